@@ -16,6 +16,18 @@ using namespace libzerocoin;
 std::map<uint32_t, CBigNum> mapAccumulatorValues;
 std::list<uint256> listAccCheckpointsNoDB;
 
+// Mints of the most recently connected blocks, keyed by height, so that calculating a checkpoint
+// does not need to read the blocks of its window back from disk
+static CCriticalSection cs_pendingMints;
+static std::map<int, std::pair<uint256, std::list<PublicCoin> > > mapPendingMints;
+// Connected blocks older than this many blocks behind the newest one can no longer be part of a checkpoint window
+static const int PENDING_MINTS_DEPTH = 30;
+
+// Witnesses of the wallet's mints, advanced as new checkpoints arrive so that a spend only needs to add the blocks
+// connected since the last update. Keyed by pubcoin hash and persisted in the zerocoin database.
+static CCriticalSection cs_witnessCache;
+static std::map<uint256, CAccumulatorWitnessData> mapWitnessCache;
+
 uint32_t ParseChecksum(uint256 nChecksum, CoinDenomination denomination)
 {
     //shift to the beginning bit of this denomination and trim any remaining bits by returning 32 bits only
@@ -180,6 +192,49 @@ bool EraseCheckpoints(int nStartHeight, int nEndHeight)
     return true;
 }
 
+void AddPendingMints(const CBlockIndex* pindex, const std::list<PublicCoin>& listPubcoins)
+{
+    LOCK(cs_pendingMints);
+    mapPendingMints[pindex->nHeight] = std::make_pair(pindex->GetBlockHash(), listPubcoins);
+
+    // forget blocks that are too deep to be accumulated again
+    mapPendingMints.erase(mapPendingMints.begin(), mapPendingMints.lower_bound(pindex->nHeight - PENDING_MINTS_DEPTH));
+}
+
+void RemovePendingMints(const CBlockIndex* pindex)
+{
+    LOCK(cs_pendingMints);
+    auto it = mapPendingMints.find(pindex->nHeight);
+    if (it != mapPendingMints.end() && it->second.first == pindex->GetBlockHash())
+        mapPendingMints.erase(it);
+}
+
+//Get the mints of a block in the active chain, from the pending queue if possible and from disk otherwise
+bool GetBlockPubcoins(const CBlockIndex* pindex, std::list<PublicCoin>& listPubcoins)
+{
+    {
+        LOCK(cs_pendingMints);
+        auto it = mapPendingMints.find(pindex->nHeight);
+        if (it != mapPendingMints.end() && it->second.first == pindex->GetBlockHash()) {
+            listPubcoins = it->second.second;
+            return true;
+        }
+    }
+
+    //blocks with no mint of any denomination need not be read at all
+    if (pindex->vMintDenominationsInBlock.empty())
+        return true;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("%s: failed to read block from disk", __func__);
+
+    if (!BlockToPubcoinList(block, listPubcoins))
+        return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
+
+    return true;
+}
+
 bool InitializeAccumulators(const int nHeight, int& nHeightCheckpoint, AccumulatorMap& mapAccumulators)
 {
     if (nHeight < Params().Zerocoin_StartHeight())
@@ -249,12 +304,8 @@ bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, Accumulat
         }
 
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk", __func__);
-
         std::list<PublicCoin> listPubcoins;
-        if (!BlockToPubcoinList(block, listPubcoins))
+        if (!GetBlockPubcoins(pindex, listPubcoins))
             return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
 
         nTotalMintsFound += listPubcoins.size();
@@ -321,13 +372,14 @@ void RandomizeSecurityLevel(int& nSecurityLevel)
 }
 
 //Compute how many coins were added to an accumulator up to the end height
-int ComputeAccumulatedCoins(int nHeightEnd, libzerocoin::CoinDenomination denom)
+int ComputeAccumulatedCoins(const CBlockIndex* pindexTip, int nHeightEnd, libzerocoin::CoinDenomination denom)
 {
-    CBlockIndex* pindex = chainActive[GetZerocoinStartHeight()];
+    //walk back through the ancestors of the tip so that the active chain does not need to be locked
+    const CBlockIndex* pindex = pindexTip->GetAncestor(nHeightEnd - 1);
     int n = 0;
-    while (pindex->nHeight < nHeightEnd) {
-        n += count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), denom);
-        pindex = chainActive.Next(pindex);
+    while (pindex && pindex->nHeight >= GetZerocoinStartHeight()) {
+        n += pindex->vMintDenominationsInBlock.count(denom);
+        pindex = pindex->pprev;
     }
 
     return n;
@@ -340,13 +392,9 @@ int AddBlockMintsToAccumulator(const libzerocoin::PublicCoin& coin, const int nH
     int nMintsAdded = 0;
     if (pindex->MintedDenomination(coin.getDenomination())) {
         //grab mints from this block
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex))
-            return error("%s: failed to read block from disk while adding pubcoins to witness", __func__);
-
         list<PublicCoin> listPubcoins;
-        if(!BlockToPubcoinList(block, listPubcoins))
-            return error("%s: failed to get zerocoin mintlist from block %n\n", __func__, pindex->nHeight);
+        if (!GetBlockPubcoins(pindex, listPubcoins))
+            return error("%s: failed to get zerocoin mintlist from block %d", __func__, pindex->nHeight);
 
         //add the mints to the witness
         for (const PublicCoin& pubcoin : listPubcoins) {
@@ -390,24 +438,13 @@ bool GetAccumulatorValue(int& nHeight, const libzerocoin::CoinDenomination denom
     return true;
 }
 
-bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator, AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, string& strError, CBlockIndex* pindexCheckpoint)
+//Find the block the mint was added in and the accumulator value that its witness starts from
+static bool InitializeWitnessData(CAccumulatorWitnessData& data)
 {
-    LogPrint("zero", "%s: generating\n", __func__);
-    int nLockAttempts = 0;
-    while (nLockAttempts < 100) {
-        TRY_LOCK(cs_main, lockMain);
-        if(!lockMain) {
-            MilliSleep(50);
-            nLockAttempts++;
-            continue;
-        }
-        break;
-    }
-    if (nLockAttempts == 100)
-        return error("%s: could not get lock on cs_main", __func__);
-    LogPrint("zero", "%s: after lock\n", __func__);
+    AssertLockHeld(cs_main);
+
     uint256 txid;
-    if (!zerocoinDB->ReadCoinMint(coin.getValue(), txid))
+    if (!zerocoinDB->ReadCoinMint(data.bnPubcoin, txid))
         return error("%s failed to read mint from db", __func__);
 
     CTransaction txMinted;
@@ -415,67 +452,291 @@ bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator
     if (!GetTransaction(txid, txMinted, hashBlock))
         return error("%s failed to read tx", __func__);
 
-    int nHeightMintAdded = mapBlockIndex[hashBlock]->nHeight;
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+        return error("%s: mint %s is not in the active chain", __func__, txid.GetHex());
+    data.nHeightMintAdded = mi->second->nHeight;
 
     //get the checkpoint added at the next multiple of 10
-    int nHeightCheckpoint = nHeightMintAdded + (10 - (nHeightMintAdded % 10));
+    int nHeightCheckpoint = data.nHeightMintAdded + (10 - (data.nHeightMintAdded % 10));
 
     //the height to start accumulating coins to add to witness
-    int nAccStartHeight = nHeightMintAdded - (nHeightMintAdded % 10);
+    data.nHeightAccStart = data.nHeightMintAdded - (data.nHeightMintAdded % 10);
 
     //Get the accumulator that is right before the cluster of blocks containing our mint was added to the accumulator
     CBigNum bnAccValue = 0;
-    if (GetAccumulatorValue(nHeightCheckpoint, coin.getDenomination(), bnAccValue)) {
-            accumulator.setValue(bnAccValue);
-            witness.resetValue(accumulator, coin);
-    }
+    if (!GetAccumulatorValue(nHeightCheckpoint, data.denom, bnAccValue))
+        return error("%s: failed to get the accumulator value before the mint", __func__);
 
-    //add the pubcoins from the blockchain up to the next checksum starting from the block
-    CBlockIndex* pindex = chainActive[nHeightCheckpoint - 10];
-    int nChainHeight = chainActive.Height();
-    int nHeightStop = nChainHeight % 10;
-    nHeightStop = nChainHeight - nHeightStop - 20; // at least two checkpoints deep
+    //the pubcoins from the blockchain are added starting from the block after the previous checkpoint
+    data.nHeightNext = nHeightCheckpoint - 10;
+    CBlockIndex* pindexLast = chainActive[data.nHeightNext - 1];
+    if (!pindexLast)
+        return error("%s: no block before height %d", __func__, data.nHeightNext);
 
-    //If looking for a specific checkpoint
-    if (pindexCheckpoint)
-        nHeightStop = pindexCheckpoint->nHeight - 10;
+    data.hashBlockLast = pindexLast->GetBlockHash();
+    data.bnWitness = bnAccValue;
+    data.nMintsAdded = 0;
+    data.nCheckpointsAdded = 0;
 
-    //Iterate through the chain and calculate the witness
-    int nCheckpointsAdded = 0;
-    nMintsAdded = 0;
-    RandomizeSecurityLevel(nSecurityLevel); //make security level not always the same and predictable
-    libzerocoin::Accumulator witnessAccumulator = accumulator;
+    // calculate how many mints of this denomination existed in the accumulator we initialized
+    data.nMintsAccumulated = ComputeAccumulatedCoins(chainActive.Tip(), data.nHeightAccStart, data.denom);
+    return true;
+}
+
+//A witness can be resumed if its last block is still on the chain and none of the blocks it covers would have
+//stopped a walk with this stop height and security level
+static bool CanResumeWitness(const CAccumulatorWitnessData& data, const CBlockIndex* pindexTip, int nHeightStop, int nSecurityLevel)
+{
+    if (data.nHeightNext <= 0 || data.nHeightNext > nHeightStop)
+        return false;
+
+    //the spend uses the accumulator parameters of the tip, a witness built in the other group is of no use. A
+    //cached witness started by GenerateAccumulatorWitness below Zerocoin_LastOldParams is dropped here.
+    if (data.fOldParams != (pindexTip->nHeight <= Params().Zerocoin_LastOldParams()))
+        return false;
+
+    const CBlockIndex* pindexLast = pindexTip->GetAncestor(data.nHeightNext - 1);
+    if (!pindexLast || pindexLast->GetBlockHash() != data.hashBlockLast)
+        return false;
+
+    return nSecurityLevel == 100 || data.nCheckpointsAdded < nSecurityLevel;
+}
+
+//Add the mints of the blocks following the witness until the stop height or the security level is reached. Only the
+//ancestors of pindexTip are used, so this does not need cs_main. pindexStop is the block the walk stopped at.
+static bool AdvanceWitnessData(CAccumulatorWitnessData& data, const CBlockIndex* pindexTip, int nHeightStop, int nSecurityLevel, const CBlockIndex*& pindexStop)
+{
+    pindexStop = nullptr;
+    libzerocoin::ZerocoinParams* params = data.fOldParams ? Params().OldZerocoin_Params() : Params().Zerocoin_Params();
+    PublicCoin coin(params, data.bnPubcoin, data.denom);
+    libzerocoin::Accumulator witnessAccumulator(params, data.denom, data.bnWitness);
+    const CBlockIndex* pindex = pindexTip->GetAncestor(data.nHeightNext);
     while (pindex) {
-        if (pindex->nHeight != nAccStartHeight && pindex->pprev->nAccumulatorCheckpoint != pindex->nAccumulatorCheckpoint)
+        // checking whether we should stop this process due to a shutdown request
+        if (ShutdownRequested())
+            return false;
+
+        int nCheckpointsAdded = data.nCheckpointsAdded;
+        if (pindex->nHeight != data.nHeightAccStart && pindex->pprev->nAccumulatorCheckpoint != pindex->nAccumulatorCheckpoint)
             ++nCheckpointsAdded;
 
-        //If the security level is satisfied, or the stop height is reached, then initialize the accumulator from here
+        //If the security level is satisfied, or the stop height is reached, then the witness is complete
         bool fSecurityLevelSatisfied = (nSecurityLevel != 100 && nCheckpointsAdded >= nSecurityLevel);
         if (pindex->nHeight >= nHeightStop || fSecurityLevelSatisfied) {
-            bnAccValue = 0;
-            uint256 nCheckpointSpend = chainActive[pindex->nHeight + 10]->nAccumulatorCheckpoint;
-            if (!GetAccumulatorValueFromDB(nCheckpointSpend, coin.getDenomination(), bnAccValue) || bnAccValue == 0)
-                return error("%s : failed to find checksum in database for accumulator", __func__);
-
-            accumulator.setValue(bnAccValue);
+            pindexStop = pindex;
             break;
         }
 
-        nMintsAdded += AddBlockMintsToAccumulator(coin, nHeightMintAdded, pindex, &witnessAccumulator, true);
-        pindex = chainActive.Next(pindex);
+        data.nMintsAdded += AddBlockMintsToAccumulator(coin, data.nHeightMintAdded, pindex, &witnessAccumulator, true);
+        data.nCheckpointsAdded = nCheckpointsAdded;
+        data.nHeightNext = pindex->nHeight + 1;
+        data.hashBlockLast = pindex->GetBlockHash();
+        pindex = (pindex == pindexTip ? nullptr : pindexTip->GetAncestor(pindex->nHeight + 1));
     }
+    data.bnWitness = witnessAccumulator.getValue();
+
+    return true;
+}
+
+//Keep a walked witness for the next spend of the coin, unless the cached one already got further
+static void StoreWitnessData(const uint256& hashPubcoin, const CAccumulatorWitnessData& data, bool fForce)
+{
+    LOCK(cs_witnessCache);
+    auto it = mapWitnessCache.find(hashPubcoin);
+    if (it == mapWitnessCache.end())
+        return;
+
+    if (!fForce && it->second.nHeightNext > data.nHeightNext)
+        return;
+
+    it->second = data;
+    if (!zerocoinDB->WriteWitnessData(hashPubcoin, data))
+        LogPrintf("%s: failed to write witness of %s\n", __func__, hashPubcoin.GetHex());
+}
+
+void AddWitnessToCache(const PublicCoin& coin)
+{
+    uint256 hashPubcoin = GetPubCoinHash(coin.getValue());
+    LOCK(cs_witnessCache);
+    if (mapWitnessCache.count(hashPubcoin))
+        return;
+
+    //the witness is started by the next UpdateWitnessCache(), once the mint is deep enough
+    CAccumulatorWitnessData data;
+    data.bnPubcoin = coin.getValue();
+    data.denom = coin.getDenomination();
+    mapWitnessCache.insert(make_pair(hashPubcoin, data));
+}
+
+bool IsWitnessCached(const uint256& hashPubcoin)
+{
+    LOCK(cs_witnessCache);
+    return mapWitnessCache.count(hashPubcoin) > 0;
+}
+
+void PruneWitnessCache(const std::set<uint256>& setHashPubcoin)
+{
+    LOCK(cs_witnessCache);
+    auto it = mapWitnessCache.begin();
+    while (it != mapWitnessCache.end()) {
+        if (setHashPubcoin.count(it->first)) {
+            ++it;
+            continue;
+        }
+
+        zerocoinDB->EraseWitnessData(it->first);
+        mapWitnessCache.erase(it++);
+    }
+}
+
+void UpdateWitnessCache()
+{
+    std::map<uint256, CAccumulatorWitnessData> mapUpdate;
+    {
+        LOCK(cs_witnessCache);
+        mapUpdate = mapWitnessCache;
+    }
+    if (mapUpdate.empty())
+        return;
+
+    //witnesses are kept two checkpoints behind the tip, like the spends that use them
+    const CBlockIndex* pindexTip;
+    int nHeightStop;
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return;
+
+        pindexTip = chainActive.Tip();
+        if (!pindexTip || pindexTip->nHeight <= Params().Zerocoin_LastOldParams())
+            return;
+
+        nHeightStop = pindexTip->nHeight - (pindexTip->nHeight % 10) - 20;
+    }
+
+    int nUpdated = 0;
+    for (auto& it : mapUpdate) {
+        CAccumulatorWitnessData& data = it.second;
+        if (data.nHeightNext == nHeightStop && CanResumeWitness(data, pindexTip, nHeightStop, 100))
+            continue;
+
+        //start over if the witness is new, its blocks were disconnected or it was built in the old parameters.
+        //The tip is past the old parameters here, so the restarted witness is in the new group SetNull leaves.
+        if (!CanResumeWitness(data, pindexTip, nHeightStop, 100)) {
+            CBigNum bnPubcoin = data.bnPubcoin;
+            libzerocoin::CoinDenomination denom = data.denom;
+            data.SetNull();
+            data.bnPubcoin = bnPubcoin;
+            data.denom = denom;
+
+            LOCK(cs_main);
+            if (!InitializeWitnessData(data))
+                continue;
+        }
+
+        const CBlockIndex* pindexStop;
+        if (!AdvanceWitnessData(data, pindexTip, nHeightStop, 100, pindexStop))
+            return;
+
+        StoreWitnessData(it.first, data, true);
+        ++nUpdated;
+    }
+
+    LogPrint("zero", "%s: advanced %d witnesses to height %d\n", __func__, nUpdated, nHeightStop);
+}
+
+bool LoadWitnessCache()
+{
+    LOCK(cs_witnessCache);
+    return zerocoinDB->LoadWitnessData(mapWitnessCache);
+}
+
+bool GenerateAccumulatorWitness(const PublicCoin &coin, Accumulator& accumulator, AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, string& strError, CBlockIndex* pindexCheckpoint)
+{
+    LogPrint("zero", "%s: generating\n", __func__);
+    uint256 hashPubcoin = GetPubCoinHash(coin.getValue());
+    CAccumulatorWitnessData data;
+    bool fCached = false;
+    {
+        LOCK(cs_witnessCache);
+        auto it = mapWitnessCache.find(hashPubcoin);
+        if (it != mapWitnessCache.end() && it->second.nHeightNext > 0) {
+            data = it->second;
+            fCached = true;
+        }
+    }
+
+    RandomizeSecurityLevel(nSecurityLevel); //make security level not always the same and predictable
+
+    //only the lookups of the tip and the mint need cs_main, the walk follows the ancestors of the tip
+    const CBlockIndex* pindexTip;
+    int nHeightStop;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        int nChainHeight = chainActive.Height();
+        nHeightStop = nChainHeight % 10;
+        nHeightStop = nChainHeight - nHeightStop - 20; // at least two checkpoints deep
+
+        //If looking for a specific checkpoint
+        if (pindexCheckpoint)
+            nHeightStop = pindexCheckpoint->nHeight - 10;
+
+        if (!fCached || !CanResumeWitness(data, pindexTip, nHeightStop, nSecurityLevel)) {
+            fCached = false;
+            data.SetNull();
+            data.bnPubcoin = coin.getValue();
+            data.denom = coin.getDenomination();
+            data.fOldParams = nChainHeight <= Params().Zerocoin_LastOldParams();
+            if (!InitializeWitnessData(data))
+                return error("%s: failed to initialize witness", __func__);
+        }
+    }
+    LogPrint("zero", "%s: %s witness at height %d\n", __func__, fCached ? "resuming" : "starting", data.nHeightNext);
+
+    //Iterate through the chain and calculate the witness
+    const CBlockIndex* pindexStop;
+    if (!AdvanceWitnessData(data, pindexTip, nHeightStop, nSecurityLevel, pindexStop))
+        return error("%s: failed to add mints to witness", __func__);
+    if (!pindexStop)
+        return error("%s: reached the chain tip before the witness was complete", __func__);
+
+    //Initialize the accumulator from the checkpoint that follows the last block of the witness
+    CBigNum bnAccValue = 0;
+    const CBlockIndex* pindexSpend = pindexTip->GetAncestor(pindexStop->nHeight + 10);
+    if (!pindexSpend || !GetAccumulatorValueFromDB(pindexSpend->nAccumulatorCheckpoint, coin.getDenomination(), bnAccValue) || bnAccValue == 0)
+        return error("%s : failed to find checksum in database for accumulator", __func__);
+    accumulator.setValue(bnAccValue);
+
+    libzerocoin::Accumulator witnessAccumulator = accumulator;
+    witnessAccumulator.setValue(data.bnWitness);
     witness.resetValue(witnessAccumulator, coin);
-    if (!witness.VerifyWitness(accumulator, coin))
+    if (!witness.VerifyWitness(accumulator, coin)) {
+        //do not resume from a cached witness that is wrong
+        if (fCached) {
+            LOCK(cs_witnessCache);
+            auto it = mapWitnessCache.find(hashPubcoin);
+            if (it != mapWitnessCache.end()) {
+                it->second.SetNull();
+                it->second.bnPubcoin = coin.getValue();
+                it->second.denom = coin.getDenomination();
+                zerocoinDB->EraseWitnessData(hashPubcoin);
+            }
+        }
         return error("%s: failed to verify witness", __func__);
+    }
+    StoreWitnessData(hashPubcoin, data, false);
 
     // A certain amount of accumulated coins are required
+    nMintsAdded = data.nMintsAdded;
     if (nMintsAdded < Params().Zerocoin_RequiredAccumulation()) {
         strError = _(strprintf("Less than %d mints added, unable to create spend", Params().Zerocoin_RequiredAccumulation()).c_str());
         return error("%s : %s", __func__, strError);
     }
 
-    // calculate how many mints of this denomination existed in the accumulator we initialized
-    nMintsAdded += ComputeAccumulatedCoins(nAccStartHeight, coin.getDenomination());
+    // add how many mints of this denomination existed in the accumulator we initialized
+    nMintsAdded += data.nMintsAccumulated;
     LogPrint("zero", "%s : %d mints added to witness\n", __func__, nMintsAdded);
 
     return true;
@@ -498,8 +759,7 @@ map<CoinDenomination, int> GetMintMaturityHeight()
         for (auto denom : libzerocoin::zerocoinDenomList) {
             //If the denom has not already had a mint added to it, then see if it has a mint added on this block
             if (mapDenomMaturity.at(denom).first < Params().Zerocoin_RequiredAccumulation()) {
-                mapDenomMaturity.at(denom).first += count(pindex->vMintDenominationsInBlock.begin(),
-                                                          pindex->vMintDenominationsInBlock.end(), denom);
+                mapDenomMaturity.at(denom).first += pindex->vMintDenominationsInBlock.count(denom);
 
                 //if mint was found then record this block as the first block that maturity occurs.
                 if (mapDenomMaturity.at(denom).first >= Params().Zerocoin_RequiredAccumulation())
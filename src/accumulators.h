@@ -15,11 +15,75 @@
 
 class CBlockIndex;
 
+/** A witness that has been accumulated up to a certain block, so that it can be resumed from there instead of
+ *  walking the chain from the mint again */
+class CAccumulatorWitnessData
+{
+public:
+    CBigNum bnPubcoin;
+    libzerocoin::CoinDenomination denom;
+    int nHeightMintAdded;
+    int nHeightAccStart; // first block of the group of ten that the mint was accumulated in
+    int nMintsAccumulated; // mints of this denomination that were in the accumulator the witness started from
+    int nHeightNext; // next block that has to be added to the witness
+    uint256 hashBlockLast; // block at nHeightNext - 1, used to notice a reorg
+    CBigNum bnWitness;
+    int nMintsAdded;
+    int nCheckpointsAdded;
+    bool fOldParams; // built in the group of the old accumulator parameters, used while the tip is at or below Zerocoin_LastOldParams
+
+    CAccumulatorWitnessData()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        bnPubcoin = 0;
+        denom = libzerocoin::ZQ_ERROR;
+        nHeightMintAdded = 0;
+        nHeightAccStart = 0;
+        nMintsAccumulated = 0;
+        nHeightNext = 0;
+        hashBlockLast = 0;
+        bnWitness = 0;
+        nMintsAdded = 0;
+        nCheckpointsAdded = 0;
+        fOldParams = false;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(bnPubcoin);
+        READWRITE(denom);
+        READWRITE(nHeightMintAdded);
+        READWRITE(nHeightAccStart);
+        READWRITE(nMintsAccumulated);
+        READWRITE(nHeightNext);
+        READWRITE(hashBlockLast);
+        READWRITE(bnWitness);
+        READWRITE(nMintsAdded);
+        READWRITE(nCheckpointsAdded);
+        READWRITE(fOldParams);
+    }
+};
+
 std::map<libzerocoin::CoinDenomination, int> GetMintMaturityHeight();
 bool GenerateAccumulatorWitness(const libzerocoin::PublicCoin &coin, libzerocoin::Accumulator& accumulator, libzerocoin::AccumulatorWitness& witness, int nSecurityLevel, int& nMintsAdded, std::string& strError, CBlockIndex* pindexCheckpoint = nullptr);
 bool GetAccumulatorValueFromDB(uint256 nCheckpoint, libzerocoin::CoinDenomination denom, CBigNum& bnAccValue);
 bool GetAccumulatorValueFromChecksum(uint32_t nChecksum, bool fMemoryOnly, CBigNum& bnAccValue);
 void AddAccumulatorChecksum(const uint32_t nChecksum, const CBigNum &bnValue, bool fMemoryOnly);
+void AddPendingMints(const CBlockIndex* pindex, const std::list<libzerocoin::PublicCoin>& listPubcoins);
+void RemovePendingMints(const CBlockIndex* pindex);
+bool GetBlockPubcoins(const CBlockIndex* pindex, std::list<libzerocoin::PublicCoin>& listPubcoins);
+void AddWitnessToCache(const libzerocoin::PublicCoin& coin);
+bool IsWitnessCached(const uint256& hashPubcoin);
+void PruneWitnessCache(const std::set<uint256>& setHashPubcoin);
+void UpdateWitnessCache();
+bool LoadWitnessCache();
 bool CalculateAccumulatorCheckpoint(int nHeight, uint256& nCheckpoint, AccumulatorMap& mapAccumulators);
 bool ValidateAccumulatorCheckpoint(const CBlock& block, CBlockIndex* pindex, AccumulatorMap& mapAccumulators);
 void DatabaseChecksums(AccumulatorMap& mapAccumulators);
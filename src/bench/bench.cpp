@@ -0,0 +1,97 @@
+// Copyright (c) 2015-2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <iostream>
+#include <limits>
+
+benchmark::BenchRunner::BenchmarkMap& benchmark::BenchRunner::benchmarks()
+{
+    static std::map<std::string, benchmark::BenchFunction> benchmarks_map;
+    return benchmarks_map;
+}
+
+benchmark::BenchRunner::BenchRunner(const std::string& name, benchmark::BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
+}
+
+void benchmark::BenchRunner::ListAll()
+{
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it)
+        std::cout << it->first << std::endl;
+}
+
+void benchmark::BenchRunner::RunAll(const std::string& strFilter, double nSeconds)
+{
+    std::cout << "# Benchmark,count,min,max,average" << std::endl;
+
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it) {
+        if (it->first.find(strFilter) == std::string::npos)
+            continue;
+        State state(it->first, (int64_t)(nSeconds * 1000000));
+        it->second(state);
+        std::cout << strprintf("%s,%d,%g,%g,%g", state.GetName(), state.GetCount(),
+                         state.GetMinTime(), state.GetMaxTime(), state.GetAverageTime())
+                  << std::endl;
+    }
+}
+
+benchmark::State::State(const std::string& nameIn, int64_t nMaxElapsedIn) : name(nameIn), nMaxElapsed(nMaxElapsedIn)
+{
+    nBeginTime = nLastTime = 0;
+    dMinTime = std::numeric_limits<double>::max();
+    dMaxTime = 0;
+    nCount = 0;
+    nBatchSize = 1;
+    nBatchEnd = 0;
+}
+
+bool benchmark::State::KeepRunning()
+{
+    if (nCount < nBatchEnd) {
+        ++nCount;
+        return true;
+    }
+
+    int64_t nNow = GetTimeMicros();
+    if (nCount == 0) {
+        nBeginTime = nNow;
+    } else {
+        int64_t nElapsed = nNow - nLastTime;
+        double dElapsedOne = nElapsed * 0.000001 / nBatchSize;
+        if (nElapsed * 128 < nMaxElapsed) {
+            // Far too short to time reliably: make the batches 8 times larger and
+            // forget the timings so far, which are mostly clock resolution
+            nBatchSize *= 8;
+            dMinTime = std::numeric_limits<double>::max();
+            dMaxTime = 0;
+        } else {
+            dMinTime = std::min(dMinTime, dElapsedOne);
+            dMaxTime = std::max(dMaxTime, dElapsedOne);
+            if (nElapsed * 16 < nMaxElapsed)
+                nBatchSize *= 2;
+        }
+    }
+    nLastTime = nNow;
+
+    if (nCount > 0 && nNow - nBeginTime >= nMaxElapsed)
+        return false;
+
+    nBatchEnd = nCount + nBatchSize;
+    ++nCount;
+    return true;
+}
+
+double benchmark::State::GetAverageTime() const
+{
+    if (nCount == 0)
+        return 0;
+    return (nLastTime - nBeginTime) * 0.000001 / nCount;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2015-2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/**
+ * Minimal micro-benchmark framework for bench_beetok.
+ *
+ * A benchmark is a function that does its setup, then repeats the code to
+ * be measured for as long as State::KeepRunning() returns true:
+ *
+ *     static void CodeToTime(benchmark::State& state)
+ *     {
+ *         ... setup ...
+ *         while (state.KeepRunning()) {
+ *             ... code to time ...
+ *         }
+ *     }
+ *     BENCHMARK(CodeToTime);
+ *
+ * Iterations are timed in batches that grow until a batch takes long enough
+ * for the clock to resolve it, so fast code is not dominated by timer
+ * overhead. Each benchmark runs for about the configured time and reports the
+ * fastest, slowest and average batch per iteration.
+ */
+namespace benchmark
+{
+class State
+{
+private:
+    std::string name;
+    int64_t nMaxElapsed;
+    int64_t nBeginTime;
+    int64_t nLastTime;
+    double dMinTime;
+    double dMaxTime;
+    uint64_t nCount;
+    uint64_t nBatchSize;
+    //! Value of nCount at which the current batch is done
+    uint64_t nBatchEnd;
+
+public:
+    /** nMaxElapsedIn is the time to keep running for, in microseconds */
+    State(const std::string& nameIn, int64_t nMaxElapsedIn);
+
+    bool KeepRunning();
+
+    const std::string& GetName() const { return name; }
+    uint64_t GetCount() const { return nCount; }
+    /** Seconds per iteration of the fastest and slowest batch, and on average */
+    double GetMinTime() const { return dMaxTime > 0 ? dMinTime : 0; }
+    double GetMaxTime() const { return dMaxTime; }
+    double GetAverageTime() const;
+};
+
+typedef boost::function<void(State&)> BenchFunction;
+
+class BenchRunner
+{
+private:
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& benchmarks();
+
+public:
+    BenchRunner(const std::string& name, BenchFunction func);
+
+    /** Print the names of all benchmarks, one per line */
+    static void ListAll();
+
+    /**
+     * Run the benchmarks whose name contains strFilter for about nSeconds
+     * each, printing one CSV line per benchmark after a header line.
+     */
+    static void RunAll(const std::string& strFilter, double nSeconds);
+};
+}
+
+// BENCHMARK(foo) registers foo under the name "foo"
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
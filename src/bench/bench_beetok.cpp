@@ -0,0 +1,47 @@
+// Copyright (c) 2015-2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#include <iostream>
+
+int main(int argc, char** argv)
+{
+    SetupEnvironment();
+    ParseParameters(argc, argv);
+
+    if (mapArgs.count("-?") || mapArgs.count("-h") || mapArgs.count("-help")) {
+        std::cout << "Usage: bench_beetok [options]\n\n"
+                  << "Runs the benchmarks and prints one CSV line per benchmark: name, number of\n"
+                  << "iterations, and the fastest, slowest and average seconds per iteration.\n\n"
+                  << "Options:\n"
+                  << "  -filter=<text>   Only run the benchmarks whose name contains <text>\n"
+                  << "  -time=<n>        Seconds to run each benchmark for (default: 1)\n"
+                  << "  -list            List the benchmarks and exit\n";
+        return 0;
+    }
+
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+    SelectParams(CBaseChainParams::REGTEST);
+    // The signature and script execution caches are left unsized, so nothing a
+    // benchmark verifies is remembered by its next iteration
+
+    if (GetBoolArg("-list", false)) {
+        benchmark::BenchRunner::ListAll();
+        return 0;
+    }
+
+    double nSeconds = atof(GetArg("-time", "1").c_str());
+    if (nSeconds <= 0) {
+        std::cerr << "Error: -time must be positive" << std::endl;
+        return 1;
+    }
+    benchmark::BenchRunner::RunAll(GetArg("-filter", ""), nSeconds);
+    return 0;
+}
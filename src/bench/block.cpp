@@ -0,0 +1,144 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "timedata.h"
+
+#include <vector>
+
+namespace
+{
+const int BLOCK_TX_COUNT = 1000;
+
+/**
+ * A proof-of-work block at height 1 holding a coinbase and BLOCK_TX_COUNT
+ * signed pay-to-pubkey-hash spends, with the coins it spends and a previous
+ * block index for ConnectBlock to find. The tree ships no block data, so the
+ * block is built in code; it is built once and shared by the benchmarks.
+ */
+struct BlockFixture {
+    CBlock block;
+    std::vector<char> vBlockData;
+    CCoinsView viewDummy;
+    CCoinsViewCache viewInputs;
+    uint256 hashPrev;
+    CBlockIndex indexPrev;
+
+    BlockFixture() : viewInputs(&viewDummy), hashPrev(uint256(1))
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CBasicKeyStore keystore;
+        keystore.AddKey(key);
+        const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        CMutableTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+        txCoinbase.vout.resize(1);
+        txCoinbase.vout[0].scriptPubKey = scriptPubKey;
+        txCoinbase.vout[0].nValue = BLOCK_TX_COUNT * 1000LL;
+        block.vtx.push_back(txCoinbase);
+
+        for (int i = 0; i < BLOCK_TX_COUNT; i++) {
+            const uint256 txidFrom = uint256(i + 1);
+            viewInputs.AddCoin(COutPoint(txidFrom, 0), Coin(CTxOut(COIN, scriptPubKey), 0, false, false), false);
+
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(txidFrom, 0);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = COIN - 1000LL;
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            bool fSigned = SignSignature(keystore, scriptPubKey, tx, 0, COIN, SIGHASH_ALL);
+            assert(fSigned);
+            block.vtx.push_back(tx);
+        }
+        viewInputs.SetBestBlock(hashPrev);
+
+        block.nVersion = CBlockHeader::CURRENT_VERSION;
+        block.hashPrevBlock = hashPrev;
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = GetAdjustedTime();
+        block.nBits = Params().ProofOfWorkLimit().GetCompact();
+        while (!CheckProofOfWork(block.GetHash(), block.nBits))
+            block.nNonce++;
+
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        vBlockData.assign(ssBlock.begin(), ssBlock.end());
+
+        // CheckInputs looks the spend height up from the view's best block
+        indexPrev.phashBlock = &hashPrev;
+        indexPrev.nVersion = block.nVersion;
+        LOCK(cs_main);
+        mapBlockIndex.insert(std::make_pair(hashPrev, &indexPrev));
+    }
+};
+
+BlockFixture& GetFixture()
+{
+    static BlockFixture fixture;
+    return fixture;
+}
+}
+
+static void DeserializeBlock(benchmark::State& state)
+{
+    const BlockFixture& fixture = GetFixture();
+    while (state.KeepRunning()) {
+        CDataStream stream(fixture.vBlockData, SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        stream >> block;
+    }
+}
+
+/** Context-free checks: proof of work, merkle root, size and sigop limits */
+static void CheckBlockContextFree(benchmark::State& state)
+{
+    const BlockFixture& fixture = GetFixture();
+    while (state.KeepRunning()) {
+        CValidationState validationState;
+        bool fValid = CheckBlock(fixture.block, validationState);
+        assert(fValid);
+    }
+}
+
+/**
+ * Connect the block to a fresh view over its inputs with fJustCheck, which
+ * runs every input script but writes nothing out. The benchmarks run
+ * without signature or script execution caches, so each pass verifies all
+ * the signatures.
+ */
+static void ConnectBlockJustCheck(benchmark::State& state)
+{
+    BlockFixture& fixture = GetFixture();
+    const uint256 hashBlock = fixture.block.GetHash();
+    CBlockIndex index(fixture.block);
+    index.phashBlock = &hashBlock;
+    index.pprev = &fixture.indexPrev;
+    index.nHeight = 1;
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&fixture.viewInputs);
+        CValidationState validationState;
+        bool fValid = ConnectBlock(fixture.block, validationState, &index, view, true, true);
+        assert(fValid);
+    }
+}
+
+BENCHMARK(DeserializeBlock);
+BENCHMARK(CheckBlockContextFree);
+BENCHMARK(ConnectBlockJustCheck);
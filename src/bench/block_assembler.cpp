@@ -0,0 +1,66 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "main.h"
+#include "miner.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+static CMutableTransaction SpendTx(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11 << std::vector<unsigned char>(180, 0);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+/**
+ * Assemble a template from a mempool of 10000 transactions of about 250
+ * bytes, a quarter of them unrelated and the rest in chains of up to 25, so
+ * that only part of the pool fits the block. Both the priority and the
+ * package part of the block are filled.
+ */
+static void AssembleBlock(benchmark::State& state)
+{
+    const int nHeight = 1000;
+    const int nTxCount = 10000;
+    CTxMemPool pool(CFeeRate(0));
+
+    COutPoint prevout;
+    int nChainLength = 0;
+    for (int i = 0; i < nTxCount; i++) {
+        if (i < nTxCount / 4 || nChainLength == 25) {
+            prevout = COutPoint(uint256(i + 1), 0);
+            nChainLength = 0;
+        }
+        CMutableTransaction tx = SpendTx(prevout, 1000000LL - nChainLength);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000LL + (i * 7919) % 50000, GetTime(), 1e6 * (i % 100), nHeight - 1));
+        prevout = COutPoint(tx.GetHash(), 0);
+        nChainLength++;
+    }
+
+    LOCK2(cs_main, pool.cs);
+    while (state.KeepRunning()) {
+        CBlockTemplate blocktemplate;
+        CMutableTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vout.resize(1);
+        blocktemplate.block.vtx.push_back(txCoinbase);
+        blocktemplate.vTxFees.push_back(-1);
+        blocktemplate.vTxSigOpsCost.push_back(-1);
+
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+        assert(assembler.GetBlockTx() > 0);
+    }
+}
+
+BENCHMARK(AssembleBlock);
@@ -0,0 +1,103 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/filesystem.hpp>
+
+/**
+ * An in-memory block tree holding 50000 proof-of-stake headers, written the
+ * way ConnectBlock stores them. Only the path of the database is taken from
+ * the data directory, which is a temporary one.
+ */
+class BlockIndexFixture
+{
+public:
+    boost::filesystem::path pathTemp;
+    CBlockTreeDB* pdb;
+
+    BlockIndexFixture()
+    {
+        pathTemp = GetTempPath() / strprintf("bench_beetok_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+        pdb = new CBlockTreeDB(1 << 26, true);
+
+        CBlockIndex index;
+        uint256 hashPrev;
+        for (int i = 0; i < 50000; i++) {
+            index.nHeight = 1000 + i;
+            index.nVersion = 4;
+            index.nTime = 1500000000 + 60 * i;
+            index.nBits = Params().ProofOfWorkLimit().GetCompact();
+            index.nNonce = i;
+            index.hashMerkleRoot = uint256(i + 1);
+            index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+            index.nTx = 2;
+            index.SetProofOfStake();
+            index.prevoutStake = COutPoint(uint256(i + 1), 1);
+            index.nStakeTime = index.nTime;
+            CDiskBlockIndex diskindex(&index);
+            diskindex.hashPrev = hashPrev;
+            bool fWritten = pdb->WriteBlockIndex(diskindex);
+            assert(fWritten);
+            hashPrev = diskindex.GetBlockHash();
+        }
+    }
+
+    ~BlockIndexFixture()
+    {
+        delete pdb;
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+static void UnloadBenchBlockIndex()
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it)
+        delete it->second;
+    mapBlockIndex.clear();
+    setStakeSeen.clear();
+}
+
+/** LoadBlockIndexGuts with nThreads decoding threads, 1 for the serial path */
+static void LoadBlockIndex(benchmark::State& state, int nThreads)
+{
+    BlockIndexFixture fixture;
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    nScriptCheckThreads = nThreads;
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        bool fLoaded = fixture.pdb->LoadBlockIndexGuts();
+        assert(fLoaded);
+        UnloadBenchBlockIndex();
+    }
+
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+}
+
+static void LoadBlockIndexSerial(benchmark::State& state)
+{
+    LoadBlockIndex(state, 0);
+}
+
+static void LoadBlockIndexSharded(benchmark::State& state)
+{
+    LoadBlockIndex(state, 4);
+}
+
+BENCHMARK(LoadBlockIndexSerial);
+BENCHMARK(LoadBlockIndexSharded);
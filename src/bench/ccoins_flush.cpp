@@ -0,0 +1,37 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "script/standard.h"
+
+/**
+ * Add the outputs of a block's worth of transactions in a child cache and
+ * flush them into the cache below it, as ConnectBlock's view is flushed into
+ * pcoinsTip. After the first pass every outpoint is already in the parent, so
+ * each flush overwrites the parent's coins.
+ */
+static void CCoinsCacheFlush(benchmark::State& state)
+{
+    const int nTxCount = 2000;
+    CCoinsView viewDummy;
+    CCoinsViewCache viewTip(&viewDummy);
+    const CScript scriptPubKey = GetScriptForDestination(CKeyID(uint160()));
+
+    int nHeight = 1;
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&viewTip);
+        for (int i = 0; i < nTxCount; i++) {
+            const uint256 txid(i + 1);
+            view.AddCoin(COutPoint(txid, 0), Coin(CTxOut(50 * COIN, scriptPubKey), nHeight, false, false), true);
+            view.AddCoin(COutPoint(txid, 1), Coin(CTxOut(nHeight, scriptPubKey), nHeight, false, false), true);
+        }
+        view.SetBestBlock(uint256(nHeight));
+        view.Flush();
+        nHeight++;
+    }
+}
+
+BENCHMARK(CCoinsCacheFlush);
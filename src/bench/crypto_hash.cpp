@@ -0,0 +1,47 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "uint256.h"
+
+#include <vector>
+
+/* Proof-of-work hash of a version 3 block header */
+static void HashQuark_80b(benchmark::State& state)
+{
+    uint256 hash;
+    std::vector<unsigned char> in(80, 0);
+    while (state.KeepRunning()) {
+        hash = HashQuark(in.begin(), in.end());
+        memcpy(&in[0], hash.begin(), 32);
+    }
+}
+
+/* Transaction ids, merkle nodes and version 4 block headers */
+static void SHA256D_32b(benchmark::State& state)
+{
+    uint256 hash;
+    std::vector<unsigned char> in(32, 0);
+    while (state.KeepRunning()) {
+        hash = Hash(in.begin(), in.end());
+        memcpy(&in[0], hash.begin(), 32);
+    }
+}
+
+static void SHA256D_1MB(benchmark::State& state)
+{
+    uint256 hash;
+    std::vector<unsigned char> in(1000000, 0);
+    while (state.KeepRunning()) {
+        hash = Hash(in.begin(), in.end());
+        memcpy(&in[0], hash.begin(), 32);
+    }
+}
+
+BENCHMARK(HashQuark_80b);
+BENCHMARK(SHA256D_32b);
+BENCHMARK(SHA256D_1MB);
@@ -0,0 +1,126 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chain.h"
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+
+#include <vector>
+
+/**
+ * A kernel for a coin from a block outside the active chain, so SetKernel
+ * needs no chain. The target is 1, which no hash meets, so every search
+ * tries all its timestamps as a staker that does not find a block does.
+ */
+static bool SetBenchKernel(CStakeKernel& kernel, CBlockIndex& indexFrom)
+{
+    indexFrom.nHeight = 1;
+    indexFrom.nTime = 1500000000;
+    return kernel.SetKernel(0x03000001, &indexFrom, COutPoint(uint256(1), 0), 1000 * COIN);
+}
+
+/** The staker's search over a minute of hash drift */
+static void StakeKernelSearch(benchmark::State& state)
+{
+    CBlockIndex indexFrom;
+    CStakeKernel kernel;
+    bool fSet = SetBenchKernel(kernel, indexFrom);
+    assert(fSet);
+
+    unsigned int nTime = indexFrom.nTime + 3600;
+    uint256 hashProofOfStake;
+    while (state.KeepRunning()) {
+        unsigned int nTimeTx = nTime;
+        bool fHit = kernel.Search(nTimeTx, 60, hashProofOfStake);
+        assert(!fHit);
+        nTime += 60;
+    }
+}
+
+/** Checking the kernel of a received block: one timestamp */
+static void StakeKernelCheck(benchmark::State& state)
+{
+    CBlockIndex indexFrom;
+    CStakeKernel kernel;
+    bool fSet = SetBenchKernel(kernel, indexFrom);
+    assert(fSet);
+
+    unsigned int nTimeTx = indexFrom.nTime + 3600;
+    while (state.KeepRunning()) {
+        bool fHit = kernel.Hit(kernel.GetHash(nTimeTx));
+        assert(!fHit);
+        nTimeTx++;
+    }
+}
+
+/**
+ * A synthetic active chain of 100000 blocks with jittered times, a third of
+ * them generating a stake modifier. Built once and kept for the process,
+ * since the kernel modifier index keeps pointing into it.
+ */
+static std::vector<CBlockIndex>& GetModifierChain()
+{
+    static std::vector<CBlockIndex> vBlocks;
+    if (vBlocks.empty()) {
+        vBlocks.resize(100000);
+        unsigned int nTime = 1500000000;
+        for (size_t i = 0; i < vBlocks.size(); i++) {
+            CBlockIndex& block = vBlocks[i];
+            block.pprev = i ? &vBlocks[i - 1] : NULL;
+            block.nHeight = i;
+            nTime += 90 - insecure_rand() % 100;
+            block.nTime = nTime;
+            block.SetStakeModifier(((uint64_t)insecure_rand() << 32) | insecure_rand(), insecure_rand() % 3 == 0);
+            block.BuildSkip();
+        }
+    }
+    return vBlocks;
+}
+
+/**
+ * The modifier of a coin from a random height of the active chain. With
+ * fIndexed the block itself is passed and the height index answers; otherwise
+ * a copy that is not part of chainActive is passed, which walks forward
+ * through the chain as every lookup did before the index.
+ */
+static void KernelStakeModifier(benchmark::State& state, bool fIndexed)
+{
+    LOCK(cs_main);
+    std::vector<CBlockIndex>& vBlocks = GetModifierChain();
+    chainActive.SetTip(&vBlocks.back());
+
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+    // Bring the index up to the chain before timing
+    GetKernelStakeModifier(&vBlocks[0], nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+
+    const size_t nHeights = vBlocks.size() - 1000;
+    while (state.KeepRunning()) {
+        const CBlockIndex& block = vBlocks[insecure_rand() % nHeights];
+        CBlockIndex indexCopy(block);
+        bool fFound = GetKernelStakeModifier(fIndexed ? &block : &indexCopy, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+        assert(fFound);
+    }
+
+    chainActive.SetTip(NULL);
+}
+
+static void KernelStakeModifierWalk(benchmark::State& state)
+{
+    KernelStakeModifier(state, false);
+}
+
+static void KernelStakeModifierIndex(benchmark::State& state)
+{
+    KernelStakeModifier(state, true);
+}
+
+BENCHMARK(StakeKernelSearch);
+BENCHMARK(StakeKernelCheck);
+BENCHMARK(KernelStakeModifierWalk);
+BENCHMARK(KernelStakeModifierIndex);
@@ -0,0 +1,85 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "net.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+
+/**
+ * One round of ThreadSocketHandler's socket waiting against nPeers connected
+ * peers, of which a few send something each round: the peers are stand-ins
+ * on the far end of socket pairs, and the handler side only drains what
+ * arrived. This is the per-round cost that grows with the number of mostly
+ * idle connections a seed or masternode keeps.
+ */
+static void SocketEventsRound(benchmark::State& state, bool fUseEpoll, int nPeers)
+{
+    const int nActivePerRound = 8;
+    RaiseFileDescriptorLimit(2 * nPeers + 64);
+
+    std::vector<CNode*> vNodesBench;
+    std::vector<SOCKET> vPeers;
+    for (int i = 0; i < nPeers; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            break;
+        SOCKET hSocket = sv[0];
+        SetSocketNonBlocking(hSocket, true);
+        if (!fUseEpoll && !IsSelectableSocket(hSocket)) {
+            close(sv[0]);
+            close(sv[1]);
+            break;
+        }
+        vNodesBench.push_back(new CNode(hSocket, CAddress(), "peer", true));
+        vPeers.push_back(sv[1]);
+    }
+
+    CSocketEvents events(fUseEpoll);
+    const std::vector<SOCKET> vListen;
+    const char chPing = 0;
+    char pchBuf[0x10000];
+    size_t nNext = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < nActivePerRound && !vPeers.empty(); i++) {
+            send(vPeers[nNext], &chPing, 1, MSG_DONTWAIT);
+            nNext = (nNext + 1) % vPeers.size();
+        }
+
+        events.Wait(vListen, vNodesBench, 50);
+        for (size_t i = 0; i < vNodesBench.size(); i++) {
+            CNode* pnode = vNodesBench[i];
+            if (!pnode->fSocketRecvReady)
+                continue;
+            int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes < (int)sizeof(pchBuf))
+                events.RecvBlocked(pnode);
+        }
+    }
+
+    for (size_t i = 0; i < vNodesBench.size(); i++) {
+        delete vNodesBench[i];
+        close(vPeers[i]);
+    }
+}
+
+static void SocketEventsSelect_100(benchmark::State& state) { SocketEventsRound(state, false, 100); }
+static void SocketEventsSelect_450(benchmark::State& state) { SocketEventsRound(state, false, 450); }
+#ifdef HAVE_SYS_EPOLL_H
+static void SocketEventsEpoll_100(benchmark::State& state) { SocketEventsRound(state, true, 100); }
+static void SocketEventsEpoll_450(benchmark::State& state) { SocketEventsRound(state, true, 450); }
+static void SocketEventsEpoll_2000(benchmark::State& state) { SocketEventsRound(state, true, 2000); }
+#endif
+
+BENCHMARK(SocketEventsSelect_100);
+BENCHMARK(SocketEventsSelect_450);
+#ifdef HAVE_SYS_EPOLL_H
+BENCHMARK(SocketEventsEpoll_100);
+BENCHMARK(SocketEventsEpoll_450);
+BENCHMARK(SocketEventsEpoll_2000);
+#endif
+#endif // WIN32
@@ -0,0 +1,85 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "accumulators.h"
+#include "chainparams.h"
+#include "libzerocoin/CoinSpend.h"
+
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+using namespace libzerocoin;
+
+namespace
+{
+const int COINS_TO_ACCUMULATE = 10;
+
+/**
+ * Minted coins, the accumulator holding them and a spend of the first coin.
+ * Minting and proving take seconds, so it is built once and shared by the
+ * benchmarks below.
+ */
+struct ZerocoinFixture {
+    std::vector<boost::shared_ptr<PrivateCoin> > vCoins;
+    Accumulator acc;
+    boost::shared_ptr<CoinSpend> spend;
+
+    ZerocoinFixture() : acc(Params().Zerocoin_Params(), CoinDenomination::ZQ_ONE)
+    {
+        const ZerocoinParams* params = Params().Zerocoin_Params();
+        for (int i = 0; i < COINS_TO_ACCUMULATE; i++) {
+            vCoins.push_back(boost::shared_ptr<PrivateCoin>(new PrivateCoin(params, CoinDenomination::ZQ_ONE)));
+            acc += vCoins.back()->getPublicCoin();
+        }
+
+        Accumulator accEmpty(params, CoinDenomination::ZQ_ONE);
+        AccumulatorWitness witness(params, accEmpty, vCoins[0]->getPublicCoin());
+        for (int i = 0; i < COINS_TO_ACCUMULATE; i++)
+            witness += vCoins[i]->getPublicCoin();
+        spend.reset(new CoinSpend(params, params, *vCoins[0], acc, GetChecksum(acc.getValue()),
+            witness, uint256(1), SpendType::SPEND));
+    }
+};
+
+const ZerocoinFixture& GetFixture()
+{
+    static ZerocoinFixture fixture;
+    return fixture;
+}
+}
+
+static void CoinSpendVerify(benchmark::State& state)
+{
+    const ZerocoinFixture& fixture = GetFixture();
+    while (state.KeepRunning()) {
+        bool fValid = fixture.spend->Verify(fixture.acc);
+        assert(fValid);
+    }
+}
+
+static void CoinSpendVerifyPrecomputed(benchmark::State& state)
+{
+    const ZerocoinFixture& fixture = GetFixture();
+    while (state.KeepRunning()) {
+        bool fValid = fixture.spend->Verify(fixture.acc, true);
+        assert(fValid);
+    }
+}
+
+static void AccumulatorAccumulate(benchmark::State& state)
+{
+    const ZerocoinFixture& fixture = GetFixture();
+    Accumulator acc(Params().Zerocoin_Params(), CoinDenomination::ZQ_ONE);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        acc += fixture.vCoins[i % fixture.vCoins.size()]->getPublicCoin();
+        i++;
+    }
+}
+
+BENCHMARK(CoinSpendVerify);
+BENCHMARK(CoinSpendVerifyPrecomputed);
+BENCHMARK(AccumulatorAccumulate);
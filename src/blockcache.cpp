@@ -0,0 +1,156 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockReadCache blockreadcache;
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef WIN32
+    if (pdata)
+        munmap((void*)pdata, nSize);
+#endif
+}
+
+void CBlockReadCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    while (nSize > nMaxSize && !listBlocks.empty()) {
+        std::map<PosKey, std::pair<BlockList::iterator, size_t> >::iterator it = mapBlocks.find(listBlocks.back().first);
+        nSize -= it->second.second;
+        mapBlocks.erase(it);
+        listBlocks.pop_back();
+    }
+}
+
+std::shared_ptr<const CBlock> CBlockReadCache::Get(const CDiskBlockPos& pos)
+{
+    LOCK(cs);
+    std::map<PosKey, std::pair<BlockList::iterator, size_t> >::iterator it = mapBlocks.find(Key(pos));
+    if (it == mapBlocks.end())
+        return std::shared_ptr<const CBlock>();
+    listBlocks.splice(listBlocks.begin(), listBlocks, it->second.first);
+    return it->second.first->second;
+}
+
+void CBlockReadCache::Insert(const CDiskBlockPos& pos, const std::shared_ptr<const CBlock>& pblock, size_t nBlockSize)
+{
+    LOCK(cs);
+    if (nBlockSize > nMaxSize || mapBlocks.count(Key(pos)))
+        return;
+    while (nSize + nBlockSize > nMaxSize && !listBlocks.empty()) {
+        std::map<PosKey, std::pair<BlockList::iterator, size_t> >::iterator it = mapBlocks.find(listBlocks.back().first);
+        nSize -= it->second.second;
+        mapBlocks.erase(it);
+        listBlocks.pop_back();
+    }
+    listBlocks.push_front(std::make_pair(Key(pos), pblock));
+    mapBlocks[Key(pos)] = std::make_pair(listBlocks.begin(), nBlockSize);
+    nSize += nBlockSize;
+}
+
+std::shared_ptr<const CBlockFileMapping> CBlockReadCache::MapFile(int nFile, size_t nEnd)
+{
+#ifdef WIN32
+    return std::shared_ptr<const CBlockFileMapping>();
+#else
+    LOCK(cs_files);
+    for (std::list<std::pair<int, std::shared_ptr<const CBlockFileMapping> > >::iterator it = listMappings.begin(); it != listMappings.end(); it++) {
+        if (it->first != nFile)
+            continue;
+        if (it->second->size() >= nEnd) {
+            listMappings.splice(listMappings.begin(), listMappings, it);
+            return listMappings.front().second;
+        }
+        // The file has grown since it was mapped; readers still holding the old mapping keep it alive
+        listMappings.erase(it);
+        break;
+    }
+
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::shared_ptr<const CBlockFileMapping>();
+    struct stat st;
+    void* pdata = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= nEnd && st.st_size > 0)
+        pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pdata == MAP_FAILED) {
+        LogPrint("db", "%s : unable to map %s\n", __func__, path.string());
+        return std::shared_ptr<const CBlockFileMapping>();
+    }
+
+    std::shared_ptr<const CBlockFileMapping> mapping(new CBlockFileMapping((const char*)pdata, st.st_size));
+    listMappings.push_front(std::make_pair(nFile, mapping));
+    if (listMappings.size() > MAX_MAPPED_BLOCK_FILES)
+        listMappings.pop_back();
+    return mapping;
+#endif
+}
+
+bool CBlockReadCache::ReadFromMappedFile(const CDiskBlockPos& pos, CBlock& block, unsigned int& nBlockSize)
+{
+    // Blocks are stored as message start, serialized size and block, with pos pointing at the block
+    const size_t nHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    if (pos.nPos < nHeaderSize)
+        return false;
+    std::shared_ptr<const CBlockFileMapping> mapping = MapFile(pos.nFile, pos.nPos);
+    if (!mapping)
+        return false;
+
+    const char* pstart = mapping->data() + pos.nPos;
+    if (memcmp(pstart - nHeaderSize, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        throw std::ios_base::failure("CBlockReadCache::ReadFromMappedFile : message start mismatch");
+    nBlockSize = ReadLE32((const unsigned char*)pstart - sizeof(uint32_t));
+    if (pos.nPos + (size_t)nBlockSize > mapping->size()) {
+        mapping = MapFile(pos.nFile, pos.nPos + (size_t)nBlockSize);
+        if (!mapping)
+            return false;
+        pstart = mapping->data() + pos.nPos;
+    }
+
+    CMemoryReader reader(pstart, pstart + nBlockSize, SER_DISK, CLIENT_VERSION);
+    reader >> block;
+    return true;
+}
+
+void CBlockReadCache::UnmapFile(int nFile)
+{
+    LOCK(cs_files);
+    for (std::list<std::pair<int, std::shared_ptr<const CBlockFileMapping> > >::iterator it = listMappings.begin(); it != listMappings.end();) {
+        if (it->first == nFile)
+            it = listMappings.erase(it);
+        else
+            it++;
+    }
+}
+
+void CBlockReadCache::Clear()
+{
+    {
+        LOCK(cs);
+        listBlocks.clear();
+        mapBlocks.clear();
+        nSize = 0;
+    }
+    LOCK(cs_files);
+    listMappings.clear();
+}
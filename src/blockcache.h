@@ -0,0 +1,100 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "chain.h"
+#include "primitives/block.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <memory>
+
+/** Default for -blockcachesize, the serialized size of the blocks kept in the block read cache in MiB */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 32;
+/** Number of block files kept memory-mapped at the same time */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 32;
+
+/** A read-only memory mapping of a whole blk?????.dat file */
+class CBlockFileMapping
+{
+private:
+    // Disallow copies
+    CBlockFileMapping(const CBlockFileMapping&);
+    CBlockFileMapping& operator=(const CBlockFileMapping&);
+
+    const char* pdata;
+    size_t nSize;
+
+public:
+    CBlockFileMapping(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CBlockFileMapping();
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Shared read path for blocks stored in block files. Files are memory-mapped
+ * instead of opened for every read, and recently read blocks are kept
+ * deserialized in an LRU cache, bounded by their serialized size.
+ *
+ * Only blocks whose hash was checked against the block index are inserted, so
+ * a cache hit needs no further verification.
+ */
+class CBlockReadCache
+{
+private:
+    typedef std::pair<int, unsigned int> PosKey;
+    typedef std::list<std::pair<PosKey, std::shared_ptr<const CBlock> > > BlockList;
+
+    mutable CCriticalSection cs;
+    size_t nMaxSize;
+    size_t nSize;
+    // Most recently used first, with the serialized size of each block
+    BlockList listBlocks;
+    std::map<PosKey, std::pair<BlockList::iterator, size_t> > mapBlocks;
+
+    mutable CCriticalSection cs_files;
+    std::list<std::pair<int, std::shared_ptr<const CBlockFileMapping> > > listMappings;
+
+    static PosKey Key(const CDiskBlockPos& pos) { return std::make_pair(pos.nFile, pos.nPos); }
+
+    /** Return a mapping of block file nFile covering at least nEnd bytes, or NULL if it cannot be mapped */
+    std::shared_ptr<const CBlockFileMapping> MapFile(int nFile, size_t nEnd);
+
+public:
+    CBlockReadCache() : nMaxSize(DEFAULT_BLOCK_CACHE_SIZE << 20), nSize(0) {}
+
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    /** Look up the block stored at pos, moving it to the front of the cache */
+    std::shared_ptr<const CBlock> Get(const CDiskBlockPos& pos);
+
+    /** Add a block, verified against the block index, of serialized size nBlockSize */
+    void Insert(const CDiskBlockPos& pos, const std::shared_ptr<const CBlock>& pblock, size_t nBlockSize);
+
+    /**
+     * Deserialize the block at pos straight from the mapped block file.
+     * Returns false if the file cannot be mapped, in which case the caller
+     * should fall back to reading the file; throws on corrupt data.
+     */
+    bool ReadFromMappedFile(const CDiskBlockPos& pos, CBlock& block, unsigned int& nBlockSize);
+
+    /**
+     * Drop the mappings of block file nFile. Must be called before the file is
+     * truncated, so that later reads map it again within its new size instead
+     * of touching pages past its end.
+     */
+    void UnmapFile(int nFile);
+
+    /** Drop all cached blocks and file mappings */
+    void Clear();
+};
+
+extern CBlockReadCache blockreadcache;
+
+#endif // BITCOIN_BLOCKCACHE_H
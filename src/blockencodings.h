@@ -0,0 +1,223 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Smallest serialized transaction, used to bound the transaction count of a compact block */
+static const unsigned int MIN_SERIALIZABLE_TRANSACTION_SIZE = 60;
+/** Upper bound for the number of transactions a compact block may describe */
+static const unsigned int MAX_COMPACT_BLOCK_TXN = MAX_BLOCK_SIZE_CURRENT / MIN_SERIALIZABLE_TRANSACTION_SIZE;
+
+/** Request for the transactions of a compact block that could not be found in the mempool (getblocktxn) */
+class BlockTransactionsRequest
+{
+public:
+    // A BlockTransactionsRequest message
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    /** Indexes are sent as the distance to the previous index, minus one */
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, indexes.size());
+        for (size_t i = 0; i < indexes.size(); i++)
+            WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        if (nCount > MAX_COMPACT_BLOCK_TXN)
+            throw std::ios_base::failure("too many indexes in getblocktxn");
+        indexes.clear();
+        indexes.reserve(nCount);
+        uint64_t nIndex = 0;
+        for (uint64_t i = 0; i < nCount; i++) {
+            nIndex += ReadCompactSize(s) + (i == 0 ? 0 : 1);
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            indexes.push_back(nIndex);
+        }
+    }
+};
+
+/** The transactions requested by a BlockTransactionsRequest, in the same order (blocktxn) */
+class BlockTransactions
+{
+public:
+    // A BlockTransactions message
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full along with a compact block, with its index in the block */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+};
+
+typedef enum ReadStatus_t {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED,  // Failed to process object
+} ReadStatus;
+
+/**
+ * A block announced as its header, the block signature and a 6-byte short ID
+ * for each transaction the receiver is expected to have in its mempool
+ * (cmpctblock). The coinbase, and the coinstake of a proof-of-stake block,
+ * are always sent in full.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint256 shorttxidk;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() : nonce(0) {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    /** The header and block signature with the prefilled coinbase and coinstake, enough to check the proof of stake */
+    CBlock GetStakeBlock() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    /** Short IDs are written as 48-bit little-endian integers, prefilled indexes like BlockTransactionsRequest's */
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteCompactSize(s, prefilledtxn[i].index - (i == 0 ? 0 : prefilledtxn[i - 1].index + 1));
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+
+        uint64_t nShortIDs = ReadCompactSize(s);
+        if (nShortIDs > MAX_COMPACT_BLOCK_TXN)
+            throw std::ios_base::failure("too many short IDs in cmpctblock");
+        shorttxids.resize(nShortIDs);
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb;
+            uint16_t msb;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+        }
+
+        uint64_t nPrefilled = ReadCompactSize(s);
+        if (nPrefilled > MAX_COMPACT_BLOCK_TXN)
+            throw std::ios_base::failure("too many prefilled transactions in cmpctblock");
+        prefilledtxn.resize(nPrefilled);
+        uint64_t nIndex = 0;
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            nIndex += ReadCompactSize(s) + (i == 0 ? 0 : 1);
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            prefilledtxn[i].index = nIndex;
+            ::Unserialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+
+        FillShortTxIDSelector();
+    }
+};
+
+/** A block being rebuilt from a CBlockHeaderAndShortTxIDs, the mempool and a BlockTransactions reply */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<std::shared_ptr<const CTransaction> > txn_available;
+    size_t prefilled_count, mempool_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t GetMissingCount() const { return txn_available.size() - prefilled_count - mempool_count; }
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
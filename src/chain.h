@@ -99,6 +99,130 @@ enum BlockStatus {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //! block data in blk*.data was received with a witness-enforcing client
+    BLOCK_STAKE_PENDING     =   256, //! stake modifier not computed and proof of stake not checked yet, see CheckStakeContext
+};
+
+/**
+ * Zerocoin supply of a block, one counter per denomination in zerocoinDenomList order.
+ * Replaces a std::map that cost a heap node per denomination on every block index, and
+ * serializes exactly like that map did.
+ */
+class CZerocoinSupply
+{
+private:
+    int64_t nSupply[libzerocoin::ZEROCOIN_DENOM_COUNT];
+
+    static int Index(libzerocoin::CoinDenomination denom)
+    {
+        int nIndex = libzerocoin::ZerocoinDenominationToIndex(denom);
+        if (nIndex < 0)
+            throw std::out_of_range("CZerocoinSupply : invalid denomination");
+        return nIndex;
+    }
+
+public:
+    CZerocoinSupply() { SetNull(); }
+
+    void SetNull() { std::fill(nSupply, nSupply + libzerocoin::ZEROCOIN_DENOM_COUNT, 0); }
+
+    int64_t& at(libzerocoin::CoinDenomination denom) { return nSupply[Index(denom)]; }
+    const int64_t& at(libzerocoin::CoinDenomination denom) const { return nSupply[Index(denom)]; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(libzerocoin::ZEROCOIN_DENOM_COUNT) + libzerocoin::ZEROCOIN_DENOM_COUNT * (sizeof(int) + sizeof(int64_t));
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, libzerocoin::ZEROCOIN_DENOM_COUNT);
+        for (int i = 0; i < libzerocoin::ZEROCOIN_DENOM_COUNT; i++) {
+            ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+            ::Serialize(s, nSupply[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SetNull();
+        uint64_t nSize = ReadCompactSize(s);
+        for (uint64_t n = 0; n < nSize; n++) {
+            libzerocoin::CoinDenomination denom;
+            int64_t nValue;
+            ::Unserialize(s, denom, nType, nVersion);
+            ::Unserialize(s, nValue, nType, nVersion);
+            int nIndex = libzerocoin::ZerocoinDenominationToIndex(denom);
+            if (nIndex >= 0)
+                nSupply[nIndex] = nValue;
+        }
+    }
+};
+
+/**
+ * Denominations of the zerocoins minted in a block, kept as a count per denomination instead
+ * of a std::vector. Serializes like the vector it replaces, listed in zerocoinDenomList order.
+ */
+class CMintDenominations
+{
+private:
+    uint16_t nMints[libzerocoin::ZEROCOIN_DENOM_COUNT];
+
+public:
+    CMintDenominations() { clear(); }
+
+    void clear() { std::fill(nMints, nMints + libzerocoin::ZEROCOIN_DENOM_COUNT, 0); }
+
+    void push_back(libzerocoin::CoinDenomination denom)
+    {
+        int nIndex = libzerocoin::ZerocoinDenominationToIndex(denom);
+        if (nIndex >= 0)
+            nMints[nIndex]++;
+    }
+
+    int count(libzerocoin::CoinDenomination denom) const
+    {
+        int nIndex = libzerocoin::ZerocoinDenominationToIndex(denom);
+        return nIndex < 0 ? 0 : nMints[nIndex];
+    }
+
+    unsigned int size() const
+    {
+        unsigned int nSize = 0;
+        for (int i = 0; i < libzerocoin::ZEROCOIN_DENOM_COUNT; i++)
+            nSize += nMints[i];
+        return nSize;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(size()) + size() * sizeof(int);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, size());
+        for (int i = 0; i < libzerocoin::ZEROCOIN_DENOM_COUNT; i++) {
+            for (int n = 0; n < nMints[i]; n++)
+                ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        clear();
+        uint64_t nSize = ReadCompactSize(s);
+        for (uint64_t n = 0; n < nSize; n++) {
+            libzerocoin::CoinDenomination denom;
+            ::Unserialize(s, denom, nType, nVersion);
+            push_back(denom);
+        }
+    }
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -121,9 +245,6 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -164,7 +285,6 @@ public:
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
     COutPoint prevoutStake;
     unsigned int nStakeTime;
-    uint256 hashProofOfStake;
     int64_t nMint;
     int64_t nMoneySupply;
 
@@ -180,8 +300,8 @@ public:
     uint32_t nSequenceId;
     
     //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, int64_t> mapZerocoinSupply;
-    std::vector<libzerocoin::CoinDenomination> vMintDenominationsInBlock;
+    CZerocoinSupply mapZerocoinSupply;
+    CMintDenominations vMintDenominationsInBlock;
     
     void SetNull()
     {
@@ -213,9 +333,7 @@ public:
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
         // Start supply of each denomination with 0s
-        for (auto& denom : libzerocoin::zerocoinDenomList) {
-            mapZerocoinSupply.insert(make_pair(denom, 0));
-        }
+        mapZerocoinSupply.SetNull();
         vMintDenominationsInBlock.clear();
     }
 
@@ -237,13 +355,11 @@ public:
             nAccumulatorCheckpoint = block.nAccumulatorCheckpoint;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = uint256();
 
         if (block.IsProofOfStake()) {
             SetProofOfStake();
@@ -301,7 +417,7 @@ public:
 
     bool MintedDenomination(libzerocoin::CoinDenomination denom) const
     {
-        return std::find(vMintDenominationsInBlock.begin(), vMintDenominationsInBlock.end(), denom) != vMintDenominationsInBlock.end();
+        return vMintDenominationsInBlock.count(denom) > 0;
     }
 
     uint256 GetBlockHash() const
@@ -467,7 +583,6 @@ public:
         } else {
             const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
             const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
-            const_cast<CDiskBlockIndex*>(this)->hashProofOfStake = uint256();
         }
 
         // block header
@@ -187,3 +187,24 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256DPadded(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    // The second hash always covers 32 bytes, so its padding is fixed
+    unsigned char inner[64] = {0};
+    inner[32] = 0x80;
+    WriteBE64(inner + 56, 256);
+
+    for (size_t i = 0; i < blocks; i++) {
+        uint32_t s[8];
+        sha256::Initialize(s);
+        sha256::Transform(s, input + 64 * i);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(inner + 4 * j, s[j]);
+
+        sha256::Initialize(s);
+        sha256::Transform(s, inner);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(output + 32 * i + 4 * j, s[j]);
+    }
+}
@@ -25,4 +25,11 @@ public:
     CSHA256& Reset();
 };
 
+/** Compute the double SHA-256 of several messages of at most 55 bytes each.
+ *  The input consists of one 64-byte block per message that already contains
+ *  the SHA-256 padding, so the first hash needs no buffering. The output has
+ *  32 bytes per message.
+ */
+void SHA256DPadded(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
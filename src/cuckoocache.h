@@ -0,0 +1,155 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Fixed-size hash set for small keys that are already uniformly distributed,
+ * such as salted SHA256 digests. Each key can live in one of eight slots chosen
+ * by its hash; inserting into a full neighbourhood displaces an existing key
+ * to one of its other slots, and the key left over after a bounded number of
+ * displacements is dropped.
+ *
+ * Lookups never modify the table. Marking an entry as no longer needed only
+ * flips an atomic flag, so it is safe under a shared lock, while inserts need
+ * exclusive access.
+ */
+namespace CuckooCache
+{
+/** Vector of flags packed eight to a byte whose bits can be set and cleared concurrently */
+class bit_packed_atomic_flags
+{
+private:
+    std::unique_ptr<std::atomic<uint8_t>[]> mem;
+
+public:
+    /** All flags start set */
+    explicit bit_packed_atomic_flags(uint32_t nFlags)
+    {
+        nFlags = (nFlags + 7) / 8;
+        mem.reset(new std::atomic<uint8_t>[nFlags]);
+        for (uint32_t i = 0; i < nFlags; ++i)
+            mem[i].store(0xFF);
+    }
+
+    void setup(uint32_t nFlags)
+    {
+        bit_packed_atomic_flags d(nFlags);
+        std::swap(mem, d.mem);
+    }
+
+    void bit_set(uint32_t s) const { mem[s >> 3].fetch_or(1 << (s & 7), std::memory_order_relaxed); }
+    void bit_unset(uint32_t s) const { mem[s >> 3].fetch_and(~(1 << (s & 7)), std::memory_order_relaxed); }
+    bool bit_is_set(uint32_t s) const { return (1 << (s & 7)) & mem[s >> 3].load(std::memory_order_relaxed); }
+};
+
+/**
+ * Hash must provide operator()<n>(const Element&) for n in 0..7 returning
+ * independent 32-bit hashes of the element.
+ */
+template <typename Element, typename Hash>
+class cache
+{
+private:
+    std::vector<Element> table;
+    uint32_t size;
+    //! A set flag marks a slot as free: never filled, or erased once its entry was used
+    mutable bit_packed_atomic_flags collection_flags;
+    //! Maximum number of displacements tried by insert before dropping a key
+    uint8_t depth_limit;
+    const Hash hash_function;
+
+    /** Map the eight hashes of e onto [0, size) without a modulo */
+    std::array<uint32_t, 8> compute_hashes(const Element& e) const
+    {
+        return {{(uint32_t)(((uint64_t)hash_function.template operator()<0>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<1>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<2>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<3>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<4>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<5>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<6>(e) * (uint64_t)size) >> 32),
+            (uint32_t)(((uint64_t)hash_function.template operator()<7>(e) * (uint64_t)size) >> 32)}};
+    }
+
+    static uint32_t invalid() { return ~(uint32_t)0; }
+
+public:
+    cache() : table(), size(0), collection_flags(0), depth_limit(0), hash_function() {}
+
+    /** Allocate room for nEntries keys, dropping the current contents. Returns the number of slots */
+    uint32_t setup(uint32_t nEntries)
+    {
+        size = std::max<uint32_t>(2, nEntries);
+        depth_limit = static_cast<uint8_t>(std::log2(static_cast<float>(size)));
+        table.assign(size, Element());
+        collection_flags.setup(size);
+        return size;
+    }
+
+    /** Allocate as many slots as fit in nBytes. Returns the number of slots */
+    uint32_t setup_bytes(size_t nBytes)
+    {
+        return setup(static_cast<uint32_t>(std::min<size_t>(nBytes / sizeof(Element), invalid() >> 1)));
+    }
+
+    void insert(Element e)
+    {
+        if (size == 0)
+            return;
+        uint32_t last_loc = invalid();
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        // Refresh an entry that is already present instead of storing it twice
+        for (const uint32_t loc : locs) {
+            if (table[loc] == e) {
+                collection_flags.bit_unset(loc);
+                return;
+            }
+        }
+        for (uint8_t depth = 0; depth < depth_limit; ++depth) {
+            for (const uint32_t loc : locs) {
+                if (!collection_flags.bit_is_set(loc))
+                    continue;
+                table[loc] = std::move(e);
+                collection_flags.bit_unset(loc);
+                return;
+            }
+            // All slots are taken: swap e with the occupant of the slot after the one it was evicted
+            // from, and try to place the displaced key in its own slots next round
+            last_loc = locs[(1 + (std::find(locs.begin(), locs.end(), last_loc) - locs.begin())) & 7];
+            std::swap(table[last_loc], e);
+            locs = compute_hashes(e);
+        }
+    }
+
+    /** Return whether e is in the cache; with erase set, its slot may be reused by later inserts */
+    bool contains(const Element& e, const bool erase) const
+    {
+        if (size == 0)
+            return false;
+        std::array<uint32_t, 8> locs = compute_hashes(e);
+        for (const uint32_t loc : locs) {
+            if (table[loc] == e) {
+                if (erase)
+                    collection_flags.bit_set(loc);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+} // namespace CuckooCache
+
+#endif // BITCOIN_CUCKOOCACHE_H
@@ -7,6 +7,8 @@
 
 #include <boost/assign/list_of.hpp>
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -62,7 +64,7 @@ static int64_t GetStakeModifierSelectionIntervalSection(int nSection)
 }
 
 // Get stake modifier selection interval (in seconds)
-static int64_t GetStakeModifierSelectionInterval()
+int64_t GetStakeModifierSelectionInterval()
 {
     int64_t nSelectionInterval = 0;
     for (int nSection = 0; nSection < 64; nSection++) {
@@ -240,16 +242,118 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Kernel stake modifier of every block of the active chain, indexed by height, so that a kernel does not have to
+// walk forward through the chain to find it. A height is resolved by the first later block that generated a
+// modifier at least a selection interval after it; heights waiting for that block are kept by their target time.
+struct CKernelModifier {
+    uint64_t nStakeModifier;
+    int nHeightModifier; // block the modifier was taken from, -1 while unresolved
+};
+static CCriticalSection cs_kernelModifiers;
+static std::vector<CKernelModifier> vKernelModifiers;
+static std::vector<int> vKernelModifierMinHeight; // lowest height resolved by the block at this height
+static std::multimap<int64_t, int> mapKernelModifierPending;
+static const CBlockIndex* pindexKernelModifiers = NULL;
+
+// Bring the kernel stake modifier index in line with the active chain
+static void UpdateKernelModifiers()
+{
+    AssertLockHeld(cs_kernelModifiers);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexKernelModifiers == pindexTip)
+        return;
+
+    int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
+
+    // Disconnect the heights above the fork and forget what they resolved
+    const CBlockIndex* pindexFork = pindexKernelModifiers ? chainActive.FindFork(pindexKernelModifiers) : NULL;
+    int nHeightFork = pindexFork ? pindexFork->nHeight : -1;
+    if (nHeightFork + 1 < (int)vKernelModifiers.size()) {
+        int nHeightLow = nHeightFork + 1;
+        for (int nHeight = nHeightFork + 1; nHeight < (int)vKernelModifiers.size(); nHeight++)
+            nHeightLow = std::min(nHeightLow, vKernelModifierMinHeight[nHeight]);
+
+        auto it = mapKernelModifierPending.begin();
+        while (it != mapKernelModifierPending.end()) {
+            if (it->second > nHeightFork)
+                mapKernelModifierPending.erase(it++);
+            else
+                ++it;
+        }
+
+        for (int nHeight = nHeightLow; nHeight <= nHeightFork; nHeight++) {
+            CKernelModifier& modifier = vKernelModifiers[nHeight];
+            if (modifier.nHeightModifier > nHeightFork) {
+                modifier.nHeightModifier = -1;
+                mapKernelModifierPending.insert(make_pair(chainActive[nHeight]->GetBlockTime() + nSelectionInterval, nHeight));
+            }
+        }
+
+        vKernelModifiers.resize(nHeightFork + 1);
+        vKernelModifierMinHeight.resize(nHeightFork + 1);
+    }
+
+    // Connect the new blocks of the active chain
+    for (int nHeight = nHeightFork + 1; pindexTip && nHeight <= pindexTip->nHeight; nHeight++) {
+        const CBlockIndex* pindex = chainActive[nHeight];
+        int nHeightLow = std::numeric_limits<int>::max();
+        if (pindex->GeneratedStakeModifier()) {
+            auto itEnd = mapKernelModifierPending.upper_bound(pindex->GetBlockTime());
+            for (auto it = mapKernelModifierPending.begin(); it != itEnd; ++it) {
+                vKernelModifiers[it->second].nStakeModifier = pindex->nStakeModifier;
+                vKernelModifiers[it->second].nHeightModifier = nHeight;
+                nHeightLow = std::min(nHeightLow, it->second);
+            }
+            mapKernelModifierPending.erase(mapKernelModifierPending.begin(), itEnd);
+        }
+
+        CKernelModifier modifier = {0, -1};
+        vKernelModifiers.push_back(modifier);
+        vKernelModifierMinHeight.push_back(nHeightLow);
+        mapKernelModifierPending.insert(make_pair(pindex->GetBlockTime() + nSelectionInterval, nHeight));
+    }
+
+    pindexKernelModifiers = pindexTip;
+}
+
+void ResetKernelModifiers()
+{
+    LOCK(cs_kernelModifiers);
+    vKernelModifiers.clear();
+    vKernelModifierMinHeight.clear();
+    mapKernelModifierPending.clear();
+    pindexKernelModifiers = NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    if (!pindexFrom)
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
+
+    // Blocks of the active chain are looked up in the index
+    if (chainActive.Contains(pindexFrom)) {
+        LOCK(cs_kernelModifiers);
+        UpdateKernelModifiers();
+        if (pindexFrom->nHeight < (int)vKernelModifiers.size()) {
+            const CKernelModifier& modifier = vKernelModifiers[pindexFrom->nHeight];
+            if (modifier.nHeightModifier < 0) {
+                // Should never happen need to revist
+                LogPrintf("We Cant't Stop Here, This is Bat Country! Oh yea at height=%d Null pindexNext.\n", chainActive.Height());
+                return true;
+            }
+
+            nStakeModifier = modifier.nStakeModifier;
+            nStakeModifierHeight = modifier.nHeightModifier;
+            nStakeModifierTime = chainActive[modifier.nHeightModifier]->GetBlockTime();
+            return true;
+        }
+    }
+
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
     CBlockIndex* pindexNext = chainActive[pindexFrom->nHeight + 1];
@@ -257,20 +361,20 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
     // loop to find the stake modifier later by a selection interval
     while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval) {
         if (!pindexNext) {
-			// Should never happen need to revist
-			//return error("Null pindexNext\n");
-            LogPrintf("We Cant't Stop Here, This is Bat Country! Oh yea at height=%d Null pindexNext.\n");
+            // Should never happen need to revist
+            //return error("Null pindexNext\n");
+            LogPrintf("We Cant't Stop Here, This is Bat Country! Oh yea at height=%d Null pindexNext.\n", pindex->nHeight);
             return true;
+        }
+        pindex = pindexNext;
+        pindexNext = chainActive[pindexNext->nHeight + 1];
+        if (pindex->GeneratedStakeModifier()) {
+            nStakeModifierHeight = pindex->nHeight;
+            nStakeModifierTime = pindex->GetBlockTime();
+        }
     }
-    pindex = pindexNext;
-    pindexNext = chainActive[pindexNext->nHeight + 1];
-    if (pindex->GeneratedStakeModifier()) {
-        nStakeModifierHeight = pindex->nHeight;
-        nStakeModifierTime = pindex->GetBlockTime();
-    }
-}
-nStakeModifier = pindex->nStakeModifier;
-return true;
+    nStakeModifier = pindex->nStakeModifier;
+    return true;
 }
 
 uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom)
@@ -290,12 +394,81 @@ bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTarget
     return (uint256(hashProofOfStake) < bnCoinDayWeight * bnTargetPerCoinDay);
 }
 
+CStakeKernel::CStakeKernel() : nTimeBlockFrom(0), nStakeModifier(0), bnTarget(0)
+{
+    memset(block, 0, sizeof(block));
+}
+
+bool CStakeKernel::SetKernel(unsigned int nBits, const CBlockIndex* pindexFrom, const COutPoint& prevoutIn, int64_t nValueIn, bool fPrintProofOfStake)
+{
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
+        return false;
+
+    prevout = prevoutIn;
+    nTimeBlockFrom = pindexFrom->GetBlockTime();
+
+    //same target as stakeTargetHit(), computed once instead of for every hash
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    bnTarget = (uint256(nValueIn) / 100) * bnTargetPerCoinDay;
+
+    //serialize the message like stakeHash() does, followed by its SHA-256 padding
+    memset(block, 0, sizeof(block));
+    WriteLE64(block, nStakeModifier);
+    WriteLE32(block + 8, nTimeBlockFrom);
+    WriteLE32(block + 12, prevout.n);
+    memcpy(block + 16, prevout.hash.begin(), 32);
+    block[MESSAGE_SIZE] = 0x80;
+    WriteBE64(block + 56, MESSAGE_SIZE * 8);
+    return true;
+}
+
+uint256 CStakeKernel::GetHash(unsigned int nTimeTx) const
+{
+    unsigned char buf[64];
+    memcpy(buf, block, sizeof(buf));
+    WriteLE32(buf + 48, nTimeTx);
+
+    uint256 hash;
+    SHA256DPadded(hash.begin(), buf, 1);
+    return hash;
+}
+
+bool CStakeKernel::Search(unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake) const
+{
+    unsigned char buf[64 * HASH_BATCH];
+    unsigned char hashes[32 * HASH_BATCH];
+    for (unsigned int j = 0; j < HASH_BATCH; j++)
+        memcpy(buf + 64 * j, block, 64);
+
+    for (unsigned int i = 0; i < nHashDrift; i += HASH_BATCH) {
+        unsigned int nHashes = nHashDrift - i < HASH_BATCH ? nHashDrift - i : HASH_BATCH;
+        for (unsigned int j = 0; j < nHashes; j++)
+            WriteLE32(buf + 64 * j + 48, nTimeTx + nHashDrift - i - j);
+        SHA256DPadded(hashes, buf, nHashes);
+
+        //take the first hit in the same order as hashing the timestamps one by one
+        for (unsigned int j = 0; j < nHashes; j++) {
+            uint256 hash;
+            memcpy(hash.begin(), hashes + 32 * j, 32);
+            if (!Hit(hash))
+                continue;
+
+            hashProofOfStake = hash;
+            nTimeTx = nTimeTx + nHashDrift - i - j;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 //instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
 {
-    //assign new variables to make it easier to read
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = pindexFrom->GetBlockTime();
 
     if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
@@ -304,63 +477,29 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
         return false;
     //return error("CheckStakeKernelHash() : min age violation - nTimeBlockFrom=%d StakeMinAgev2()=%d nTimeTx=%d", nTimeBlockFrom, StakeMinAgev2(), nTimeTx);
 
-    //grab difficulty
-    uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
-    //grab stake modifier
-    uint64_t nStakeModifier = 0;
-    int nStakeModifierHeight = 0;
-    int64_t nStakeModifierTime = 0;
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
+    //grab stake modifier, weight and target
+    CStakeKernel kernel;
+    if (!kernel.SetKernel(nBits, pindexFrom, prevout, nValueIn, fPrintProofOfStake)) {
         LogPrintf("CheckStakeKernelHash(): failed to get kernel stake modifier \n");
         return false;
     }
 
-    //create data stream once instead of repeating it in the loop
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
-
     //if wallet is simply checking to make sure a hash is valid
     if (fCheck) {
-        hashProofOfStake = stakeHash(nTimeTx, ss, prevout.n, prevout.hash, nTimeBlockFrom);
-        return stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay);
+        hashProofOfStake = kernel.GetHash(nTimeTx);
+        return kernel.Hit(hashProofOfStake);
     }
 
-    bool fSuccess = false;
-    unsigned int nTryTime = 0;
-    unsigned int i;
-    int nHeightStart = chainActive.Height();
-    for (i = 0; i < (nHashDrift); i++) //iterate the hashing
-    {
-        //new block came in, move on
-        if (chainActive.Height() != nHeightStart)
-            break;
-
-        //hash this iteration
-        nTryTime = nTimeTx + nHashDrift - i;
-        hashProofOfStake = stakeHash(nTryTime, ss, prevout.n, prevout.hash, nTimeBlockFrom);
-
-        // if stake hash does not meet the target then continue to next iteration
-        if (!stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay))
-            continue;
-
-        fSuccess = true; // if we make it this far then we have successfully created a stake hash
-        nTimeTx = nTryTime;
-
-        if (fDebug || fPrintProofOfStake) {
-            LogPrintf("CheckStakeKernelHash() : using modifier %s at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-                std::to_string(nStakeModifier).c_str(), nStakeModifierHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
-                mapBlockIndex[blockFrom.GetHash()]->nHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
-            LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-                "0.3",
-                std::to_string(nStakeModifier).c_str(),
-                nTimeBlockFrom, prevout.hash.ToString().c_str(), nTimeBlockFrom, prevout.n, nTryTime,
-                hashProofOfStake.ToString().c_str());
-        }
-        break;
+    bool fSuccess = kernel.Search(nTimeTx, nHashDrift, hashProofOfStake);
+    if (fSuccess && (fDebug || fPrintProofOfStake)) {
+        LogPrintf("CheckStakeKernelHash() : using modifier %s for block from height=%d timestamp=%s\n",
+            std::to_string(kernel.nStakeModifier).c_str(), pindexFrom->nHeight,
+            DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexFrom->GetBlockTime()).c_str());
+        LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
+            "0.3",
+            std::to_string(kernel.nStakeModifier).c_str(),
+            nTimeBlockFrom, prevout.hash.ToString().c_str(), nTimeBlockFrom, prevout.n, nTimeTx,
+            hashProofOfStake.ToString().c_str());
     }
 
     mapHashedBlocks.clear();
@@ -369,42 +508,50 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    AssertLockHeld(cs_main);
+
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    // The kernel is normally unspent on the active chain, so its output comes from the coins view and the
+    // block it was included in from the block index, without reading either from disk
+    CTxOut txoutPrev;
+    const CBlockIndex* pindexFrom = NULL;
+    const Coin& coin = pcoinsTip->AccessCoin(txin.prevout);
+    if (coin.IsAvailable() && coin.nHeight <= chainActive.Height()) {
+        txoutPrev = coin.out;
+        pindexFrom = chainActive[coin.nHeight];
+    } else {
+        // Otherwise try finding the previous transaction in database
+        uint256 hashBlock;
+        CTransaction txPrev;
+        if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+            return error("CheckProofOfStake() : INFO: read txPrev failed");
+        if (txin.prevout.n >= txPrev.vout.size())
+            return error("CheckProofOfStake() : kernel output %d does not exist", txin.prevout.n);
+        txoutPrev = txPrev.vout[txin.prevout.n];
+
+        BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+        if (it == mapBlockIndex.end())
+            return error("CheckProofOfStake() : read block failed");
+        pindexFrom = it->second;
+    }
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey,
-            tx.wit.vtxinwit.size() > 0 ? &tx.wit.vtxinwit[0].scriptWitness : NULL, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0, txPrev.vout[txin.prevout.n].nValue)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey,
+            tx.wit.vtxinwit.size() > 0 ? &tx.wit.vtxinwit[0].scriptWitness : NULL, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0, txoutPrev.nValue)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     unsigned int nInterval = 0;
     unsigned int nTime = block.nTime;
 
-    if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug) && (nTime > 1505247602))
+    if (!CheckStakeKernelHash(block.nBits, pindexFrom, txoutPrev.nValue, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug) && (nTime > 1505247602))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -418,14 +565,14 @@ bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx)
 }
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
+unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex, const uint256& hashProofOfStake)
 {
     assert(pindex->pprev || pindex->GetBlockHash() == Params().HashGenesisBlock());
     // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
     CDataStream ss(SER_GETHASH, 0);
     if (pindex->pprev)
         ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    ss << pindex->nFlags << hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return hashChecksum.Get64();
@@ -21,21 +21,56 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Get stake modifier selection interval (in seconds)
+int64_t GetStakeModifierSelectionInterval();
+
+// Get the stake modifier used for kernels of coins from the given block
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+
+// Forget the kernel stake modifier index, before the block index it points into is freed
+void ResetKernelModifiers();
+
+// A stake kernel with the inputs that are the same for every timestamp precomputed.
+// The hashed message is kept in a padded SHA-256 block, so trying a timestamp only
+// rewrites its last four bytes.
+class CStakeKernel
+{
+private:
+    // modifier, time of the block from, prevout index, prevout hash and the timestamp
+    static const size_t MESSAGE_SIZE = 52;
+    // timestamps hashed per call when searching
+    static const unsigned int HASH_BATCH = 8;
+    unsigned char block[64];
+
+public:
+    COutPoint prevout;
+    unsigned int nTimeBlockFrom;
+    uint64_t nStakeModifier;
+    uint256 bnTarget; // stake weight times the target per coin day
+
+    CStakeKernel();
+    bool SetKernel(unsigned int nBits, const CBlockIndex* pindexFrom, const COutPoint& prevoutIn, int64_t nValueIn, bool fPrintProofOfStake = false);
+    uint256 GetHash(unsigned int nTimeTx) const;
+    bool Hit(const uint256& hashProofOfStake) const { return hashProofOfStake < bnTarget; }
+    // Try the timestamps from nTimeTx + nHashDrift down to nTimeTx + 1, setting nTimeTx to the first that hits
+    bool Search(unsigned int& nTimeTx, unsigned int nHashDrift, uint256& hashProofOfStake) const;
+};
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex);
+unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex, const uint256& hashProofOfStake);
 
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierChecksum);
@@ -11,6 +11,7 @@
  **/
 // Copyright (c) 2017 The PIVX developers
 #include "AccumulatorProofOfKnowledge.h"
+#include "FixedBaseTables.h"
 #include "hash.h"
 
 namespace libzerocoin {
@@ -103,7 +104,7 @@ AccumulatorProofOfKnowledge::AccumulatorProofOfKnowledge(const AccumulatorAndPro
 
 /** Verifies that a commitment c is accumulated in accumulator a
  */
-bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const CBigNum& valueOfCommitmentToCoin) const {
+bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const CBigNum& valueOfCommitmentToCoin, bool fPrecomputed) const {
 	CBigNum sg = params->accumulatorPoKCommitmentGroup.g;
 	CBigNum sh = params->accumulatorPoKCommitmentGroup.h;
 
@@ -116,6 +117,9 @@ bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const CBigNum& v
 
 	CBigNum c = CBigNum(hasher.GetHash()); //this hash should be of length k_prime bits
 
+	if (fPrecomputed)
+		return VerifyPrecomputed(a, valueOfCommitmentToCoin, c, AccumulatorPoKTables::Get(params));
+
 	CBigNum st_1_prime = (valueOfCommitmentToCoin.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * sg.pow_mod(s_alpha, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_phi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
 	CBigNum st_2_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * ((valueOfCommitmentToCoin * sg.inverse(params->accumulatorPoKCommitmentGroup.modulus)).pow_mod(s_gamma, params->accumulatorPoKCommitmentGroup.modulus)) * sh.pow_mod(s_psi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
 	CBigNum st_3_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * (sg * valueOfCommitmentToCoin).pow_mod(s_sigma, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_xi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
@@ -125,6 +129,32 @@ bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const CBigNum& v
 	CBigNum t_3_prime = ((a.getValue()).pow_mod(c, params->accumulatorModulus) * C_u.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
 	CBigNum t_4_prime = (C_r.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_delta, params->accumulatorModulus)) * ((g_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
 
+	return CheckResponses(st_1_prime, st_2_prime, st_3_prime, t_1_prime, t_2_prime, t_3_prime, t_4_prime);
+}
+
+/** Same as Verify, with every exponentiation of a fixed base served from the precomputed tables
+ */
+bool AccumulatorProofOfKnowledge::VerifyPrecomputed(const Accumulator& a, const CBigNum& valueOfCommitmentToCoin, const CBigNum& c, const AccumulatorPoKTables* tables) const {
+	const CBigNum& P = params->accumulatorPoKCommitmentGroup.modulus;
+	const CBigNum& N = params->accumulatorModulus;
+
+	CBigNum sg_c = tables->sg.pow_mod(c);
+
+	CBigNum st_1_prime = (valueOfCommitmentToCoin.pow_mod(c, P) * tables->sg.pow_mod(s_alpha) * tables->sh.pow_mod(s_phi)) % P;
+	CBigNum st_2_prime = (sg_c * ((valueOfCommitmentToCoin * tables->sg_inverse).pow_mod(s_gamma, P)) * tables->sh.pow_mod(s_psi)) % P;
+	CBigNum st_3_prime = (sg_c * (params->accumulatorPoKCommitmentGroup.g * valueOfCommitmentToCoin).pow_mod(s_sigma, P) * tables->sh.pow_mod(s_xi)) % P;
+
+	// (h_n^-1)^x and (g_n^-1)^x are served as h_n^-x and g_n^-x
+	CBigNum t_1_prime = (C_r.pow_mod(c, N) * tables->h_n.pow_mod(s_zeta) * tables->g_n.pow_mod(s_epsilon)) % N;
+	CBigNum t_2_prime = (C_e.pow_mod(c, N) * tables->h_n.pow_mod(s_eta) * tables->g_n.pow_mod(s_alpha)) % N;
+	CBigNum t_3_prime = ((a.getValue()).pow_mod(c, N) * C_u.pow_mod(s_alpha, N) * tables->h_n.pow_mod(-s_beta)) % N;
+	CBigNum t_4_prime = (C_r.pow_mod(s_alpha, N) * tables->h_n.pow_mod(-s_delta) * tables->g_n.pow_mod(-s_beta)) % N;
+
+	return CheckResponses(st_1_prime, st_2_prime, st_3_prime, t_1_prime, t_2_prime, t_3_prime, t_4_prime);
+}
+
+bool AccumulatorProofOfKnowledge::CheckResponses(const CBigNum& st_1_prime, const CBigNum& st_2_prime, const CBigNum& st_3_prime,
+        const CBigNum& t_1_prime, const CBigNum& t_2_prime, const CBigNum& t_3_prime, const CBigNum& t_4_prime) const {
 	bool result = false;
 
 	bool result_st1 = (st_1 == st_1_prime);
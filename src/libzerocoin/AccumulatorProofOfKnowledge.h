@@ -19,6 +19,8 @@
 
 namespace libzerocoin {
 
+class AccumulatorPoKTables;
+
 /**A prove that a value insde the commitment commitmentToCoin is in an accumulator a.
  *
  */
@@ -34,8 +36,9 @@ public:
 	 */
 	AccumulatorProofOfKnowledge(const AccumulatorAndProofParams* p, const Commitment& commitmentToCoin, const AccumulatorWitness& witness, Accumulator& a);
 	/** Verifies that  a commitment c is accumulated in accumulated a
+	 * @param fPrecomputed use the shared fixed-base tables (see FixedBaseTables.h)
 	 */
-	bool Verify(const Accumulator& a,const CBigNum& valueOfCommitmentToCoin) const;
+	bool Verify(const Accumulator& a,const CBigNum& valueOfCommitmentToCoin, bool fPrecomputed = false) const;
 	
 	ADD_SERIALIZE_METHODS;
   template <typename Stream, typename Operation>  inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
@@ -64,6 +67,10 @@ public:
 private:
 	const AccumulatorAndProofParams* params;
 
+	bool VerifyPrecomputed(const Accumulator& a, const CBigNum& valueOfCommitmentToCoin, const CBigNum& c, const AccumulatorPoKTables* tables) const;
+	bool CheckResponses(const CBigNum& st_1_prime, const CBigNum& st_2_prime, const CBigNum& st_3_prime,
+	                    const CBigNum& t_1_prime, const CBigNum& t_2_prime, const CBigNum& t_3_prime, const CBigNum& t_4_prime) const;
+
 	/* Return values for proof */
 	CBigNum C_e;
 	CBigNum C_u;
@@ -72,7 +72,7 @@ namespace libzerocoin
     }
 }
 
-bool CoinSpend::Verify(const Accumulator& a) const
+bool CoinSpend::Verify(const Accumulator& a, bool fPrecomputed) const
 {
     // Double check that the version is the same as marked in the serial
     if (ExtractVersionFromSerial(coinSerialNumber) != version) {
@@ -91,12 +91,12 @@ bool CoinSpend::Verify(const Accumulator& a) const
         return false;
     }
 
-    if (!accumulatorPoK.Verify(a, accCommitmentToCoinValue)) {
+    if (!accumulatorPoK.Verify(a, accCommitmentToCoinValue, fPrecomputed)) {
         //std::cout << "CoinsSpend::Verify: accumulatorPoK failed\n";
         return false;
     }
 
-    if (!serialNumberSoK.Verify(coinSerialNumber, serialCommitmentToCoinValue, signatureHash())) {
+    if (!serialNumberSoK.Verify(coinSerialNumber, serialCommitmentToCoinValue, signatureHash(), fPrecomputed)) {
         //std::cout << "CoinsSpend::Verify: serialNumberSoK failed. sighash:" << signatureHash().GetHex() << "\n";
         return false;
     }
@@ -115,7 +115,9 @@ public:
     SpendType getSpendType() const { return spendType; }
     std::vector<unsigned char> getSignature() const { return vchSig; }
 
-    bool Verify(const Accumulator& a) const;
+    /** Verifies the spend against accumulator a. fPrecomputed serves the exponentiations of fixed
+     *  bases from shared tables; the result is the same either way. See FixedBaseTables.h. */
+    bool Verify(const Accumulator& a, bool fPrecomputed = false) const;
     bool HasValidSerial(ZerocoinParams* params) const;
     bool HasValidSignature() const;
     CBigNum CalculateValidSerial(ZerocoinParams* params);
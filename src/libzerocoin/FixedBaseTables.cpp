@@ -0,0 +1,78 @@
+/**
+ * @file       FixedBaseTables.cpp
+ *
+ * @brief      Precomputed powers of the fixed bases used to verify CoinSpend proofs.
+ **/
+// Copyright (c) 2019 The Beetok Developers
+
+#include "FixedBaseTables.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+namespace libzerocoin {
+
+// Exponents produced by a valid proof never exceed the bounds below; longer or unexpected
+// exponents still verify correctly, they just fall back to a plain modular exponentiation.
+SerialNumberSoKTables::SerialNumberSoKTables(const ZerocoinParams* p):
+	a(p->coinCommitmentGroup.g, p->serialNumberSoKCommitmentGroup.groupOrder, p->coinCommitmentGroup.groupOrder.bitSize()),
+	b(p->coinCommitmentGroup.h, p->serialNumberSoKCommitmentGroup.groupOrder, p->coinCommitmentGroup.groupOrder.bitSize(), p->coinCommitmentGroup.groupOrder.bitSize()),
+	g(p->serialNumberSoKCommitmentGroup.g, p->serialNumberSoKCommitmentGroup.modulus, p->serialNumberSoKCommitmentGroup.groupOrder.bitSize()),
+	h(p->serialNumberSoKCommitmentGroup.h, p->serialNumberSoKCommitmentGroup.modulus, std::max(p->serialNumberSoKCommitmentGroup.groupOrder.bitSize(), 1024),
+	  2 * p->serialNumberSoKCommitmentGroup.groupOrder.bitSize() + 1) { }
+
+AccumulatorPoKTables::AccumulatorPoKTables(const AccumulatorAndProofParams* p):
+	sg(p->accumulatorPoKCommitmentGroup.g, p->accumulatorPoKCommitmentGroup.modulus,
+	   std::max(256u, p->maxCoinValue.bitSize() + p->k_prime + p->k_dprime + 1),
+	   std::max(256u, p->maxCoinValue.bitSize() + p->k_prime + p->k_dprime + 1)),
+	sh(p->accumulatorPoKCommitmentGroup.h, p->accumulatorPoKCommitmentGroup.modulus,
+	   std::max(p->accumulatorPoKCommitmentGroup.modulus.bitSize(), 2 * p->accumulatorPoKCommitmentGroup.groupOrder.bitSize() + 256) + 1,
+	   std::max(p->accumulatorPoKCommitmentGroup.modulus.bitSize(), 2 * p->accumulatorPoKCommitmentGroup.groupOrder.bitSize() + 256) + 1),
+	g_n(p->accumulatorQRNCommitmentGroup.g, p->accumulatorModulus,
+	    p->accumulatorModulus.bitSize() + p->accumulatorPoKCommitmentGroup.modulus.bitSize() + p->k_prime + p->k_dprime + 1,
+	    p->accumulatorModulus.bitSize() + p->accumulatorPoKCommitmentGroup.modulus.bitSize() + p->k_prime + p->k_dprime + 1),
+	h_n(p->accumulatorQRNCommitmentGroup.h, p->accumulatorModulus,
+	    p->accumulatorModulus.bitSize() + p->accumulatorPoKCommitmentGroup.modulus.bitSize() + p->k_prime + p->k_dprime + 1,
+	    p->accumulatorModulus.bitSize() + p->accumulatorPoKCommitmentGroup.modulus.bitSize() + p->k_prime + p->k_dprime + 1),
+	sg_inverse(p->accumulatorPoKCommitmentGroup.g.inverse(p->accumulatorPoKCommitmentGroup.modulus)) { }
+
+// Parameter objects may be freed and reallocated (e.g. by the tests), so cached tables are
+// matched on the group values they were built from rather than on the params pointer.
+static bool Matches(const CBigNumFixedBase& table, const CBigNum& base, const CBigNum& modulus)
+{
+	return table.getBase() == base && table.getModulus() == modulus;
+}
+
+static std::mutex csTables;
+static std::vector<std::unique_ptr<SerialNumberSoKTables> > vSoKTables;
+static std::vector<std::unique_ptr<AccumulatorPoKTables> > vAccPoKTables;
+
+const SerialNumberSoKTables* SerialNumberSoKTables::Get(const ZerocoinParams* p)
+{
+	std::lock_guard<std::mutex> lock(csTables);
+	for (const std::unique_ptr<SerialNumberSoKTables>& tables : vSoKTables) {
+		if (Matches(tables->a, p->coinCommitmentGroup.g, p->serialNumberSoKCommitmentGroup.groupOrder) &&
+		    Matches(tables->b, p->coinCommitmentGroup.h, p->serialNumberSoKCommitmentGroup.groupOrder) &&
+		    Matches(tables->g, p->serialNumberSoKCommitmentGroup.g, p->serialNumberSoKCommitmentGroup.modulus) &&
+		    Matches(tables->h, p->serialNumberSoKCommitmentGroup.h, p->serialNumberSoKCommitmentGroup.modulus))
+			return tables.get();
+	}
+	vSoKTables.emplace_back(new SerialNumberSoKTables(p));
+	return vSoKTables.back().get();
+}
+
+const AccumulatorPoKTables* AccumulatorPoKTables::Get(const AccumulatorAndProofParams* p)
+{
+	std::lock_guard<std::mutex> lock(csTables);
+	for (const std::unique_ptr<AccumulatorPoKTables>& tables : vAccPoKTables) {
+		if (Matches(tables->sg, p->accumulatorPoKCommitmentGroup.g, p->accumulatorPoKCommitmentGroup.modulus) &&
+		    Matches(tables->sh, p->accumulatorPoKCommitmentGroup.h, p->accumulatorPoKCommitmentGroup.modulus) &&
+		    Matches(tables->g_n, p->accumulatorQRNCommitmentGroup.g, p->accumulatorModulus) &&
+		    Matches(tables->h_n, p->accumulatorQRNCommitmentGroup.h, p->accumulatorModulus))
+			return tables.get();
+	}
+	vAccPoKTables.emplace_back(new AccumulatorPoKTables(p));
+	return vAccPoKTables.back().get();
+}
+
+} /* namespace libzerocoin */
@@ -0,0 +1,55 @@
+/**
+ * @file       FixedBaseTables.h
+ *
+ * @brief      Precomputed powers of the fixed bases used to verify CoinSpend proofs.
+ **/
+// Copyright (c) 2019 The Beetok Developers
+
+#ifndef FIXEDBASETABLES_H_
+#define FIXEDBASETABLES_H_
+
+#include "Params.h"
+#include "bignum.h"
+
+namespace libzerocoin {
+
+/** Fixed-base tables for the bases used by SerialNumberSignatureOfKnowledge::Verify.
+ *  Built once per parameter set and shared by every verifying thread.
+ */
+class SerialNumberSoKTables {
+public:
+	SerialNumberSoKTables(const ZerocoinParams* p);
+
+	/** Returns the tables matching p, building them on first use. Never returns NULL. */
+	static const SerialNumberSoKTables* Get(const ZerocoinParams* p);
+
+	// coinCommitmentGroup.g and .h modulo serialNumberSoKCommitmentGroup.groupOrder
+	CBigNumFixedBase a;
+	CBigNumFixedBase b;
+	// serialNumberSoKCommitmentGroup.g and .h modulo serialNumberSoKCommitmentGroup.modulus
+	CBigNumFixedBase g;
+	CBigNumFixedBase h;
+};
+
+/** Fixed-base tables for the bases used by AccumulatorProofOfKnowledge::Verify.
+ *  Built once per parameter set and shared by every verifying thread.
+ */
+class AccumulatorPoKTables {
+public:
+	AccumulatorPoKTables(const AccumulatorAndProofParams* p);
+
+	/** Returns the tables matching p, building them on first use. Never returns NULL. */
+	static const AccumulatorPoKTables* Get(const AccumulatorAndProofParams* p);
+
+	// accumulatorPoKCommitmentGroup.g and .h
+	CBigNumFixedBase sg;
+	CBigNumFixedBase sh;
+	// accumulatorQRNCommitmentGroup.g and .h modulo accumulatorModulus
+	CBigNumFixedBase g_n;
+	CBigNumFixedBase h_n;
+	// inverse of sg, used as part of a variable base
+	CBigNum sg_inverse;
+};
+
+} /* namespace libzerocoin */
+#endif /* FIXEDBASETABLES_H_ */
@@ -12,6 +12,7 @@
 // Copyright (c) 2017 The PIVX developers
 #include <streams.h>
 #include "SerialNumberSignatureOfKnowledge.h"
+#include "FixedBaseTables.h"
 
 namespace libzerocoin {
 
@@ -108,13 +109,18 @@ SerialNumberSignatureOfKnowledge::SerialNumberSignatureOfKnowledge(const
 }
 
 inline CBigNum SerialNumberSignatureOfKnowledge::challengeCalculation(const CBigNum& a_exp,const CBigNum& b_exp,
-        const CBigNum& h_exp) const {
+        const CBigNum& h_exp, const SerialNumberSoKTables* tables) const {
 
 	CBigNum a = params->coinCommitmentGroup.g;
 	CBigNum b = params->coinCommitmentGroup.h;
 	CBigNum g = params->serialNumberSoKCommitmentGroup.g;
 	CBigNum h = params->serialNumberSoKCommitmentGroup.h;
 
+	if (tables) {
+		CBigNum exponent = (tables->a.pow_mod(a_exp) * tables->b.pow_mod(b_exp)) % params->serialNumberSoKCommitmentGroup.groupOrder;
+		return (tables->g.pow_mod(exponent) * tables->h.pow_mod(h_exp)) % params->serialNumberSoKCommitmentGroup.modulus;
+	}
+
 	CBigNum exponent = (a.pow_mod(a_exp, params->serialNumberSoKCommitmentGroup.groupOrder)
 	                   * b.pow_mod(b_exp, params->serialNumberSoKCommitmentGroup.groupOrder)) % params->serialNumberSoKCommitmentGroup.groupOrder;
 
@@ -122,11 +128,12 @@ inline CBigNum SerialNumberSignatureOfKnowledge::challengeCalculation(const CBig
 }
 
 bool SerialNumberSignatureOfKnowledge::Verify(const CBigNum& coinSerialNumber, const CBigNum& valueOfCommitmentToCoin,
-        const uint256 msghash) const {
+        const uint256 msghash, bool fPrecomputed) const {
 	CBigNum a = params->coinCommitmentGroup.g;
 	CBigNum b = params->coinCommitmentGroup.h;
 	CBigNum g = params->serialNumberSoKCommitmentGroup.g;
 	CBigNum h = params->serialNumberSoKCommitmentGroup.h;
+	const SerialNumberSoKTables* tables = fPrecomputed ? SerialNumberSoKTables::Get(params) : NULL;
 	CHashWriter hasher(0,0);
 	hasher << *params << valueOfCommitmentToCoin << coinSerialNumber << msghash;
 
@@ -138,7 +145,11 @@ bool SerialNumberSignatureOfKnowledge::Verify(const CBigNum& coinSerialNumber, c
 		int byte = i / 8;
 		bool challenge_bit = ((hashbytes[byte] >> bit) & 0x01);
 		if(challenge_bit) {
-			tprime[i] = challengeCalculation(coinSerialNumber, s_notprime[i], SeedTo1024(sprime[i].getuint256()));
+			tprime[i] = challengeCalculation(coinSerialNumber, s_notprime[i], SeedTo1024(sprime[i].getuint256()), tables);
+		} else if (tables) {
+			CBigNum exp = tables->b.pow_mod(s_notprime[i]);
+			tprime[i] = (valueOfCommitmentToCoin.pow_mod(exp, params->serialNumberSoKCommitmentGroup.modulus) *
+			             tables->h.pow_mod(sprime[i])) % params->serialNumberSoKCommitmentGroup.modulus;
 		} else {
 			CBigNum exp = b.pow_mod(s_notprime[i], params->serialNumberSoKCommitmentGroup.groupOrder);
 			tprime[i] = ((valueOfCommitmentToCoin.pow_mod(exp, params->serialNumberSoKCommitmentGroup.modulus) % params->serialNumberSoKCommitmentGroup.modulus) *
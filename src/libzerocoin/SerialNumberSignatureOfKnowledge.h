@@ -28,6 +28,8 @@
 using namespace std;
 namespace libzerocoin {
 
+class SerialNumberSoKTables;
+
 /**A Signature of knowledge on the hash of metadata attesting that the signer knows the values
  *  necessary to open a commitment which contains a coin(which it self is of course a commitment)
  * with a given serial number.
@@ -47,9 +49,10 @@ public:
 	/** Verifies the Signature of knowledge.
 	 *
 	 * @param msghash hash of meta data to create a signature of knowledge on.
+	 * @param fPrecomputed use the shared fixed-base tables (see FixedBaseTables.h)
 	 * @return
 	 */
-	bool Verify(const CBigNum& coinSerialNumber, const CBigNum& valueOfCommitmentToCoin,const uint256 msghash) const;
+	bool Verify(const CBigNum& coinSerialNumber, const CBigNum& valueOfCommitmentToCoin,const uint256 msghash, bool fPrecomputed = false) const;
 	ADD_SERIALIZE_METHODS;
   template <typename Stream, typename Operation>  inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
 	    READWRITE(s_notprime);
@@ -68,7 +71,7 @@ private:
 	vector<CBigNum> s_notprime;
 	vector<CBigNum> sprime;
 	inline CBigNum challengeCalculation(const CBigNum& a_exp, const CBigNum& b_exp,
-	                                   const CBigNum& h_exp) const;
+	                                   const CBigNum& h_exp, const SerialNumberSoKTables* tables = NULL) const;
 };
 
 } /* namespace libzerocoin */
@@ -706,6 +706,7 @@ public:
     friend inline bool operator>=(const CBigNum& a, const CBigNum& b);
     friend inline bool operator<(const CBigNum& a, const CBigNum& b);
     friend inline bool operator>(const CBigNum& a, const CBigNum& b);
+    friend class CBigNumFixedBase;
 };
 
 
@@ -783,6 +784,125 @@ inline bool operator<(const CBigNum& a, const CBigNum& b)  { return (BN_cmp(a.bn
 inline bool operator>(const CBigNum& a, const CBigNum& b)  { return (BN_cmp(a.bn, b.bn) > 0); }
 inline std::ostream& operator<<(std::ostream &strm, const CBigNum &b) { return strm << b.ToString(10); }
 
+/**
+ * Fixed-base modular exponentiation: base^e mod m for a base and modulus that never change.
+ *
+ * Keeps a table of base^(d * 2^(WINDOW*i)) in Montgomery form so that an exponentiation costs
+ * one multiplication per WINDOW exponent bits and no squarings. Exponents that are negative
+ * (without an inverse table) or longer than the table fall back to CBigNum::pow_mod, so the
+ * result is always identical to base.pow_mod(e, m).
+ */
+class CBigNumFixedBase
+{
+public:
+    static const unsigned int WINDOW = 4;
+
+    /**
+     * @param base the fixed base
+     * @param m the (odd) modulus
+     * @param nMaxBits longest positive exponent covered by the table
+     * @param nMaxBitsInverse longest negative exponent covered by a table of base^-1, 0 for none
+     */
+    CBigNumFixedBase(const CBigNum& base, const CBigNum& m, unsigned int nMaxBits, unsigned int nMaxBitsInverse = 0) : base(base), modulus(m), mont(NULL)
+    {
+        // Montgomery multiplication only works for odd moduli, leave the tables empty otherwise
+        if (!BN_is_odd(m.bn))
+            return;
+
+        CAutoBN_CTX pctx;
+        mont = BN_MONT_CTX_new();
+        if (mont == NULL || !BN_MONT_CTX_set(mont, m.bn, pctx))
+            throw bignum_error("CBigNumFixedBase : BN_MONT_CTX_set failed");
+        if (!BN_to_montgomery(one.bn, CBigNum(1).bn, mont, pctx))
+            throw bignum_error("CBigNumFixedBase : BN_to_montgomery failed");
+
+        BuildTable(vTable, base % m, nMaxBits, pctx);
+        if (nMaxBitsInverse)
+            BuildTable(vTableInverse, base.inverse(m), nMaxBitsInverse, pctx);
+    }
+
+    ~CBigNumFixedBase()
+    {
+        if (mont != NULL)
+            BN_MONT_CTX_free(mont);
+    }
+
+    const CBigNum& getBase() const { return base; }
+    const CBigNum& getModulus() const { return modulus; }
+
+    /** base^e mod m */
+    CBigNum pow_mod(const CBigNum& e) const
+    {
+        if (BN_is_negative(e.bn)) {
+            if (!Covers(vTableInverse, e))
+                return base.pow_mod(e, modulus);
+            return Exp(vTableInverse, -e);
+        }
+        if (!Covers(vTable, e))
+            return base.pow_mod(e, modulus);
+        return Exp(vTable, e);
+    }
+
+private:
+    CBigNum base;
+    CBigNum modulus;
+    BN_MONT_CTX* mont;
+    CBigNum one;
+
+    // Row i holds base^(d << (WINDOW * i)) for d = 1 .. 2^WINDOW - 1
+    std::vector<std::vector<CBigNum> > vTable;
+    std::vector<std::vector<CBigNum> > vTableInverse;
+
+    CBigNumFixedBase(const CBigNumFixedBase&);
+    CBigNumFixedBase& operator=(const CBigNumFixedBase&);
+
+    void BuildTable(std::vector<std::vector<CBigNum> >& table, const CBigNum& b, unsigned int nMaxBits, CAutoBN_CTX& pctx)
+    {
+        CBigNum cur;
+        if (!BN_to_montgomery(cur.bn, b.bn, mont, pctx))
+            throw bignum_error("CBigNumFixedBase::BuildTable : BN_to_montgomery failed");
+
+        table.resize((nMaxBits + WINDOW - 1) / WINDOW);
+        for (unsigned int i = 0; i < table.size(); i++) {
+            std::vector<CBigNum>& row = table[i];
+            row.resize((1 << WINDOW) - 1);
+            row[0] = cur;
+            for (unsigned int d = 1; d < row.size(); d++) {
+                if (!BN_mod_mul_montgomery(row[d].bn, row[d - 1].bn, cur.bn, mont, pctx))
+                    throw bignum_error("CBigNumFixedBase::BuildTable : BN_mod_mul_montgomery failed");
+            }
+            // next row starts at cur^(2^WINDOW)
+            if (!BN_mod_mul_montgomery(cur.bn, row.back().bn, cur.bn, mont, pctx))
+                throw bignum_error("CBigNumFixedBase::BuildTable : BN_mod_mul_montgomery failed");
+        }
+    }
+
+    bool Covers(const std::vector<std::vector<CBigNum> >& table, const CBigNum& e) const
+    {
+        return mont != NULL && (unsigned int)BN_num_bits(e.bn) <= table.size() * WINDOW;
+    }
+
+    CBigNum Exp(const std::vector<std::vector<CBigNum> >& table, const CBigNum& e) const
+    {
+        CAutoBN_CTX pctx;
+        CBigNum acc = one;
+        const int nBits = BN_num_bits(e.bn);
+        for (int i = 0; i * (int)WINDOW < nBits; i++) {
+            unsigned int d = 0;
+            for (unsigned int j = 0; j < WINDOW; j++) {
+                if (BN_is_bit_set(e.bn, i * WINDOW + j))
+                    d |= 1 << j;
+            }
+            if (d && !BN_mod_mul_montgomery(acc.bn, acc.bn, table[i][d - 1].bn, mont, pctx))
+                throw bignum_error("CBigNumFixedBase::Exp : BN_mod_mul_montgomery failed");
+        }
+        CBigNum ret;
+        if (!BN_from_montgomery(ret.bn, acc.bn, mont, pctx))
+            throw bignum_error("CBigNumFixedBase::Exp : BN_from_montgomery failed");
+        return ret;
+    }
+};
+
 typedef CBigNum Bignum;
 
 #endif
\ No newline at end of file
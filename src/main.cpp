@@ -9,14 +9,19 @@
 
 #include "main.h"
 #include "accumulators.h"
+#include "addressindex.h"
 #include "addrman.h"
 #include "alert.h"
 #include "base58.h"
+#include "blockcache.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode-budget.h"
@@ -41,9 +46,11 @@
 #include "libzerocoin/Denominations.h"
 #include "primitives/zerocoin.h"
 
+#include <atomic>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/thread.hpp>
@@ -88,10 +95,12 @@ bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fAddrIndex = true;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 unsigned int nBytesPerSigOp = DEFAULT_BYTES_PER_SIGOP;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -193,6 +202,7 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, set while waiting for the blocktxn of a cmpctblock.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -253,10 +263,23 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    //! Since when we have had blocks in flight from this peer (in microseconds), or 0.
+    int64_t nDownloadingSince;
+    //! Time spent with blocks in flight from this peer before nDownloadingSince (in microseconds).
+    int64_t nDownloadTime;
+    //! Blocks received from this peer that we had requested, and their serialized size.
+    int nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    //! How many times this peer held back the block download window.
+    int nStalls;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Whether this peer wants new blocks announced with cmpctblock rather than inv.
+    bool fPreferHeaderAndIDs;
+    //! Length of the current run of headers messages from this peer that did not connect to our index.
+    int nUnconnectingHeaders;
 
     CNodeState()
     {
@@ -269,8 +292,15 @@ struct CNodeState {
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nDownloadingSince = 0;
+        nDownloadTime = 0;
+        nBlocksDownloaded = 0;
+        nBlockBytesDownloaded = 0;
+        nStalls = 0;
         fPreferredDownload = false;
         fHaveWitness = false;
+        fPreferHeaderAndIDs = false;
+        nUnconnectingHeaders = 0;
     }
 };
 
@@ -336,8 +366,8 @@ void FinalizeNode(NodeId nodeid)
     mapNodeState.erase(nodeid);
 }
 
-// Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+// Requires cs_main. nSize is the size of the block if it actually arrived, to credit the peer it was requested from.
+void MarkBlockAsReceived(const uint256& hash, unsigned int nSize = 0)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
@@ -346,12 +376,20 @@ void MarkBlockAsReceived(const uint256& hash)
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        if (nSize > 0) {
+            state->nBlocksDownloaded++;
+            state->nBlockBytesDownloaded += nSize;
+        }
+        if (state->nBlocksInFlight == 0) {
+            state->nDownloadTime += GetTimeMicros() - state->nDownloadingSince;
+            state->nDownloadingSince = 0;
+        }
         mapBlocksInFlight.erase(itInFlight);
     }
 }
 
-// Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+// Requires cs_main. Returns the new queue entry.
+list<QueuedBlock>::iterator MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -359,11 +397,13 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, std::shared_ptr<PartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
-    state->nBlocksInFlight++;
+    if (state->nBlocksInFlight++ == 0)
+        state->nDownloadingSince = newentry.nTime;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    return it;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -520,6 +560,13 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlockBytesDownloaded = state->nBlockBytesDownloaded;
+    // Only time with blocks in flight counts, so an idle peer keeps the rate it had while downloading
+    int64_t nDownloadTime = state->nDownloadTime + (state->nDownloadingSince ? GetTimeMicros() - state->nDownloadingSince : 0);
+    stats.dBlockDownloadRate = nDownloadTime > 0 ? state->nBlockBytesDownloaded * 1000000.0 / nDownloadTime : 0.0;
+    stats.fStalling = state->nStallingSince != 0;
+    stats.nStalls = state->nStalls;
     return true;
 }
 
@@ -835,11 +882,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
+        if (!coin.IsSpent()) {
+            if (coin.nHeight < 0) return 0;
+            return (chainActive.Tip()->nHeight + 1) - coin.nHeight;
         } else
             return -1;
     }
@@ -909,12 +956,21 @@ bool GetCoinAge(const CTransaction& tx, const unsigned int nTxTime, uint64_t& nC
     uint256 bnCentSecond = 0; // coin age in the unit of cent-seconds
     nCoinAge = 0;
 
+    // First try finding the previous transactions in database, all in one pass over the block files
+    std::vector<uint256> vHashPrev;
+    vHashPrev.reserve(tx.vin.size());
+    BOOST_FOREACH (const CTxIn& txin, tx.vin)
+        vHashPrev.push_back(txin.prevout.hash);
+    std::vector<CTransaction> vTxPrev;
+    std::vector<uint256> vHashBlockPrev;
+    GetTransactions(vHashPrev, vTxPrev, vHashBlockPrev, true);
+
     CBlockIndex* pindex = NULL;
-    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        // First try finding the previous transaction in database
-        CTransaction txPrev;
-        uint256 hashBlockPrev;
-        if (!GetTransaction(txin.prevout.hash, txPrev, hashBlockPrev, true)) {
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CTxIn& txin = tx.vin[i];
+        const CTransaction& txPrev = vTxPrev[i];
+        const uint256& hashBlockPrev = vHashBlockPrev[i];
+        if (hashBlockPrev == 0) {
             LogPrintf("GetCoinAge: failed to find vin transaction \n");
             continue; // previous transaction not in main chain
         }
@@ -1292,7 +1348,7 @@ bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend
     return true;
 }
 
-bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidationState& state, int nHeight)
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, int nHeight, std::vector<CZerocoinSpendCheck>* pvZerocoinChecks)
 {
     //max needed non-mint outputs should be 2 - one for redemption address and a possible 2nd for change
     if (tx.vout.size() > 2) {
@@ -1346,11 +1402,14 @@ bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidatio
                 return state.DoS(100, error("%s: Zerocoinspend could not find accumulator associated with checksum %s", __func__, HexStr(BEGIN(nChecksum), END(nChecksum))));
             }
 
-            Accumulator accumulator(GetZerocoinParams(nHeight), newSpend.getDenomination(), bnAccumulatorValue);
-
-            //Check that the coin has been accumulated
-            if (!newSpend.Verify(accumulator))
+            CZerocoinSpendCheck check(newSpend, GetZerocoinParams(nHeight), bnAccumulatorValue, tx.GetHash());
+            if (pvZerocoinChecks) {
+                pvZerocoinChecks->push_back(CZerocoinSpendCheck());
+                check.swap(pvZerocoinChecks->back());
+            } else if (!check()) {
+                //Check that the coin has been accumulated
                 return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
+            }
         }
 
         if (serials.count(newSpend.getCoinSerialNumber()))
@@ -1370,7 +1429,54 @@ bool CheckZerocoinSpend(const CTransaction tx, bool fVerifySignature, CValidatio
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fWitnessEnabled)
+static std::atomic<int64_t> nZerocoinSpendChecks(0);
+static std::atomic<int64_t> nTimeZerocoinSpendChecks(0);
+
+bool CZerocoinSpendCheck::operator()()
+{
+    int64_t nTimeStart = GetTimeMicros();
+    // A check holds a single spend, verified directly on the precomputed tables
+    Accumulator accumulator(params, pspend->getDenomination(), bnAccumulatorValue);
+    bool fValid = pspend->Verify(accumulator, true);
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+
+    nZerocoinSpendChecks++;
+    nTimeZerocoinSpendChecks += nTime;
+    LogPrint("bench", "        - Verify zerocoin spend %s in tx %s: %.2fms\n", pspend->getCoinSerialNumber().GetHex().substr(0, 10), txid.GetHex(), 0.001 * nTime);
+
+    if (!fValid)
+        return ::error("CZerocoinSpendCheck(): zerocoin spend in tx %s did not verify", txid.GetHex());
+    return true;
+}
+
+void GetZerocoinSpendCheckStats(int64_t& nCount, int64_t& nTimeMicros)
+{
+    nCount = nZerocoinSpendChecks;
+    nTimeMicros = nTimeZerocoinSpendChecks;
+}
+
+/** Zerocoin spend proofs are verified on their own pool, sized like the script check pool (-par).
+ *  Its users are serialized by the queue's ControlMutex, so it is only held by RunZerocoinSpendChecks. */
+static CCheckQueue<CZerocoinSpendCheck> zerocoinspendcheckqueue(1);
+
+void ThreadZerocoinSpendCheck()
+{
+    RenameThread("beetok-zcspendch");
+    zerocoinspendcheckqueue.Thread();
+}
+
+/** Verify spend proofs collected by CheckTransaction on the zerocoin check pool. Nothing taking cs_main may run
+ *  while the queue is held: callers holding cs_main lock it before ControlMutex, and so must every other caller. */
+static bool RunZerocoinSpendChecks(std::vector<CZerocoinSpendCheck>& vChecks)
+{
+    if (vChecks.empty())
+        return true;
+    CCheckQueueControl<CZerocoinSpendCheck> control(&zerocoinspendcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fWitnessEnabled, std::vector<CZerocoinSpendCheck>* pvZerocoinChecks)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1420,7 +1526,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 
             // Do not require signature verification if this is initial sync and a block over 24 hours old
             bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60 * 60 * 24));
-            if (!CheckZerocoinSpend(tx, fVerifySignature, state, chainActive.Height()))
+            if (!CheckZerocoinSpend(tx, fVerifySignature, state, chainActive.Height(), pvZerocoinChecks))
                 return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
     }
@@ -1514,7 +1620,22 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
         }
 
 
+        /** Evict expired transactions, then the lowest scoring packages until the pool fits in limit bytes */
+        static void LimitMempoolSize(CTxMemPool & pool, size_t limit, int64_t age)
+        {
+            int expired = pool.Expire(GetTime() - age);
+            if (expired != 0)
+                LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+            pool.TrimToSize(limit);
+        }
+
         bool AcceptToMemoryPool(CTxMemPool & pool, CValidationState & state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+        {
+            return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+        }
+
+        bool AcceptToMemoryPoolWithTime(CTxMemPool & pool, CValidationState & state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
         {
             AssertLockHeld(cs_main);
             if (pfMissingInputs)
@@ -1524,9 +1645,12 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
             if (GetAdjustedTime() > GetSporkValue(SPORK_19_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
                 return state.DoS(10, error("AcceptToMemoryPool : Zerocoin transactions are temporarily disabled for maintenance"), REJECT_INVALID, "bad-tx");
 
-            if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < chainActive.Tip()->nTime)) {
+            std::vector<CZerocoinSpendCheck> vZerocoinChecks;
+            if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < chainActive.Tip()->nTime, nScriptCheckThreads ? &vZerocoinChecks : NULL)) {
                 return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
             }
+            if (!RunZerocoinSpendChecks(vZerocoinChecks))
+                return state.DoS(100, error("AcceptToMemoryPool: : zerocoin spend did not verify"), REJECT_INVALID, "bad-tx");
 
             // Coinbase is only valid in a block, not as a loose transaction
             if (tx.IsCoinBase())
@@ -1610,15 +1734,15 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                     CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
                     view.SetBackend(viewMemPool);
 
-                    // do we already have it?
-                    if (view.HaveCoins(hash))
-                        return false;
-
                     // do all inputs exist?
-                    // Note that this does not check for the presence of actual outputs (see the next check for that),
-                    // only helps filling in pfMissingInputs (to determine missing vs spent).
                     for (const CTxIn txin : tx.vin) {
-                        if (!view.HaveCoins(txin.prevout.hash)) {
+                        if (!view.HaveCoin(txin.prevout)) {
+                            // Are the inputs missing because we already have the tx? Only the
+                            // cache is asked: a miss just treats the tx as an orphan.
+                            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                                if (pcoinsTip->HaveCoinInCache(COutPoint(hash, i)))
+                                    return false;
+                            }
                             if (pfMissingInputs)
                                 *pfMissingInputs = true;
                             return false;
@@ -1674,7 +1798,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                 CAmount nFees = nValueIn - nValueOut;
                 double dPriority = view.GetPriority(tx, chainActive.Height());
 
-                CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), nSigOpsCost);
+                CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), nSigOpsCost);
 
                 unsigned int nSize = entry.GetTxSize();
 
@@ -1686,6 +1810,12 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                 if (mapObfuscationBroadcastTxes.count(hash)) {
                     mempool.PrioritiseTransaction(hash, hash.ToString(), 1000, 0.1 * COIN);
                 } else if (!ignoreFees) {
+                    // Once the pool has been full, new transactions must outbid what was evicted
+                    CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+                    if (mempoolRejectFee > 0 && nFees < mempoolRejectFee && !tx.IsZerocoinSpend())
+                        return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d", hash.ToString(), nFees, mempoolRejectFee),
+                            REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
                     CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
                     if (fLimitFree && nFees < txMinFee && !tx.IsZerocoinSpend())
                         return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d", hash.ToString(), nFees, txMinFee),
@@ -1731,6 +1861,17 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                         nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
 
+                // Calculate in-mempool ancestors, up to a limit.
+                CTxMemPool::setEntries setAncestors;
+                size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+                size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+                size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+                size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+                std::string errString;
+                if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                    return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), errString),
+                        REJECT_NONSTANDARD, "too-long-mempool-chain");
+
                 unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
                 if (!Params().RequireStandard()) {
                     scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
@@ -1738,33 +1879,41 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 
                 // Check against previous transactions
                 // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-                if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true)) {
+                if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false)) {
                     // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
                     // need to turn both off, and compare against just turning off CLEANSTACK
                     // to see if the failure is specifically due to witness validation.
-                    if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true) &&
-                        !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true)) {
+                    if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false) &&
+                        !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false)) {
                         // Only the witness is wrong, so the transaction itself may be fine.
                         state.SetCorruptionPossible();
                     }
                     return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
                 }
 
-                // Check again against just the consensus-critical mandatory script
-                // verification flags, in case of bugs in the standard flags that cause
+                // Check again against the consensus-critical flags the next block will be
+                // validated with, in case of bugs in the standard flags that cause
                 // transactions to pass as valid when they're actually invalid. For
                 // instance the STRICTENC flag was incorrectly allowing certain
                 // CHECKSIG NOT scripts to pass, even though they were invalid.
+                // The signatures are cached by now, so this is cheap, and it stores
+                // the result in the script execution cache for ConnectBlock.
                 //
                 // There is a similar check in CreateNewBlock() to prevent creating
                 // invalid blocks, however allowing such transactions into the mempool
                 // can be exploited as a DoS attack.
-                if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-                    return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+                if (!CheckInputs(tx, state, view, true, GetBlockScriptFlags(GetAdjustedTime()) | MANDATORY_SCRIPT_VERIFY_FLAGS, true, true)) {
+                    return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s", hash.ToString());
                 }
 
                 // Store transaction in memory
-                pool.addUnchecked(hash, entry);
+                pool.addUnchecked(hash, entry, setAncestors);
+
+                // Trim the pool back to its limits, which may evict this transaction again
+                LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+                if (!pool.exists(hash))
+                    return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString()),
+                        REJECT_INSUFFICIENTFEE, "mempool full");
             }
 
             SyncWithWallets(tx, NULL);
@@ -1816,14 +1965,42 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
             return true;
         }
 
+        bool GetAddressIndexKey(const CTxDestination& dest, uint160& hashBytes, int& type)
+        {
+            if (const CKeyID* pkeyid = boost::get<CKeyID>(&dest)) {
+                hashBytes = static_cast<uint160>(*pkeyid);
+                type = ADDRESS_TYPE_PUBKEYHASH;
+            } else if (const CScriptID* pscriptid = boost::get<CScriptID>(&dest)) {
+                hashBytes = static_cast<uint160>(*pscriptid);
+                type = ADDRESS_TYPE_SCRIPTHASH;
+            } else if (const WitnessV0KeyHash* pwitnessid = boost::get<WitnessV0KeyHash>(&dest)) {
+                hashBytes = static_cast<uint160>(*pwitnessid);
+                type = ADDRESS_TYPE_WITNESS_V0_KEYHASH;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        bool GetAddressIndexKey(const CScript& scriptPubKey, uint160& hashBytes, int& type)
+        {
+            CTxDestination dest;
+            if (!ExtractDestination(scriptPubKey, dest))
+                return false;
+            return GetAddressIndexKey(dest, hashBytes, type);
+        }
+
         bool AcceptableInputs(CTxMemPool & pool, CValidationState & state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
         {
             AssertLockHeld(cs_main);
             if (pfMissingInputs)
                 *pfMissingInputs = false;
 
-            if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < chainActive.Tip()->nTime))
+            std::vector<CZerocoinSpendCheck> vZerocoinChecks;
+            if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < chainActive.Tip()->nTime, nScriptCheckThreads ? &vZerocoinChecks : NULL))
                 return error("AcceptableInputs: : CheckTransaction failed");
+            if (!RunZerocoinSpendChecks(vZerocoinChecks))
+                return state.DoS(100, error("AcceptableInputs: : zerocoin spend did not verify"), REJECT_INVALID, "bad-tx");
 
             // Coinbase is only valid in a block, not as a loose transaction
             if (tx.IsCoinBase())
@@ -1878,15 +2055,15 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                     CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
                     view.SetBackend(viewMemPool);
 
-                    // do we already have it?
-                    if (view.HaveCoins(hash))
-                        return false;
-
                     // do all inputs exist?
-                    // Note that this does not check for the presence of actual outputs (see the next check for that),
-                    // only helps filling in pfMissingInputs (to determine missing vs spent).
                     for (const CTxIn txin : tx.vin) {
-                        if (!view.HaveCoins(txin.prevout.hash)) {
+                        if (!view.HaveCoin(txin.prevout)) {
+                            // Are the inputs missing because we already have the tx? Only the
+                            // cache is asked: a miss just treats the tx as an orphan.
+                            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                                if (pcoinsTip->HaveCoinInCache(COutPoint(hash, i)))
+                                    return false;
+                            }
                             if (pfMissingInputs)
                                 *pfMissingInputs = true;
                             return false;
@@ -1993,7 +2170,7 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
 
                 // Check against previous transactions
                 // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-                if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+                if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true, false)) {
                     return error("AcceptableInputs: : ConnectInputs failed %s", hash.ToString());
                 }
 
@@ -2021,6 +2198,145 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
             return true;
         }
 
+        bool LoadMempool()
+        {
+            int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+            boost::filesystem::path path = GetDataDir() / "mempool.dat";
+            CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s : failed to open %s", __func__, path.string());
+
+            std::vector<std::pair<CTransaction, int64_t> > vTx;
+            if (!mempool.ReadMempool(file, vTx))
+                return false;
+
+            int64_t nNow = GetTime();
+            int nAccepted = 0, nFailed = 0, nExpired = 0;
+            for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vTx.begin(); it != vTx.end(); it++) {
+                if (ShutdownRequested())
+                    return false;
+                if (it->second + nExpiryTimeout <= nNow) {
+                    ++nExpired;
+                    continue;
+                }
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, it->first, true, NULL, it->second))
+                    ++nAccepted;
+                else
+                    ++nFailed;
+            }
+            LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", nAccepted, nFailed, nExpired);
+            return true;
+        }
+
+        bool DumpMempool()
+        {
+            int64_t nStart = GetTimeMicros();
+            boost::filesystem::path path = GetDataDir() / "mempool.dat";
+            boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+            CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s : failed to open %s", __func__, pathTmp.string());
+            if (!mempool.WriteMempool(file))
+                return false;
+            FileCommit(file.Get());
+            file.fclose();
+            if (!RenameOver(pathTmp, path))
+                return error("%s : failed to rename %s", __func__, pathTmp.string());
+            LogPrintf("Dumped mempool: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+            return true;
+        }
+
+        /** Serialized size of the header of the block an index entry records, or 0 when that block is not known */
+        static unsigned int GetIndexedHeaderSize(const CDiskTxIndex& postx)
+        {
+            AssertLockHeld(cs_main);
+            if (!postx.HasBlock())
+                return 0;
+            BlockMap::const_iterator mi = mapBlockIndex.find(postx.hashBlock);
+            if (mi == mapBlockIndex.end())
+                return 0;
+            return ::GetSerializeSize(mi->second->GetBlockHeader(), SER_DISK, CLIENT_VERSION);
+        }
+
+        /** Read a transaction from a block file positioned at the start of its block, see GetIndexedHeaderSize */
+        static bool ReadIndexedTransaction(CAutoFile& file, const CDiskTxIndex& postx, unsigned int nHeaderSize, CTransaction& txOut, uint256& hashBlock)
+        {
+            try {
+                if (nHeaderSize > 0) {
+                    // The entry records its block, so the header is skipped instead of read and hashed
+                    if (fseek(file.Get(), nHeaderSize + postx.nTxOffset, SEEK_CUR))
+                        return error("%s : fseek past the header failed", __func__);
+                    hashBlock = postx.hashBlock;
+                } else {
+                    // Legacy index entries do not record the block, so hash the header as before
+                    CBlockHeader header;
+                    file >> header;
+                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    hashBlock = header.GetHash();
+                }
+                file >> txOut;
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            return true;
+        }
+
+        bool GetTransactions(const std::vector<uint256>& vHash, std::vector<CTransaction>& vTxOut, std::vector<uint256>& vHashBlock, bool fAllowSlow)
+        {
+            vTxOut.assign(vHash.size(), CTransaction());
+            vHashBlock.assign(vHash.size(), uint256());
+            std::vector<bool> vFound(vHash.size(), false);
+            std::vector<std::pair<CDiskTxIndex, size_t> > vPos;
+            std::vector<unsigned int> vHeaderSize(vHash.size(), 0);
+
+            if (fTxIndex) {
+                {
+                    LOCK(cs_main);
+                    for (size_t i = 0; i < vHash.size(); i++) {
+                        if (mempool.lookup(vHash[i], vTxOut[i])) {
+                            vFound[i] = true;
+                            continue;
+                        }
+                        CDiskTxIndex postx;
+                        if (pblocktree->ReadTxIndex(vHash[i], postx)) {
+                            vPos.push_back(std::make_pair(postx, i));
+                            vHeaderSize[i] = GetIndexedHeaderSize(postx);
+                        }
+                    }
+                }
+
+                // Visit the block files in disk order so that reads are sequential
+                std::sort(vPos.begin(), vPos.end(), [](const std::pair<CDiskTxIndex, size_t>& a, const std::pair<CDiskTxIndex, size_t>& b) {
+                    return (const CDiskTxPos&)a.first < (const CDiskTxPos&)b.first;
+                });
+
+                for (size_t i = 0; i < vPos.size();) {
+                    const int nFile = vPos[i].first.nFile;
+                    CAutoFile file(OpenBlockFile(CDiskBlockPos(nFile, 0), true), SER_DISK, CLIENT_VERSION);
+                    if (file.IsNull())
+                        return error("%s: OpenBlockFile failed", __func__);
+                    for (; i < vPos.size() && vPos[i].first.nFile == nFile; i++) {
+                        const CDiskTxIndex& postx = vPos[i].first;
+                        const size_t nIndex = vPos[i].second;
+                        if (fseek(file.Get(), postx.nPos, SEEK_SET))
+                            return error("%s: fseek to %u in block file %d failed", __func__, postx.nPos, nFile);
+                        if (!ReadIndexedTransaction(file, postx, vHeaderSize[nIndex], vTxOut[nIndex], vHashBlock[nIndex]))
+                            return false;
+                        if (vTxOut[nIndex].GetHash() != vHash[nIndex])
+                            return error("%s : txid mismatch", __func__);
+                        vFound[nIndex] = true;
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < vHash.size(); i++)
+                    vFound[i] = GetTransaction(vHash[i], vTxOut[i], vHashBlock[i], fAllowSlow);
+            }
+
+            return std::find(vFound.begin(), vFound.end(), false) == vFound.end();
+        }
+
         /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
         bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
         {
@@ -2034,20 +2350,13 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                 }
 
                 if (fTxIndex) {
-                    CDiskTxPos postx;
+                    CDiskTxIndex postx;
                     if (pblocktree->ReadTxIndex(hash, postx)) {
                         CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
                         if (file.IsNull())
                             return error("%s: OpenBlockFile failed", __func__);
-                        CBlockHeader header;
-                        try {
-                            file >> header;
-                            fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                            file >> txOut;
-                        } catch (std::exception& e) {
-                            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                        }
-                        hashBlock = header.GetHash();
+                        if (!ReadIndexedTransaction(file, postx, GetIndexedHeaderSize(postx), txOut, hashBlock))
+                            return false;
                         if (txOut.GetHash() != hash)
                             return error("%s : txid mismatch", __func__);
                         return true;
@@ -2060,10 +2369,9 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
                 if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
                     int nHeight = -1;
                     {
-                        CCoinsViewCache& view = *pcoinsTip;
-                        const CCoins* coins = view.AccessCoins(hash);
-                        if (coins)
-                            nHeight = coins->nHeight;
+                        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                        if (!coin.IsSpent())
+                            nHeight = coin.nHeight;
                     }
                     if (nHeight > 0)
                         pindexSlow = chainActive[nHeight];
@@ -2113,39 +2421,68 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
             return true;
         }
 
-        bool ReadBlockFromDisk(CBlock & block, const CDiskBlockPos& pos)
+        /** Read a block from its mapped block file, or from the file itself, hashing the header once */
+        static bool ReadBlockFromFile(CBlock & block, const CDiskBlockPos& pos, uint256& hashBlock, unsigned int& nBlockSize)
         {
             block.SetNull();
 
-            // Open history file to read
-            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-            if (filein.IsNull())
-                return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-            // Read block
             try {
-                filein >> block;
+                if (!blockreadcache.ReadFromMappedFile(pos, block, nBlockSize)) {
+                    // Open history file to read
+                    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+                    if (filein.IsNull())
+                        return error("ReadBlockFromDisk : OpenBlockFile failed");
+
+                    // Read block
+                    filein >> block;
+                    nBlockSize = filein.GetSerializeSize(block);
+                }
             } catch (std::exception& e) {
                 return error("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
 
             // Check the header
+            hashBlock = block.GetHash();
             if (block.IsProofOfWork()) {
-                if (!CheckProofOfWork(block.GetHash(), block.nBits))
+                if (!CheckProofOfWork(hashBlock, block.nBits))
                     return error("ReadBlockFromDisk : Errors in block header");
             }
 
             return true;
         }
 
+        bool ReadBlockFromDisk(CBlock & block, const CDiskBlockPos& pos)
+        {
+            std::shared_ptr<const CBlock> pblock = blockreadcache.Get(pos);
+            if (pblock) {
+                block = *pblock;
+                return true;
+            }
+
+            uint256 hashBlock;
+            unsigned int nBlockSize;
+            return ReadBlockFromFile(block, pos, hashBlock, nBlockSize);
+        }
+
         bool ReadBlockFromDisk(CBlock & block, const CBlockIndex* pindex)
         {
-            if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+            // Cached blocks were checked against the index when they were read
+            const CDiskBlockPos pos = pindex->GetBlockPos();
+            std::shared_ptr<const CBlock> pblock = blockreadcache.Get(pos);
+            if (pblock) {
+                block = *pblock;
+                return true;
+            }
+
+            uint256 hashBlock;
+            unsigned int nBlockSize;
+            if (!ReadBlockFromFile(block, pos, hashBlock, nBlockSize))
                 return false;
-            if (block.GetHash() != pindex->GetBlockHash()) {
-                LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
+            if (hashBlock != pindex->GetBlockHash()) {
+                LogPrintf("%s : block=%s index=%s\n", __func__, hashBlock.ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
                 return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
             }
+            blockreadcache.Insert(pos, std::make_shared<const CBlock>(block), nBlockSize);
             return true;
         }
 
@@ -2388,34 +2725,15 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             if (!tx.IsCoinBase()) {
                 txundo.vprevout.reserve(tx.vin.size());
                 BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                    txundo.vprevout.push_back(CTxInUndo());
-                    bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
-                    assert(ret);
-                }
-            }
-
-            // add outputs
-            inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
-        }
-
-
-		/*
-        void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight)
-        {
-            // mark inputs spent
-            if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) {
-                txundo.vprevout.reserve(tx.vin.size());
-                BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                    txundo.vprevout.push_back(CTxInUndo());
-                    bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+                    txundo.vprevout.push_back(Coin());
+                    bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
                     assert(ret);
                 }
             }
 
             // add outputs
-            inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+            AddCoins(inputs, tx, nHeight);
         }
-		*/
 
         bool CScriptCheck::operator()()
         {
@@ -2427,7 +2745,33 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             return true;
         }
 
-        bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+        /** Transactions whose scripts passed with a given set of flags, keyed by salted (wtxid, flags); guarded by cs_main */
+        static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+        static uint256 scriptExecutionCacheNonce(GetRandHash());
+
+        void InitScriptExecutionCache()
+        {
+            int64_t nMaxCacheSize = std::min<int64_t>(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), 0x40000000);
+            if (nMaxCacheSize <= 0) {
+                LogPrintf("Script execution cache disabled\n");
+                return;
+            }
+            uint32_t nEntries = scriptExecutionCache.setup(nMaxCacheSize);
+            LogPrintf("Using %u MiB for the script execution cache, able to store %u elements\n",
+                (unsigned int)((nEntries * sizeof(uint256)) >> 20), nEntries);
+        }
+
+        unsigned int GetBlockScriptFlags(int64_t nBlockTime)
+        {
+            unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+
+            if (GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < nBlockTime) {
+                flags |= SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+            }
+            return flags;
+        }
+
+        bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, bool cacheFullScriptStore, std::vector<CScriptCheck>* pvChecks)
         {
             //if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) {
             if (!tx.IsCoinBase()) {  
@@ -2447,20 +2791,20 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 CAmount nFees = 0;
                 for (unsigned int i = 0; i < tx.vin.size(); i++) {
                     const COutPoint& prevout = tx.vin[i].prevout;
-                    const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                    assert(coins);
+                    const Coin& coin = inputs.AccessCoin(prevout);
+                    assert(!coin.IsSpent());
 
                     // If prev is coinbase, check that it's matured
-                    if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                        if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+                    if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                        if (nSpendHeight - coin.nHeight < Params().COINBASE_MATURITY())
                             return state.Invalid(
-                                error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                                error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coin.nHeight, coin.IsCoinStake()),
                                 REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                     }
 
                     // Check for negative or overflow input values
-                    nValueIn += coins->vout[prevout.n].nValue;
-                    if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+                    nValueIn += coin.out.nValue;
+                    if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                         return state.DoS(100, error("CheckInputs() : txin values out of range"),
                             REJECT_INVALID, "bad-txns-inputvalues-outofrange");
                 }
@@ -2488,13 +2832,22 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 // before the last block chain checkpoint. This is safe because block merkle hashes are
                 // still computed and checked, and any change will be caught at the next checkpoint.
                 if (fScriptChecks) {
+                    // Scripts that already passed with these flags, typically when the transaction entered
+                    // the mempool, need not run again. The entry commits to the witness hash, so a
+                    // transaction relayed with a different witness is checked in full.
+                    AssertLockHeld(cs_main);
+                    uint256 hashCacheEntry;
+                    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+                    if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore))
+                        return true;
+
                     for (unsigned int i = 0; i < tx.vin.size(); i++) {
                         const COutPoint& prevout = tx.vin[i].prevout;
-                        const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                        assert(coins);
+                        const Coin& coin = inputs.AccessCoin(prevout);
+                        assert(!coin.IsSpent());
 
                         // Verify signature
-                        CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                        CScriptCheck check(coin.out, tx, i, flags, cacheStore);
                         if (pvChecks) {
                             pvChecks->push_back(CScriptCheck());
                             check.swap(pvChecks->back());
@@ -2506,7 +2859,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                                 // arguments; if so, don't trigger DoS protection to
                                 // avoid splitting the network between upgraded and
                                 // non-upgraded nodes.
-                                CScriptCheck check2(*coins, tx, i,
+                                CScriptCheck check2(coin.out, tx, i,
                                     flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                                 if (check2())
                                     return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2521,6 +2874,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                             return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                         }
                     }
+
+                    // Checks handed to the caller have not run yet, so only inline results are cached
+                    if (cacheFullScriptStore && !pvChecks)
+                        scriptExecutionCache.insert(hashCacheEntry);
                 }
             }
 
@@ -2548,6 +2905,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
                 return error("DisconnectBlock() : block and undo data inconsistent");
 
+            std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+            std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+
             // undo transactions in reverse order
             for (int i = block.vtx.size() - 1; i >= 0; i--) {
                 const CTransaction& tx = block.vtx[i];
@@ -2586,26 +2947,28 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
                 uint256 hash = tx.GetHash();
 
+                if (fAddressIndex) {
+                    for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                        const CTxOut& txout = tx.vout[k];
+                        uint160 hashBytes;
+                        int addressType;
+                        if (!GetAddressIndexKey(txout.scriptPubKey, hashBytes, addressType))
+                            continue;
+                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, k, false), txout.nValue));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, hash, k), CAddressUnspentValue()));
+                    }
+                }
+
                 // Check that all outputs are available and match the outputs in the block itself
-                // exactly. Note that transactions with only provably unspendable outputs won't
-                // have outputs available even in the block itself, so we handle that case
-                // specially with outsEmpty.
-                {
-                    CCoins outsEmpty;
-                    CCoinsModifier outs = view.ModifyCoins(hash);
-                    outs->ClearUnspendable();
-
-                    CCoins outsBlock(tx, pindex->nHeight);
-                    // The CCoins serialization does not serialize negative numbers.
-                    // No network rules currently depend on the version here, so an inconsistency is harmless
-                    // but it must be corrected before txout nversion ever influences a network rule.
-                    if (outsBlock.nVersion < 0)
-                        outs->nVersion = outsBlock.nVersion;
-                    if (*outs != outsBlock)
+                // exactly, and spend them. Provably unspendable outputs were never added.
+                for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                    if (tx.vout[k].scriptPubKey.IsUnspendable())
+                        continue;
+                    Coin coin;
+                    bool fSpent = view.SpendCoin(COutPoint(hash, k), &coin);
+                    if (!fSpent || tx.vout[k] != coin.out || coin.nHeight != pindex->nHeight ||
+                        coin.fCoinBase != tx.IsCoinBase() || coin.fCoinStake != tx.IsCoinStake())
                         fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-                    // remove outputs
-                    outs->Clear();
                 }
 
                 // restore inputs
@@ -2615,25 +2978,36 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                         return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
                     for (unsigned int j = tx.vin.size(); j-- > 0;) {
                         const COutPoint& out = tx.vin[j].prevout;
-                        const CTxInUndo& undo = txundo.vprevout[j];
-                        CCoinsModifier coins = view.ModifyCoins(out.hash);
-                        if (undo.nHeight != 0) {
-                            // undo data contains height: this is the last output of the prevout tx being spent
-                            if (!coins->IsPruned())
-                                fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                            coins->Clear();
-                            coins->fCoinBase = undo.fCoinBase;
-                            coins->nHeight = undo.nHeight;
-                            coins->nVersion = undo.nVersion;
-                        } else {
-                            if (coins->IsPruned())
+                        Coin undo = txundo.vprevout[j];
+                        if (undo.nHeight == 0) {
+                            // Undo data written before the coin database kept one record per output
+                            // carries the metadata only with the last spent output of a transaction;
+                            // that output was restored first, so take the metadata from it.
+                            const Coin& alternate = AccessByTxid(view, out.hash);
+                            if (alternate.IsSpent()) {
                                 fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
+                            } else {
+                                undo.nHeight = alternate.nHeight;
+                                undo.fCoinBase = alternate.fCoinBase;
+                                undo.fCoinStake = alternate.fCoinStake;
+                            }
                         }
-                        if (coins->IsAvailable(out.n))
+                        bool fOverwrite = view.HaveCoin(out);
+                        if (fOverwrite)
                             fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                        if (coins->vout.size() < out.n + 1)
-                            coins->vout.resize(out.n + 1);
-                        coins->vout[out.n] = undo.txout;
+                        view.AddCoin(out, undo, fOverwrite);
+
+                        if (fAddressIndex) {
+                            uint160 hashBytes;
+                            int addressType;
+                            if (GetAddressIndexKey(undo.out.scriptPubKey, hashBytes, addressType)) {
+                                // undo the spend and restore the output to the unspent index
+                                addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, j, true), -undo.out.nValue));
+                                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, out.hash, out.n), CAddressUnspentValue(undo.out.nValue, undo.out.scriptPubKey, undo.nHeight)));
+                            }
+                        }
+                        if (fSpentIndex)
+                            spentIndex.push_back(make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
 
                         // erase the spent input
                         mapStakeSpent.erase(out);
@@ -2651,6 +3025,20 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     if (!EraseAccumulatorValues(nCheckpoint, pindex->pprev->nAccumulatorCheckpoint))
                         return error("DisconnectBlock(): failed to erase checkpoint");
                 }
+
+                //this block's mints are no longer pending accumulation
+                RemovePendingMints(pindex);
+
+                if (fAddressIndex) {
+                    if (!pblocktree->EraseAddressIndex(addressIndex))
+                        return error("DisconnectBlock() : failed to erase address balance index");
+                    if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+                        return error("DisconnectBlock() : failed to write address unspent index");
+                }
+
+                if (fSpentIndex)
+                    if (!pblocktree->UpdateSpentIndex(spentIndex))
+                        return error("DisconnectBlock() : failed to erase spent index");
             }
 
             if (pfClean) {
@@ -2669,8 +3057,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
             FILE* fileOld = OpenBlockFile(posOld);
             if (fileOld) {
-                if (fFinalize)
+                if (fFinalize) {
+                    // Readers holding the old mapping only touch the blocks, which stay within the new size
+                    blockreadcache.UnmapFile(nLastBlockFile);
                     TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+                }
                 FileCommit(fileOld);
                 fclose(fileOld);
             }
@@ -2709,10 +3100,9 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 std::list<CZerocoinMint> listMints;
                 BlockToZerocoinMintList(block, listMints);
 
-                vector<libzerocoin::CoinDenomination> vDenomsBefore = pindex->vMintDenominationsInBlock;
                 pindex->vMintDenominationsInBlock.clear();
                 for (auto mint : listMints)
-                    pindex->vMintDenominationsInBlock.emplace_back(mint.GetDenomination());
+                    pindex->vMintDenominationsInBlock.push_back(mint.GetDenomination());
 
                 if (pindex->nHeight < nHeightEnd)
                     pindex = chainActive.Next(pindex);
@@ -2739,7 +3129,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
                 //Add mints to zBTOK supply
                 for (auto denom : libzerocoin::zerocoinDenomList) {
-                    long nDenomAdded = count(pindex->vMintDenominationsInBlock.begin(), pindex->vMintDenominationsInBlock.end(), denom);
+                    long nDenomAdded = pindex->vMintDenominationsInBlock.count(denom);
                     pindex->mapZerocoinSupply.at(denom) += nDenomAdded;
                 }
 
@@ -3005,10 +3395,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                                      (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
             if (fEnforceBIP30) {
                 BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-                    const CCoins* coins = view.AccessCoins(tx.GetHash());
-                    if (coins && !coins->IsPruned())
-                        return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                            REJECT_INVALID, "bad-txns-BIP30");
+                    for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                        if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                            return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                                REJECT_INVALID, "bad-txns-BIP30");
+                    }
                 }
             }
 
@@ -3019,8 +3410,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             int nInputs = 0;
             int64_t nSigOpsCost = 0;
             CExtDiskTxPos pos(CDiskTxPos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())), pindex->nHeight);
-            std::vector<std::pair<uint256, CDiskTxPos> > vPosTxid;
+            std::vector<std::pair<uint256, CDiskTxIndex> > vPosTxid;
             std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddrid;
+            std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+            std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
             std::vector<pair<CoinSpend, uint256> > vSpends;
             vector<pair<PublicCoin, uint256> > vMints;
             if (fTxIndex)
@@ -3035,11 +3429,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             vector<uint256> vSpendsInBlock;
             uint256 hashBlock = block.GetHash();
 
-            unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-
-            if (GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < block.nTime) {
-                flags |= SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
-            }
+            unsigned int flags = GetBlockScriptFlags(block.nTime);
 
             for (unsigned int i = 0; i < block.vtx.size(); i++) {
                 const CTransaction& tx = block.vtx[i];
@@ -3132,7 +3522,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                         return state.DoS(100, error("ConnectBlock(): too many sigops"),
                             REJECT_INVALID, "bad-blk-sigops");
 
-                    if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+                    // A block that is only being checked, like a new block template, must not mark the cache
+                    // entries of its transactions reusable: they are still needed when the real block connects
+                    bool fCacheResults = fJustCheck;
+                    if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
                         return false;
                     control.Add(vChecks);
                 }
@@ -3143,20 +3536,52 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     blockundo.vtxundo.push_back(CTxUndo());
                 }
                 if (fTxIndex)
-                    vPosTxid.push_back(std::make_pair(tx.GetHash(), pos));
+                    vPosTxid.push_back(std::make_pair(tx.GetHash(), CDiskTxIndex(pos, hashBlock, pindex->nHeight)));
                 if (fAddrIndex) {
                     if (!tx.IsCoinBase()) {
                         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                            CCoins coins;
-                            view.GetCoins(txin.prevout.hash, coins);
-                            if (coins.IsAvailable(txin.prevout.n)) {
-                                BuildAddrIndex(coins.vout[txin.prevout.n].scriptPubKey, pos, vPosAddrid);
+                            const Coin& coin = view.AccessCoin(txin.prevout);
+                            if (coin.IsAvailable()) {
+                                BuildAddrIndex(coin.out.scriptPubKey, pos, vPosAddrid);
                             }
                         }
                     }
                     BOOST_FOREACH (const CTxOut& txout, tx.vout)
                         BuildAddrIndex(txout.scriptPubKey, pos, vPosAddrid);
                 }
+                if (fAddressIndex || fSpentIndex) {
+                    const uint256 txhash = tx.GetHash();
+                    if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) {
+                        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                            const COutPoint& prevout = tx.vin[j].prevout;
+                            const Coin& coin = view.AccessCoin(prevout);
+                            if (!coin.IsAvailable())
+                                continue;
+                            const CTxOut& txout = coin.out;
+                            uint160 hashBytes;
+                            int addressType = ADDRESS_TYPE_NONE;
+                            bool fAddress = GetAddressIndexKey(txout.scriptPubKey, hashBytes, addressType);
+                            if (fAddressIndex && fAddress) {
+                                // record the spend and drop the output from the unspent index
+                                addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), -txout.nValue));
+                                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+                            }
+                            if (fSpentIndex)
+                                spentIndex.push_back(make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, txout.nValue, fAddress ? addressType : ADDRESS_TYPE_NONE, hashBytes)));
+                        }
+                    }
+                    if (fAddressIndex) {
+                        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                            const CTxOut& txout = tx.vout[k];
+                            uint160 hashBytes;
+                            int addressType;
+                            if (!GetAddressIndexKey(txout.scriptPubKey, hashBytes, addressType))
+                                continue;
+                            addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, k, false), txout.nValue));
+                            addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(txout.nValue, txout.scriptPubKey, pindex->nHeight)));
+                        }
+                    }
+                }
 
                 UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
                 pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
@@ -3264,6 +3689,12 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
     //Record accumulator checksums
     DatabaseChecksums(mapAccumulators);
 #endif
+            //Queue this block's mints for the accumulator checkpoints that will include them
+            std::list<PublicCoin> listPubcoins;
+            for (const pair<PublicCoin, uint256>& pMint : vMints)
+                listPubcoins.emplace_back(pMint.first);
+            AddPendingMints(pindex, listPubcoins);
+
             if (fTxIndex)
                 if (!pblocktree->WriteTxIndex(vPosTxid))
                     return state.Error("Failed to write transaction index");
@@ -3272,6 +3703,20 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 if (!pblocktree->AddAddrIndex(vPosAddrid))
                     return state.Error("Failed to write address index");
 
+            // -checkblocks reconnects blocks that are already in the indexes, as DisconnectBlock leaves them
+            if (!fVerifyingBlocks) {
+                if (fAddressIndex) {
+                    if (!pblocktree->WriteAddressIndex(addressIndex))
+                        return state.Error("Failed to write address balance index");
+                    if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex))
+                        return state.Error("Failed to write address unspent index");
+                }
+
+                if (fSpentIndex)
+                    if (!pblocktree->UpdateSpentIndex(spentIndex))
+                        return state.Error("Failed to write spent index");
+            }
+
             // add new entries
             for (const CTransaction tx : block.vtx) {
                 if (tx.IsCoinBase() || tx.IsZerocoinSpend())
@@ -3329,15 +3774,19 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             LOCK(cs_main);
             static int64_t nLastWrite = 0;
             try {
-                if ((mode == FLUSH_STATE_ALWAYS) ||
-                    ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+                size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+                // The cache is close to its budget and we are between blocks: write now rather than mid-block.
+                bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+                // The cache is over its budget: write now.
+                bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+                if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical ||
                     (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-                    // Typical CCoins structures on disk are around 100 bytes in size.
+                    // Typical Coin records on disk are around 48 bytes in size.
                     // Pushing a new one to the database can cause it to be written
                     // twice (once in the log, and once in the tables). This is already
                     // an overestimation, as most will delete an existing entry or
                     // overwrite one. Still, use a conservative safety factor of 2.
-                    if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+                    if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                         return state.Error("out of disk space");
                     // First make sure all block and undo data is flushed to disk.
                     FlushBlockFile();
@@ -3394,10 +3843,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             nTimeBestReceived = GetTime();
             mempool.AddTransactionsUpdated(1);
 
-            LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+            LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
                 chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
                 DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-                Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+                Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
             cvBlockChange.notify_all();
 
@@ -3474,6 +3923,29 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
         static int64_t nTimeChainState = 0;
         static int64_t nTimePostConnect = 0;
 
+        /** Compute the stake modifier and its checksum of a block index entry from its parent's. */
+        void static ComputeBlockIndexStakeModifier(CBlockIndex * pindexNew)
+        {
+            // ppcoin: look up proof-of-stake hash value, only needed for the checksum below
+            uint256 hashProofOfStake;
+            if (pindexNew->IsProofOfStake()) {
+                if (!mapProofOfStake.count(pindexNew->GetBlockHash()))
+                    LogPrintf("%s : hashProofOfStake not found in map \n", __func__);
+                hashProofOfStake = mapProofOfStake[pindexNew->GetBlockHash()];
+            }
+
+            // ppcoin: compute stake modifier
+            uint64_t nStakeModifier = 0;
+            bool fGeneratedStakeModifier = false;
+            if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+                LogPrintf("%s : ComputeNextStakeModifier() failed \n", __func__);
+            pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+            pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew, hashProofOfStake);
+            if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+                LogPrintf("%s : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", __func__, pindexNew->nHeight, std::to_string(nStakeModifier));
+            setDirtyBlockIndex.insert(pindexNew);
+        }
+
         /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
@@ -3500,6 +3972,13 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             nTimeReadFromDisk += nTime2 - nTime1;
             int64_t nTime3;
             LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+            // The block may have been accepted before its parent was connected, so that its proof of
+            // stake could not be checked then
+            if (!CheckStakeContext(state, *pblock, pindexNew)) {
+                if (state.IsInvalid())
+                    InvalidBlockFound(pindexNew, state);
+                return error("ConnectTip() : CheckStakeContext %s failed", pindexNew->GetBlockHash().ToString());
+            }
             {
                 CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
                 bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -3793,6 +4272,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 boost::this_thread::interruption_point();
 
                 bool fInitialDownload;
+                set<NodeId> setCmpctPeers;
                 while (true) {
                     TRY_LOCK(cs_main, lockMain);
                     if (!lockMain) {
@@ -3811,6 +4291,13 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
                     pindexNewTip = chainActive.Tip();
                     fInitialDownload = IsInitialBlockDownload();
+
+                    // Peers that want the new tip announced as cmpctblock, which we can only build from pblock.
+                    if (pblock && pblock->GetHash() == pindexNewTip->GetBlockHash()) {
+                        for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                            if (it->second.fPreferHeaderAndIDs)
+                                setCmpctPeers.insert(it->first);
+                    }
                     break;
                 }
                 // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -3821,10 +4308,21 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     // Relay inventory, but don't relay old inventory during initial block download.
                     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
                     {
+                        std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                        if (!setCmpctPeers.empty())
+                            pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+
                         LOCK(cs_vNodes);
-                        BOOST_FOREACH (CNode* pnode, vNodes)
-                            if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        BOOST_FOREACH (CNode* pnode, vNodes) {
+                            if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                                continue;
+                            if (setCmpctPeers.count(pnode->GetId())) {
+                                // Skip the inv/getdata round trip; the peer rebuilds the block from its mempool
+                                pnode->AddInventoryKnown(CInv(MSG_BLOCK, hashNewTip));
+                                pnode->PushMessageWithFlag((pnode->nServices & NODE_WITNESS) ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, *pcmpctblock);
+                            } else
                                 pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                        }
                     }
                     // Notify external listeners about the new tip.
                     // Note: uiInterface, should switch main signals.
@@ -3951,29 +4449,16 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 //update previous block pointer
                 pindexNew->pprev->pnext = pindexNew;
 
-                // ppcoin: compute chain trust score
-                pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
                 // ppcoin: compute stake entropy bit for stake modifier
                 if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
                     LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
-                // ppcoin: record proof-of-stake hash value
-                if (pindexNew->IsProofOfStake()) {
-                    if (!mapProofOfStake.count(hash))
-                        LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-                    pindexNew->hashProofOfStake = mapProofOfStake[hash];
-                }
-
-                // ppcoin: compute stake modifier
-                uint64_t nStakeModifier = 0;
-                bool fGeneratedStakeModifier = false;
-                if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-                    LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-                pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-                pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-                if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-                    LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+                // A header alone does not tell whether the block is proof of stake, and the
+                // parent may lack its own stake modifier: leave both to ConnectTip.
+                if (block.vtx.empty() || (pindexNew->pprev->nStatus & BLOCK_STAKE_PENDING))
+                    pindexNew->nStatus |= BLOCK_STAKE_PENDING;
+                else
+                    ComputeBlockIndexStakeModifier(pindexNew);
             }
             pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
             pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -3992,8 +4477,13 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
         /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
         bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
         {
-            if (block.IsProofOfStake())
+            if (block.IsProofOfStake() && !pindexNew->IsProofOfStake()) {
+                // the entry was added from the header alone
                 pindexNew->SetProofOfStake();
+                pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+                pindexNew->nStakeTime = block.nTime;
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
             pindexNew->nTx = block.vtx.size();
             pindexNew->nChainTx = 0;
             pindexNew->nFile = pos.nFile;
@@ -4314,7 +4804,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
         }
 
         // Modified according to Lux coin to make SegWit working
-        bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
+        bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev)
         {
             const CChainParams& chainParams = Params();
             if (pindexPrev == NULL)
@@ -4345,6 +4835,78 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             return true;
         }
 
+        /** Reject a coinstake whose inputs are already spent on the active chain or on the fork it builds on */
+        static bool CheckStakeInputs(const CBlock& block, CBlockIndex* const pindexPrev)
+        {
+            AssertLockHeld(cs_main);
+
+            CCoinsViewCache coins(pcoinsTip);
+
+            if (!coins.HaveInputs(block.vtx[1])) {
+                // the inputs are spent at the chain tip so we should look at the recently spent outputs
+
+                for (CTxIn in : block.vtx[1].vin) {
+                    auto it = mapStakeSpent.find(in.prevout);
+                    if (it == mapStakeSpent.end()) {
+                        return false;
+                    }
+                    if (it->second < pindexPrev->nHeight) {
+                        return false;
+                    }
+                }
+            }
+
+            // if this is on a fork
+            if (!chainActive.Contains(pindexPrev) && pindexPrev != NULL) {
+                // start at the block we're adding on to
+                CBlockIndex* last = pindexPrev;
+
+                // while that block is not on the main chain
+                while (!chainActive.Contains(last) && last != NULL) {
+                    CBlock bl;
+                    ReadBlockFromDisk(bl, last);
+                    // loop through every spent input from said block
+                    for (CTransaction t : bl.vtx) {
+                        for (CTxIn in : t.vin) {
+                            // loop through every spent input in the staking transaction of the new block
+                            for (CTxIn stakeIn : block.vtx[1].vin) {
+                                // if they spend the same input
+                                if (stakeIn.prevout == in.prevout) {
+                                    // reject the block
+                                    return false;
+                                }
+                            }
+                        }
+                    }
+
+                    // go to the parent block
+                    last = last->pprev;
+                }
+            }
+            return true;
+        }
+
+        bool CheckStakeContext(CValidationState& state, const CBlock& block, CBlockIndex* pindex)
+        {
+            AssertLockHeld(cs_main);
+
+            if (!(pindex->nStatus & BLOCK_STAKE_PENDING))
+                return true;
+
+            // The spent check is a coins lookup, so it goes before hashing the kernel
+            if (block.IsProofOfStake() && !CheckStakeInputs(block, pindex->pprev))
+                return state.DoS(100, error("%s : stake input of %s already spent", __func__, pindex->GetBlockHash().ToString()),
+                    REJECT_INVALID, "bad-stake-spent");
+            if (!CheckWork(block, pindex->pprev))
+                return state.DoS(100, error("%s : CheckWork %s failed", __func__, pindex->GetBlockHash().ToString()),
+                    REJECT_INVALID, "bad-proof");
+
+            ComputeBlockIndexStakeModifier(pindex);
+            pindex->nStatus &= ~BLOCK_STAKE_PENDING;
+            setDirtyBlockIndex.insert(pindex);
+            return true;
+        }
+
         bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
         {
             uint256 hash = block.GetHash();
@@ -4356,6 +4918,12 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
             int nHeight = pindexPrev->nHeight + 1;
 
+            // Check the difficulty; for a proof-of-stake header this is the only work it carries until
+            // the block, and with it the stake, is available
+            if (BLOCK_TIME_TARGET < pindexPrev->nTime && block.nBits != GetNextWorkRequired(pindexPrev, &block))
+                return state.DoS(100, error("%s : incorrect difficulty bits at %d", __func__, nHeight),
+                    REJECT_INVALID, "bad-diffbits");
+
             //If this is a reorg, check that it is not too deep
             int nMaxReorgDepth = GetArg("-maxreorg", Params().MaxReorganizationDepth());
             if (chainActive.Height() - nHeight >= nMaxReorgDepth)
@@ -4491,9 +5059,14 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     return state.DoS(50, error("CheckBlockHeader() : block version must be above 4 after ZerocoinStartHeight"),
                         REJECT_INVALID, "block-version");
 
+                // Zerocoin spend proofs are the most expensive part of these checks; collect them while the
+                // transactions are scanned and verify them on the zerocoin check queue at the end. CheckTransaction
+                // can take cs_main, so the queue is only held once the scan is done.
+                int64_t nTimeStart = GetTimeMicros();
+                std::vector<CZerocoinSpendCheck> vZerocoinChecks;
                 vector<CBigNum> vBlockSerials;
                 for (const CTransaction& tx : block.vtx) {
-                    if (!CheckTransaction(tx, true, chainActive.Height() + 1 >= Params().Zerocoin_StartHeight(), state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < block.nTime))
+                    if (!CheckTransaction(tx, true, chainActive.Height() + 1 >= Params().Zerocoin_StartHeight(), state, GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) < block.nTime, nScriptCheckThreads ? &vZerocoinChecks : NULL))
                         return error("CheckBlock() : CheckTransaction failed");
 
                     // double check that there are no double spent zBTOK spends in this block
@@ -4509,6 +5082,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                         }
                     }
                 }
+                unsigned int nZerocoinChecks = vZerocoinChecks.size();
+                if (!RunZerocoinSpendChecks(vZerocoinChecks))
+                    return state.DoS(100, error("%s : zerocoin spend did not verify", __func__), REJECT_INVALID, "bad-txns-zerocoinspend");
+                if (nZerocoinChecks)
+                    LogPrint("bench", "    - Verify %u zerocoin spends: %.2fms\n", nZerocoinChecks, 0.001 * (GetTimeMicros() - nTimeStart));
                 //} else {
                 //if (block.nVersion >= Params().Zerocoin_HeaderVersion())
                 //return state.DoS(50, error("CheckBlockHeader() : block version must be below 4 before ZerocoinStartHeight"),
@@ -4676,7 +5254,16 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 }
             }
 
-            if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
+            // A block downloaded ahead of its parent's connection, as happens when blocks are fetched in
+            // parallel after their headers, has no stake context yet: ConnectTip runs its stake checks instead.
+            bool fStakeContext = pindexPrev == NULL || !(pindexPrev->nStatus & BLOCK_STAKE_PENDING);
+
+            // An entry that is known but not pending had its work and proof of stake checked when it was added,
+            // as a cmpctblock header is
+            BlockMap::iterator miSelf = mapBlockIndex.find(block.GetHash());
+            bool fWorkChecked = miSelf != mapBlockIndex.end() && !(miSelf->second->nStatus & BLOCK_STAKE_PENDING);
+
+            if (fStakeContext && !fWorkChecked && block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
                 return false;
 
             if (!AcceptBlockHeader(block, state, &pindex))
@@ -4698,53 +5285,8 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
             int nHeight = pindex->nHeight;
 
-            if (block.IsProofOfStake()) {
-                LOCK(cs_main);
-
-                CCoinsViewCache coins(pcoinsTip);
-
-                if (!coins.HaveInputs(block.vtx[1])) {
-                    // the inputs are spent at the chain tip so we should look at the recently spent outputs
-
-                    for (CTxIn in : block.vtx[1].vin) {
-                        auto it = mapStakeSpent.find(in.prevout);
-                        if (it == mapStakeSpent.end()) {
-                            return false;
-                        }
-						if (it->second < pindexPrev->nHeight) {
-                            return false;
-                        }
-                    }
-                }
-
-                // if this is on a fork
-                if (!chainActive.Contains(pindexPrev) && pindexPrev != NULL) {
-                    // start at the block we're adding on to
-                    CBlockIndex* last = pindexPrev;
-
-                    // while that block is not on the main chain
-					while (!chainActive.Contains(last) && last != NULL) {
-                        CBlock bl;
-                        ReadBlockFromDisk(bl, last);
-                        // loop through every spent input from said block
-                        for (CTransaction t : bl.vtx) {
-                            for (CTxIn in : t.vin) {
-                                // loop through every spent input in the staking transaction of the new block
-                                for (CTxIn stakeIn : block.vtx[1].vin) {
-                                    // if they spend the same input
-                                    if (stakeIn.prevout == in.prevout) {
-                                        // reject the block
-                                        return false;
-                                    }
-                                }
-                            }
-                        }
-
-                        // go to the parent block
-                        last = last->pprev;
-                    }
-                }
-            }
+            if (fStakeContext && block.IsProofOfStake() && !CheckStakeInputs(block, pindexPrev))
+                return false;
 
             // Write block to history file
             try {
@@ -4763,6 +5305,15 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 return state.Error(std::string("System error: ") + e.what());
             }
 
+            // An entry added from its header alone waits for its stake checks, which have just run: give it
+            // its modifier now, once ReceivedBlockTransactions has marked it proof of stake, so ConnectTip does
+            // not check the stake again
+            if (fStakeContext && (pindex->nStatus & BLOCK_STAKE_PENDING)) {
+                ComputeBlockIndexStakeModifier(pindex);
+                pindex->nStatus &= ~BLOCK_STAKE_PENDING;
+                setDirtyBlockIndex.insert(pindex);
+            }
+
             return true;
         }
 
@@ -4864,7 +5415,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 //if we get this far, check if the prev block is our prev block, if not then request sync and return false
                 BlockMap::iterator mi = mapBlockIndex.find(pblock->hashPrevBlock);
                 if (mi == mapBlockIndex.end()) {
-                    pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), uint256(0));
+                    if (Params().HeadersFirstSyncingActive())
+                        pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), pblock->GetHash());
+                    else
+                        pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), uint256(0));
                     return false;
                 }
             }
@@ -4872,7 +5426,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             {
                 LOCK(cs_main); // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
-                MarkBlockAsReceived(pblock->GetHash());
+                MarkBlockAsReceived(pblock->GetHash(), ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
                 if (!checked) {
                     return error("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
                 }
@@ -5115,6 +5669,12 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             pblocktree->ReadFlag("addrindex", fAddrIndex);
             LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddrIndex ? "enabled" : "disabled");
 
+            pblocktree->ReadFlag("addressindex", fAddressIndex);
+            LogPrintf("LoadBlockIndexDB(): address balance index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+            pblocktree->ReadFlag("spentindex", fSpentIndex);
+            LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
             // If this is written true before the next client init, then we know the shutdown process failed
             pblocktree->WriteFlag("shutdown", false);
 
@@ -5184,7 +5744,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     }
                 }
                 // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-                if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+                if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
                     bool fClean = true;
                     if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                         return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -5297,6 +5857,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             setBlockIndexCandidates.clear();
             chainActive.SetTip(NULL);
             pindexBestInvalid = NULL;
+            ResetKernelModifiers();
         }
 
         bool LoadBlockIndex(string & strError)
@@ -5320,6 +5881,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             pblocktree->WriteFlag("txindex", fTxIndex);
             fAddrIndex = GetBoolArg("-addrindex", true);
             pblocktree->WriteFlag("addrindex", fAddrIndex);
+            fAddressIndex = GetBoolArg("-addressindex", false);
+            pblocktree->WriteFlag("addressindex", fAddressIndex);
+            fSpentIndex = GetBoolArg("-spentindex", false);
+            pblocktree->WriteFlag("spentindex", fSpentIndex);
             LogPrintf("Initializing databases...\n");
 
             // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -5350,103 +5915,249 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
         }
 
 
-        bool LoadExternalBlockFile(FILE * fileIn, CDiskBlockPos * dbp)
+        /** Decodes one imported block on a check queue thread; a failure is kept in the block so that it is reported in file order */
+        class CImportedBlockCheck
         {
-            // Map of disk positions for blocks with unknown parent (only used for reindex)
-            static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-            int64_t nStart = GetTimeMillis();
+        private:
+            CImportedBlock* pimported;
 
-            int nLoaded = 0;
-            try {
-                // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-                CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-                uint64_t nRewind = blkdat.GetPos();
-                while (!blkdat.eof()) {
-                    boost::this_thread::interruption_point();
+        public:
+            CImportedBlockCheck() : pimported(NULL) {}
+            CImportedBlockCheck(CImportedBlock* pimportedIn) : pimported(pimportedIn) {}
 
-                    blkdat.SetPos(nRewind);
-                    nRewind++;         // start one byte further next time, in case of failure
-                    blkdat.SetLimit(); // remove former limit
-                    unsigned int nSize = 0;
-                    try {
-                        // locate a header
-                        unsigned char buf[MESSAGE_START_SIZE];
-                        blkdat.FindByte(Params().MessageStart()[0]);
-                        nRewind = blkdat.GetPos() + 1;
-                        blkdat >> FLATDATA(buf);
-                        if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                            continue;
-                        // read size
-                        blkdat >> nSize;
-                        if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                            continue;
-                    } catch (const std::exception&) {
-                        // no valid block header found; don't complain
-                        break;
-                    }
-                    try {
-                        // read block
-                        uint64_t nBlockPos = blkdat.GetPos();
+            bool operator()()
+            {
+                CImportedBlock& imported = *pimported;
+                try {
+                    CMemoryReader reader(&imported.vData[0], &imported.vData[0] + imported.vData.size(), SER_DISK, CLIENT_VERSION);
+                    reader >> imported.block;
+                    imported.hash = imported.block.GetHash();
+                } catch (std::exception& e) {
+                    imported.strError = e.what();
+                }
+                std::vector<char>().swap(imported.vData);
+                return true;
+            }
+
+            void swap(CImportedBlockCheck& check) { std::swap(pimported, check.pimported); }
+        };
+
+        /** Decodes batches of imported blocks on worker threads that live for the whole import, while the import thread reads and connects others */
+        class CImportDecoder
+        {
+        private:
+            CCheckQueue<CImportedBlockCheck> queue;
+            boost::thread_group threads;
+            std::unique_ptr<CCheckQueueControl<CImportedBlockCheck> > pcontrol;
+
+        public:
+            CImportDecoder(size_t nWorkers) : queue(16)
+            {
+                for (size_t i = 0; i < nWorkers; i++)
+                    threads.create_thread(boost::bind(&CCheckQueue<CImportedBlockCheck>::Thread, boost::ref(queue)));
+            }
+
+            ~CImportDecoder()
+            {
+                Wait();
+                threads.interrupt_all();
+                threads.join_all();
+            }
+
+            //! Queue a batch for the workers; without workers it is decoded in Wait
+            void Start(std::vector<CImportedBlock>& vBlocks)
+            {
+                std::vector<CImportedBlockCheck> vChecks;
+                vChecks.reserve(vBlocks.size());
+                BOOST_FOREACH (CImportedBlock& imported, vBlocks)
+                    vChecks.push_back(CImportedBlockCheck(&imported));
+                pcontrol.reset(new CCheckQueueControl<CImportedBlockCheck>(&queue));
+                pcontrol->Add(vChecks);
+            }
+
+            //! Wait for the batch of the last Start, the calling thread joins the workers until it is decoded
+            void Wait()
+            {
+                if (pcontrol) {
+                    pcontrol->Wait();
+                    pcontrol.reset();
+                }
+            }
+        };
+
+        /** Read the next batch of raw blocks from blkdat; returns false once the end of the file is reached */
+        static bool ReadImportBatch(CBufferedFile& blkdat, uint64_t& nRewind, std::vector<CImportedBlock>& vBlocks, uint64_t& nBytesRead)
+        {
+            size_t nBatchBytes = 0;
+            while (vBlocks.size() < IMPORT_BATCH_BLOCKS && nBatchBytes < IMPORT_BATCH_BYTES) {
+                if (blkdat.eof())
+                    return false;
+                boost::this_thread::interruption_point();
+
+                blkdat.SetPos(nRewind);
+                nRewind++;         // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    return false;
+                }
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    vBlocks.push_back(CImportedBlock());
+                    CImportedBlock& imported = vBlocks.back();
+                    imported.nBlockPos = nBlockPos;
+                    imported.vData.resize(nSize);
+                    blkdat.read(&imported.vData[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    nBatchBytes += nSize;
+                    nBytesRead += nSize;
+                } catch (std::exception& e) {
+                    vBlocks.pop_back();
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                }
+            }
+            return true;
+        }
+
+        /** Hand a decoded batch to ProcessNewBlock in file order; returns false on a fatal validation error */
+        static bool ConnectImportBatch(std::vector<CImportedBlock>& vBlocks, CDiskBlockPos* dbp, std::multimap<uint256, CDiskBlockPos>& mapBlocksUnknownParent, int& nLoaded)
+        {
+            BOOST_FOREACH (CImportedBlock& imported, vBlocks) {
+                boost::this_thread::interruption_point();
+                if (!imported.strError.empty()) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, imported.strError);
+                    continue;
+                }
+                try {
+                    CBlock& block = imported.block;
+                    const uint256& hash = imported.hash;
+                    if (dbp)
+                        dbp->nPos = imported.nBlockPos;
+
+                    // detect out of order blocks, and store them for later
+                    if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                            block.hashPrevBlock.ToString());
                         if (dbp)
-                            dbp->nPos = nBlockPos;
-                        blkdat.SetLimit(nBlockPos + nSize);
-                        blkdat.SetPos(nBlockPos);
-                        CBlock block;
-                        blkdat >> block;
-                        nRewind = blkdat.GetPos();
-
-                        // detect out of order blocks, and store them for later
-                        uint256 hash = block.GetHash();
-                        if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                            LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                                block.hashPrevBlock.ToString());
-                            if (dbp)
-                                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                            continue;
-                        }
+                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                        continue;
+                    }
 
-                        // process in case the block isn't known yet
-                        if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                            CValidationState state;
-                            if (ProcessNewBlock(state, NULL, &block, dbp))
-                                nLoaded++;
-                            if (state.IsError())
-                                break;
-                        } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                            LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                        }
+                    // process in case the block isn't known yet
+                    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                        CValidationState state;
+                        if (ProcessNewBlock(state, NULL, &block, dbp))
+                            nLoaded++;
+                        if (state.IsError())
+                            return false;
+                    } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+                    }
 
-                        // Recursively process earlier encountered successors of this block
-                        deque<uint256> queue;
-                        queue.push_back(hash);
-                        while (!queue.empty()) {
-                            uint256 head = queue.front();
-                            queue.pop_front();
-                            std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                            while (range.first != range.second) {
-                                std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                                if (ReadBlockFromDisk(block, it->second)) {
-                                    LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                        head.ToString());
-                                    CValidationState dummy;
-                                    if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
-                                        nLoaded++;
-                                        queue.push_back(block.GetHash());
-                                    }
+                    // Recursively process earlier encountered successors of this block
+                    deque<uint256> queue;
+                    queue.push_back(hash);
+                    while (!queue.empty()) {
+                        uint256 head = queue.front();
+                        queue.pop_front();
+                        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                        while (range.first != range.second) {
+                            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                            if (ReadBlockFromDisk(block, it->second)) {
+                                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                                    head.ToString());
+                                CValidationState dummy;
+                                if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
+                                    nLoaded++;
+                                    queue.push_back(block.GetHash());
                                 }
-                                range.first++;
-                                mapBlocksUnknownParent.erase(it);
                             }
+                            range.first++;
+                            mapBlocksUnknownParent.erase(it);
                         }
-                    } catch (std::exception& e) {
-                        LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
                     }
+                } catch (std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
+            }
+            LogPrint("reindex", "%s: connected %u blocks, %d loaded\n", __func__, vBlocks.size(), nLoaded);
+            return true;
+        }
+
+        bool ReadExternalBlockFile(FILE* fileIn, size_t nThreads, const boost::function<bool(std::vector<CImportedBlock>&)>& fnConnect, CImportStats& stats)
+        {
+            // Blocks go through three stages: the calling thread reads a batch of raw blocks, worker
+            // threads deserialize and hash it, and the calling thread then hands it to fnConnect.
+            // Decoding of one batch overlaps with reading the next and connecting the previous one.
+            // The workers are started once for the whole file; with a single thread the calling
+            // thread decodes each batch itself.
+            std::vector<CImportedBlock> vBatch, vDecoding;
+            CImportDecoder decoder(nThreads > 1 ? nThreads : 0);
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            bool fReading = true;
+            do {
+                int64_t nTime0 = GetTimeMicros();
+                vBatch.clear();
+                if (fReading)
+                    fReading = ReadImportBatch(blkdat, nRewind, vBatch, stats.nBytesRead);
+                int64_t nTime1 = GetTimeMicros();
+                stats.nTimeRead += nTime1 - nTime0;
+
+                decoder.Wait();
+                vDecoding.swap(vBatch);
+                if (!vDecoding.empty())
+                    decoder.Start(vDecoding);
+                int64_t nTime2 = GetTimeMicros();
+                stats.nTimeDecode += nTime2 - nTime1;
+
+                if (!vBatch.empty() && !fnConnect(vBatch))
+                    return false;
+                stats.nTimeConnect += GetTimeMicros() - nTime2;
+            } while (!vDecoding.empty());
+            return true;
+        }
+
+        bool LoadExternalBlockFile(FILE * fileIn, CDiskBlockPos * dbp)
+        {
+            // Map of disk positions for blocks with unknown parent (only used for reindex)
+            static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+            int64_t nStart = GetTimeMillis();
+            const size_t nThreads = std::max(nScriptCheckThreads, 1);
+
+            int nLoaded = 0;
+            CImportStats stats;
+            try {
+                ReadExternalBlockFile(fileIn, nThreads, boost::bind(&ConnectImportBatch, _1, dbp, boost::ref(mapBlocksUnknownParent), boost::ref(nLoaded)), stats);
             } catch (std::runtime_error& e) {
                 AbortNode(std::string("System error: ") + e.what());
             }
-            if (nLoaded > 0)
-                LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+            if (nLoaded > 0) {
+                int nHeight;
+                {
+                    LOCK(cs_main);
+                    nHeight = chainActive.Height();
+                }
+                LogPrintf("Loaded %i blocks from external file in %dms, best height %d (read %dms at %.1f MB/s, decode wait %dms on %u threads, connect %dms)\n",
+                    nLoaded, GetTimeMillis() - nStart, nHeight, stats.nTimeRead / 1000, stats.nTimeRead > 0 ? stats.nBytesRead * 1000000.0 / stats.nTimeRead / 1048576.0 : 0.0,
+                    stats.nTimeDecode / 1000, nThreads, stats.nTimeConnect / 1000);
+            }
             return nLoaded > 0;
         }
 
@@ -5658,8 +6369,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             case MSG_TX: {
                 bool txInMap = false;
                 txInMap = mempool.exists(inv.hash);
+                // Only the cache is asked whether the tx is confirmed, and only for its
+                // first two outputs: a disk lookup per announcement is not worth it.
                 return txInMap || mapOrphanTransactions.count(inv.hash) ||
-                       pcoinsTip->HaveCoins(inv.hash);
+                       pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                       pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
             }
             case MSG_BLOCK:
             case MSG_WITNESS_BLOCK:
@@ -5946,6 +6660,36 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             }
         }
 
+        // Requires cs_main. Used when a cmpctblock could not be turned into the block it announced.
+        void static RequestFullBlock(CNode * pfrom, const uint256& hash)
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            MarkBlockAsInFlight(pfrom->GetId(), hash, mi == mapBlockIndex.end() ? NULL : mi->second);
+            vector<CInv> vGetData(1, CInv(State(pfrom->GetId())->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, hash));
+            pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
+        }
+
+        /** Process a block rebuilt from a cmpctblock and the mempool */
+        void static ProcessReconstructedBlock(CNode * pfrom, CBlock & block)
+        {
+            CValidationState state;
+            ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                LOCK(cs_main);
+                if (state.CorruptionPossible()) {
+                    // A transaction taken from the mempool may not be the one the block
+                    // commits to (e.g. a different witness); the block itself may be fine.
+                    RequestFullBlock(pfrom, block.GetHash());
+                    return;
+                }
+                pfrom->PushMessage(NetMsgType::REJECT, string(NetMsgType::BLOCK), state.GetRejectCode(),
+                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+
         bool fRequestedSporksIDB = false;
         bool static ProcessMessage(CNode * pfrom, string strCommand, CDataStream & vRecv, int64_t nTimeReceived)
         {
@@ -6110,6 +6854,24 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     LOCK(cs_main);
                     State(pfrom->GetId())->fCurrentlyConnected = true;
                 }
+
+                if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+                    // Ask for new blocks to be announced as cmpctblock, version 1 of the encoding.
+                    bool fAnnounceUsingCMPCTBLOCK = true;
+                    uint64_t nCMPCTBLOCKVersion = 1;
+                    pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                }
+            }
+
+
+            else if (strCommand == NetMsgType::SENDCMPCT) {
+                bool fAnnounceUsingCMPCTBLOCK = false;
+                uint64_t nCMPCTBLOCKVersion = 0;
+                vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+                if (nCMPCTBLOCKVersion == 1) {
+                    LOCK(cs_main);
+                    State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+                }
             }
 
 
@@ -6223,8 +6985,21 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                                 (GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) > chainActive.Tip()->nTime || State(pfrom->GetId())->fHaveWitness)) {
                                 inv.type = MSG_WITNESS_BLOCK;
                             }
-                            vToFetch.push_back(inv);
-                            LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                            if (Params().HeadersFirstSyncingActive()) {
+                                pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), inv.hash);
+                                CNodeState* nodestate = State(pfrom->GetId());
+                                if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
+                                    nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                                    vToFetch.push_back(inv);
+                                    // Mark block as in flight already, even though the actual "getdata" message only goes out
+                                    // later (within the same cs_main lock, though).
+                                    MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                                }
+                                LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                            } else {
+                                vToFetch.push_back(inv);
+                                LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                            }
                         }
                     }
 
@@ -6262,7 +7037,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             }
 
 
-            else if (strCommand == NetMsgType::GETBLOCKS || strCommand == NetMsgType::GETHEADERS) {
+            else if (strCommand == NetMsgType::GETBLOCKS) {
                 CBlockLocator locator;
                 uint256 hashStop;
                 vRecv >> locator >> hashStop;
@@ -6294,7 +7069,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             }
 
 
-            else if (strCommand == NetMsgType::HEADERS && Params().HeadersFirstSyncingActive()) {
+            else if (strCommand == NetMsgType::GETHEADERS) {
                 CBlockLocator locator;
                 uint256 hashStop;
                 vRecv >> locator >> hashStop;
@@ -6332,6 +7107,46 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             }
 
 
+            else if (strCommand == NetMsgType::GETBLOCKTXN) {
+                BlockTransactionsRequest req;
+                vRecv >> req;
+
+                LOCK(cs_main);
+
+                BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+                if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                    LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                    return true;
+                }
+
+                if (!chainActive.Contains(mi->second) || mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                    // We never announced this block as cmpctblock; let ProcessGetData decide whether to send it
+                    LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                    pfrom->vRecvGetData.push_back(CInv(State(pfrom->GetId())->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, req.blockhash));
+                    ProcessGetData(pfrom);
+                    return true;
+                }
+
+                CBlock block;
+                if (!ReadBlockFromDisk(block, mi->second))
+                    assert(!"cannot load block from disk");
+
+                BlockTransactions resp(req);
+                for (size_t i = 0; i < req.indexes.size(); i++) {
+                    if (req.indexes[i] >= block.vtx.size()) {
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                        return true;
+                    }
+                    resp.txn[i] = block.vtx[req.indexes[i]];
+                }
+                if (State(pfrom->GetId())->fHaveWitness)
+                    pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+                else
+                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCKTXN, resp);
+            }
+
+
             else if (strCommand == NetMsgType::TX || strCommand == NetMsgType::DSTX) {
                 vector<uint256> vWorkQueue;
                 vector<uint256> vEraseQueue;
@@ -6506,7 +7321,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
             }
 
 
-            else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+            else if (strCommand == NetMsgType::HEADERS && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
             {
                 std::vector<CBlockHeader> headers;
 
@@ -6529,6 +7344,21 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     // Nothing interesting. Stop asking this peers for more headers.
                     return true;
                 }
+
+                CNodeState* nodestate = State(pfrom->GetId());
+
+                // A headers announcement we cannot connect may follow a block we missed, so ask for the
+                // headers leading up to it; a peer that keeps sending them is scored
+                if (!mapBlockIndex.count(headers[0].hashPrevBlock)) {
+                    nodestate->nUnconnectingHeaders++;
+                    pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256(0));
+                    LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                        headers[0].GetHash().ToString(), headers[0].hashPrevBlock.ToString(), pindexBestHeader->nHeight, pfrom->id, nodestate->nUnconnectingHeaders);
+                    if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                        Misbehaving(pfrom->GetId(), 20);
+                    return true;
+                }
+
                 CBlockIndex* pindexLast = NULL;
                 BOOST_FOREACH (const CBlockHeader& header, headers) {
                     CValidationState state;
@@ -6538,9 +7368,8 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                         return error("non-continuous headers sequence");
                     }
 
-                    /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
+                    // The header comes without transactions, so the index entry is added without
+                    // its stake context; that is filled in when the block is connected.
                     if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
                         int nDoS;
                         if (state.IsInvalid(nDoS)) {
@@ -6552,6 +7381,10 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     }
                 }
 
+                if (nodestate->nUnconnectingHeaders > 0)
+                    LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+                nodestate->nUnconnectingHeaders = 0;
+
                 if (pindexLast)
                     UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -6566,6 +7399,127 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                 CheckBlockIndex();
             }
 
+            else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+            {
+                CBlockHeaderAndShortTxIDs cmpctblock;
+                vRecv >> cmpctblock;
+
+                CBlock block;
+                bool fBlockReconstructed = false;
+                {
+                    LOCK(cs_main);
+
+                    BlockMap::iterator miSelf = mapBlockIndex.find(cmpctblock.header.GetHash());
+                    if (miSelf != mapBlockIndex.end() && (miSelf->second->nStatus & BLOCK_HAVE_DATA)) {
+                        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, miSelf->first));
+                        UpdateBlockAvailability(pfrom->GetId(), miSelf->first);
+                        return true;
+                    }
+
+                    BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+                    if (mi == mapBlockIndex.end() || mi->second != chainActive.Tip()) {
+                        // Only a block building on our tip can be checked and rebuilt from the mempool;
+                        // fetch the headers leading up to any other, its block comes with the regular download
+                        if (!IsInitialBlockDownload())
+                            pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256(0));
+                        return true;
+                    }
+
+                    // The coinstake is always prefilled, so the work, the proof of stake and the block
+                    // signature are checked before anything is stored or looked up for the block. The header
+                    // is added with its coinstake, so the entry is not left pending for AcceptBlock and
+                    // ConnectTip to check again.
+                    CBlock blockStake = cmpctblock.GetStakeBlock();
+                    if (!CheckWork(blockStake, chainActive.Tip()) || !blockStake.CheckBlockSignature()) {
+                        Misbehaving(pfrom->GetId(), 100);
+                        return error("invalid proof of stake received via cmpctblock %s", cmpctblock.header.GetHash().ToString());
+                    }
+
+                    CBlockIndex* pindex = NULL;
+                    CValidationState state;
+                    if (!AcceptBlockHeader(blockStake, state, &pindex)) {
+                        int nDoS;
+                        if (state.IsInvalid(nDoS) && nDoS > 0)
+                            Misbehaving(pfrom->GetId(), nDoS);
+                        return error("invalid header received via cmpctblock %s", cmpctblock.header.GetHash().ToString());
+                    }
+
+                    uint256 hash = pindex->GetBlockHash();
+                    pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+                    UpdateBlockAvailability(pfrom->GetId(), hash);
+
+                    if (pindex->nStatus & BLOCK_HAVE_DATA)
+                        return true;
+                    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+                    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != pfrom->GetId())
+                        return true;
+
+                    std::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+                    ReadStatus status = partialBlock->InitData(cmpctblock);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
+                        // Duplicate short IDs; ask for the whole block
+                        RequestFullBlock(pfrom, hash);
+                        return true;
+                    }
+
+                    BlockTransactionsRequest req;
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock->IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    if (req.indexes.empty()) {
+                        if (partialBlock->FillBlock(block, std::vector<CTransaction>()) == READ_STATUS_OK)
+                            fBlockReconstructed = true;
+                        else
+                            RequestFullBlock(pfrom, hash);
+                    } else {
+                        req.blockhash = hash;
+                        MarkBlockAsInFlight(pfrom->GetId(), hash, pindex)->partialBlock = partialBlock;
+                        pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                    }
+                }
+
+                if (fBlockReconstructed)
+                    ProcessReconstructedBlock(pfrom, block);
+            }
+
+            else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+            {
+                BlockTransactions resp;
+                vRecv >> resp;
+
+                CBlock block;
+                {
+                    LOCK(cs_main);
+
+                    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+                    if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                        itInFlight->second.first != pfrom->GetId()) {
+                        LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                        return true;
+                    }
+
+                    ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
+                        // A short ID matched the wrong mempool transaction; ask for the whole block
+                        RequestFullBlock(pfrom, resp.blockhash);
+                        return true;
+                    }
+                }
+
+                ProcessReconstructedBlock(pfrom, block);
+            }
+
             else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
             {
                 CBlock block;
@@ -6576,7 +7530,11 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
 
                 //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
                 if (!mapBlockIndex.count(block.hashPrevBlock)) {
-                    if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), block.GetHash()) != pfrom->vBlockRequested.end()) {
+                    if (Params().HeadersFirstSyncingActive()) {
+                        // fetch the headers leading up to it; the block itself is downloaded once they connect
+                        LOCK(cs_main);
+                        pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), block.GetHash());
+                    } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), block.GetHash()) != pfrom->vBlockRequested.end()) {
                         //we already asked for this block, so lets work backwards and ask for the previous block
                         pfrom->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(), block.hashPrevBlock);
                         pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -6589,7 +7547,9 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     pfrom->AddInventoryKnown(inv);
 
                     CValidationState state;
-                    if (!mapBlockIndex.count(block.GetHash())) {
+                    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+                    // a header received ahead of the block does not make it processed
+                    if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
                         ProcessNewBlock(state, pfrom, &block);
                         int nDoS;
                         if (state.IsInvalid(nDoS)) {
@@ -7069,10 +8029,15 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                         state.fSyncStarted = true;
                         nSyncStarted++;
-                        //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                        //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                        //pto->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256(0));
-                        pto->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                        if (Params().HeadersFirstSyncingActive()) {
+                            // Start from the parent of our best header, so the reply is never empty and
+                            // tells us the peer has that header too.
+                            CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                            LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                            pto->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexStart), uint256(0));
+                        } else {
+                            pto->PushMessage(NetMsgType::GETBLOCKS, chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                        }
                     }
                 }
 
@@ -7155,7 +8120,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
                     BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                         if (State(pto->GetId())->fHaveWitness || GetSporkValue(SPORK_18_SEGWIT_ACTIVATION) > pindex->pprev->nTime) {
-                            vGetData.push_back(CInv(State(staller)->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
+                            vGetData.push_back(CInv(state.fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                             MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                             LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                                 pindex->nHeight, pto->id);
@@ -7164,6 +8129,7 @@ int64_t GetMasternodePayment(int nHeight, int64_t blockValue, int nMasternodeCou
                     if (state.nBlocksInFlight == 0 && staller != -1) {
                         if (State(staller)->nStallingSince == 0) {
                             State(staller)->nStallingSince = nNow;
+                            State(staller)->nStalls++;
                             LogPrint("net", "Stall started peer=%d\n", staller);
                         }
                     }
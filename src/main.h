@@ -38,6 +38,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -46,6 +47,7 @@
 
 #include "libzerocoin/CoinSpend.h"
 
+#include <boost/function.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
@@ -55,6 +57,7 @@ class CSporkDB;
 class CBloomFilter;
 class CInv;
 class CScriptCheck;
+class CZerocoinSpendCheck;
 class CValidationInterface;
 
 struct CBlockTemplate;
@@ -87,12 +90,30 @@ static const int64_t MAX_BLOCK_COST = 4000000;
 static const unsigned int MAX_BLOCK_BASE_SIZE = 1000000;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Default for -persistmempool, whether to save the mempool on shutdown and load it on restart */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Maximum number of blocks LoadExternalBlockFile reads ahead in one batch for parallel decoding */
+static const unsigned int IMPORT_BATCH_BLOCKS = 1024;
+/** Maximum serialized size of one LoadExternalBlockFile batch */
+static const unsigned int IMPORT_BATCH_BYTES = 0x2000000; // 32 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 50;
 /** Maximum number of script-checking threads allowed */
@@ -106,11 +127,16 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of headers messages in a row that may fail to connect before the peer is scored */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Depth below the tip up to which getblocktxn requests are answered with the transactions;
+ *  older blocks are never announced with cmpctblock and are sent in full instead. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -147,9 +173,11 @@ extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fAddrIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -209,6 +237,32 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+
+/** A block read raw from a block file by ReadExternalBlockFile and decoded on a worker thread */
+struct CImportedBlock {
+    uint64_t nBlockPos;
+    std::vector<char> vData; // serialized block, released once decoded
+    CBlock block;
+    uint256 hash;
+    std::string strError;
+};
+
+/** Bytes read and microseconds spent in each stage of ReadExternalBlockFile */
+struct CImportStats {
+    uint64_t nBytesRead;
+    int64_t nTimeRead;
+    int64_t nTimeDecode;
+    int64_t nTimeConnect;
+
+    CImportStats() : nBytesRead(0), nTimeRead(0), nTimeDecode(0), nTimeConnect(0) {}
+};
+
+/**
+ * Read the blocks of a block file in batches and decode each batch on nThreads threads while
+ * fnConnect handles the previous one. Batches reach fnConnect in file order, with blocks that
+ * fail to decode kept in place with their error. Returns false if fnConnect does.
+ */
+bool ReadExternalBlockFile(FILE* fileIn, size_t nThreads, const boost::function<bool(std::vector<CImportedBlock>&)>& fnConnect, CImportStats& stats);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -228,6 +282,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the zerocoin spend proof checking thread */
+void ThreadZerocoinSpendCheck();
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -239,6 +295,8 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256& hash, CTransaction& tx, uint256& hashBlock, bool fAllowSlow = false);
+/** Retrieve several transactions, reading indexed ones in block file order; returns false if any was not found */
+bool GetTransactions(const std::vector<uint256>& vHash, std::vector<CTransaction>& vTxOut, std::vector<uint256>& vHashBlock, bool fAllowSlow = false);
 /** Find the best known block, and make it the tip of the block chain */
 
 bool DisconnectBlocksAndReprocess(int blocks);
@@ -266,6 +324,15 @@ void FlushStateToDisk();
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/** (try to) add transaction to memory pool, recording nAcceptTime as the time it entered the pool */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/** Dump the mempool to mempool.dat in the data directory */
+bool DumpMempool();
+
+/** Load mempool.dat, revalidating its transactions against the current chain */
+bool LoadMempool();
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
@@ -278,6 +345,11 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    double dBlockDownloadRate;
+    bool fStalling;
+    int nStalls;
 };
 
 struct CDiskTxPos : public CDiskBlockPos {
@@ -313,6 +385,66 @@ struct CDiskTxPos : public CDiskBlockPos {
     }
 };
 
+/**
+ * Transaction index entry: the position of a transaction together with the hash
+ * and height of its block, so a lookup does not have to hash the block header.
+ * Entries written before the block hash was recorded hold only the position and
+ * read back with a null hashBlock and an nHeight of -1.
+ */
+struct CDiskTxIndex : public CDiskTxPos {
+    uint256 hashBlock;
+    int nHeight;
+
+    CDiskTxIndex(const CDiskTxPos& pos, const uint256& hashBlockIn, int nHeightIn) : CDiskTxPos(pos), hashBlock(hashBlockIn), nHeight(nHeightIn)
+    {
+    }
+
+    CDiskTxIndex()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        CDiskTxPos::SetNull();
+        hashBlock.SetNull();
+        nHeight = -1;
+    }
+
+    bool HasBlock() const { return !hashBlock.IsNull(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(*(const CDiskTxPos*)this, nType, nVersion);
+        if (HasBlock())
+            nSize += ::GetSerializeSize(hashBlock, nType, nVersion) + ::GetSerializeSize(VARINT(nHeight), nType, nVersion);
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, *(const CDiskTxPos*)this, nType, nVersion);
+        if (HasBlock()) {
+            ::Serialize(s, hashBlock, nType, nVersion);
+            ::Serialize(s, VARINT(nHeight), nType, nVersion);
+        }
+    }
+
+    /** Only read from the leveldb value stream, whose end marks a legacy entry */
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, *(CDiskTxPos*)this, nType, nVersion);
+        hashBlock.SetNull();
+        nHeight = -1;
+        if (!s.empty()) {
+            ::Unserialize(s, hashBlock, nType, nVersion);
+            ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+        }
+    }
+};
+
 struct CExtDiskTxPos : public CDiskTxPos {
     unsigned int nHeight;
 
@@ -408,17 +540,28 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. cacheStore keeps the verified signatures in the signature
+ * cache; cacheFullScriptStore also records the transaction in the script execution cache, which
+ * is only looked up with block flags, so policy-only passes should leave it false.
  */
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, bool cacheFullScriptStore, std::vector<CScriptCheck>* pvChecks = NULL);
+
+/** Size the script execution cache from -maxsigcachesize; must be called before any block or transaction is validated */
+void InitScriptExecutionCache();
+
+/** Script verification flags for a block with the given timestamp */
+unsigned int GetBlockScriptFlags(int64_t nBlockTime);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fWitnessActive);
+/**
+ * Context-independent validity checks. If pvZerocoinChecks is not NULL, zerocoin spend proof
+ * verifications are pushed onto it instead of being performed inline.
+ */
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fWitnessActive, std::vector<CZerocoinSpendCheck>* pvZerocoinChecks = NULL);
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
-bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state);
+bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state, int nHeight, std::vector<CZerocoinSpendCheck>* pvZerocoinChecks = NULL);
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const libzerocoin::CoinSpend& spend, CBlockIndex* pindex);
 libzerocoin::CoinSpend TxInToZerocoinSpend(const CTxIn& txin);
 bool TxOutToPublicCoin(const CTxOut txout, libzerocoin::PublicCoin& pubCoin, CValidationState& state);
@@ -497,8 +640,8 @@ private:
 
 public:
     CScriptCheck() : amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+                                                                                                                             ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
 
     bool operator()();
 
@@ -516,6 +659,39 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing one zerocoin spend proof verification
+ * (commitment, accumulator and serial number proofs of a single CoinSpend).
+ * The accumulator value is looked up by the caller so that workers never
+ * touch the zerocoin database.
+ */
+class CZerocoinSpendCheck
+{
+private:
+    std::shared_ptr<libzerocoin::CoinSpend> pspend;
+    libzerocoin::ZerocoinParams* params;
+    CBigNum bnAccumulatorValue;
+    uint256 txid;
+
+public:
+    CZerocoinSpendCheck() : params(NULL), bnAccumulatorValue(0), txid(0) {}
+    CZerocoinSpendCheck(const libzerocoin::CoinSpend& spendIn, libzerocoin::ZerocoinParams* paramsIn, const CBigNum& bnAccumulatorValueIn, const uint256& txidIn) : pspend(std::make_shared<libzerocoin::CoinSpend>(spendIn)),
+                                                                                                                                                                     params(paramsIn), bnAccumulatorValue(bnAccumulatorValueIn), txid(txidIn) {}
+
+    bool operator()();
+
+    void swap(CZerocoinSpendCheck& check)
+    {
+        pspend.swap(check.pspend);
+        std::swap(params, check.params);
+        std::swap(bnAccumulatorValue, check.bnAccumulatorValue);
+        std::swap(txid, check.txid);
+    }
+};
+
+/** Number of zerocoin spend proofs verified and the total time spent on them, in microseconds */
+void GetZerocoinSpendCheckStats(int64_t& nCount, int64_t& nTimeMicros);
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
@@ -523,6 +699,9 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 bool ReadTransaction(CTransaction& tx, const CDiskTxPos& pos, uint256& hashBlock);
 bool FindTransactionsByDestination(const CTxDestination& dest, std::set<CExtDiskTxPos>& setpos);
+/** Key of a destination in the address and spent indexes, false if the destination is not indexed */
+bool GetAddressIndexKey(const CTxDestination& dest, uint160& hashBytes, int& type);
+bool GetAddressIndexKey(const CScript& scriptPubKey, uint160& hashBytes, int& type);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -542,7 +721,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev);
+/** Run the proof-of-stake checks AcceptBlock deferred because the parent had no stake context yet, and
+ *  compute the stake modifier. The parent must be the tip. */
+bool CheckStakeContext(CValidationState& state, const CBlock& block, CBlockIndex* pindex);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
@@ -553,7 +735,7 @@ bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex
 
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 bool RewindBlockIndex(const CChainParams& params);
 
@@ -89,6 +89,7 @@ CAmount GetMasternodeCollateral()
         nScanningErrorCount = 0;
         nLastScanningErrorBlockHeight = 0;
         lastTimeChecked = 0;
+        fCollateralChecked = false;
         nLastDsee = 0;  // temporary, do not save. Remove after migration to v12
         nLastDseep = 0; // temporary, do not save. Remove after migration to v12
     }
@@ -114,6 +115,7 @@ CAmount GetMasternodeCollateral()
         nScanningErrorCount = other.nScanningErrorCount;
         nLastScanningErrorBlockHeight = other.nLastScanningErrorBlockHeight;
         lastTimeChecked = 0;
+        fCollateralChecked = other.fCollateralChecked;
         nLastDsee = other.nLastDsee;   // temporary, do not save. Remove after migration to v12
         nLastDseep = other.nLastDseep; // temporary, do not save. Remove after migration to v12
     }
@@ -139,6 +141,7 @@ CAmount GetMasternodeCollateral()
         nScanningErrorCount = 0;
         nLastScanningErrorBlockHeight = 0;
         lastTimeChecked = 0;
+        fCollateralChecked = false;
         nLastDsee = 0;  // temporary, do not save. Remove after migration to v12
         nLastDseep = 0; // temporary, do not save. Remove after migration to v12
     }
@@ -149,6 +152,7 @@ CAmount GetMasternodeCollateral()
     bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast & mnb)
     {
         if (mnb.sigTime > sigTime) {
+            bool fKeysChanged = pubKeyMasternode != mnb.pubKeyMasternode || pubKeyCollateralAddress != mnb.pubKeyCollateralAddress;
             pubKeyMasternode = mnb.pubKeyMasternode;
             pubKeyCollateralAddress = mnb.pubKeyCollateralAddress;
             sigTime = mnb.sigTime;
@@ -156,6 +160,8 @@ CAmount GetMasternodeCollateral()
             protocolVersion = mnb.protocolVersion;
             addr = mnb.addr;
             lastTimeChecked = 0;
+            if (fKeysChanged)
+                mnodeman.ReindexMasternodes();
             int nDoS = 0;
             if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
                 lastPing = mnb.lastPing;
@@ -176,13 +182,23 @@ CAmount GetMasternodeCollateral()
         if (chainActive.Tip() == NULL) return 0;
 
         uint256 hash = 0;
-        uint256 aux = vin.prevout.hash + vin.prevout.n;
 
         if (!GetBlockHash(hash, nBlockHeight)) {
             LogPrint("masternode", "CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
             return 0;
         }
 
+        return CalculateScore(hash);
+    }
+
+    //
+    // Same score as above for an already resolved block hash. Does not touch the chain, so it is safe
+    // to call concurrently for different Masternodes.
+    //
+    uint256 CMasternode::CalculateScore(const uint256& hash) const
+    {
+        uint256 aux = vin.prevout.hash + vin.prevout.n;
+
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << hash;
         uint256 hash2 = ss.GetHash();
@@ -225,20 +241,30 @@ CAmount GetMasternodeCollateral()
         }
 
         if (!unitTest) {
-            CValidationState state;
-            CMutableTransaction tx = CMutableTransaction();
-            CTxOut vout = CTxOut((GetMasternodeCollateral() - 0.01) * COIN, obfuScationPool.collateralPubKey);
-            tx.vin.push_back(vin);
-            tx.vout.push_back(vout);
-
-            {
-                TRY_LOCK(cs_main, lockMain);
-                if (!lockMain) return;
-
-                if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                    activeState = MASTERNODE_VIN_SPENT;
-                    return;
+            // mined spends of known collaterals are reported by the validation interface
+            if (mnodeman.IsCollateralSpent(vin.prevout)) {
+                activeState = MASTERNODE_VIN_SPENT;
+                return;
+            }
+
+            // collaterals spent before we started listening are caught with a single mempool check
+            if (!fCollateralChecked) {
+                CValidationState state;
+                CMutableTransaction tx = CMutableTransaction();
+                CTxOut vout = CTxOut((GetMasternodeCollateral() - 0.01) * COIN, obfuScationPool.collateralPubKey);
+                tx.vin.push_back(vin);
+                tx.vout.push_back(vout);
+
+                {
+                    TRY_LOCK(cs_main, lockMain);
+                    if (!lockMain) return;
+
+                    if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
+                        activeState = MASTERNODE_VIN_SPENT;
+                        return;
+                    }
                 }
+                fCollateralChecked = true;
             }
         }
 
@@ -111,6 +111,8 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
+    // the collateral was found unspent once, later spends are reported through mnodeman
+    bool fCollateralChecked;
 
 public:
     enum state {
@@ -176,6 +178,7 @@ public:
         swap(first.nLastDsq, second.nLastDsq);
         swap(first.nScanningErrorCount, second.nScanningErrorCount);
         swap(first.nLastScanningErrorBlockHeight, second.nLastScanningErrorBlockHeight);
+        swap(first.fCollateralChecked, second.fCollateralChecked);
     }
 
     CMasternode& operator=(CMasternode from)
@@ -193,6 +196,7 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    uint256 CalculateScore(const uint256& hashBlock) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -14,6 +14,7 @@
 #include <boost/filesystem.hpp>
 
 #define MN_WINNER_MINIMUM_AGE 8000    // Age in seconds. This should be > MASTERNODE_REMOVAL_SECONDS to avoid misconfigured new nodes in the list.
+#define MN_RANK_CACHE_HEIGHTS 128     // Number of block heights to keep ranked Masternode scores for.
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
@@ -26,19 +27,11 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+struct CompareScoreIndex {
+    bool operator()(const pair<int64_t, size_t>& t1,
+        const pair<int64_t, size_t>& t2) const
     {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
@@ -209,6 +202,8 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        IndexMasternode(vMasternodes.size() - 1);
+        InvalidateRankCache();
         return true;
     }
 
@@ -247,6 +242,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
+    bool fRemoved = false;
     vector<CMasternode>::iterator it = vMasternodes.begin();
     while (it != vMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
@@ -279,11 +275,17 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vMasternodes.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if (fRemoved) {
+        ReindexMasternodes();
+        InvalidateRankCache();
+    }
+
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
     while (it1 != mAskedUsForMasternodeList.end()) {
@@ -340,6 +342,8 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    ReindexMasternodes();
+    InvalidateRankCache();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -435,28 +439,60 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
-CMasternode* CMasternodeMan::Find(const CScript& payee)
+void CMasternodeMan::IndexMasternode(size_t i)
+{
+    const CMasternode& mn = vMasternodes[i];
+    mapMasternodeOutpoints.insert(make_pair(mn.vin.prevout, i));
+    mapMasternodePayees.insert(make_pair(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), i));
+    mapMasternodePubKeys.insert(make_pair(mn.pubKeyMasternode, i));
+
+    LOCK(cs_collaterals);
+    setCollaterals.insert(mn.vin.prevout);
+}
+
+void CMasternodeMan::ReindexMasternodes()
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    mapMasternodeOutpoints.clear();
+    mapMasternodePayees.clear();
+    mapMasternodePubKeys.clear();
+    {
+        LOCK(cs_collaterals);
+        setCollaterals.clear();
     }
-    return NULL;
+    for (size_t i = 0; i < vMasternodes.size(); i++)
+        IndexMasternode(i);
+
+    // forget spends of collaterals that left the list
+    LOCK(cs_collaterals);
+    std::map<COutPoint, uint256>::iterator it = mapSpentCollaterals.begin();
+    while (it != mapSpentCollaterals.end()) {
+        if (!setCollaterals.count(it->first))
+            mapSpentCollaterals.erase(it++);
+        else
+            ++it;
+    }
+}
+
+CMasternode* CMasternodeMan::Find(const CScript& payee)
+{
+    LOCK(cs);
+
+    std::map<CScript, size_t>::const_iterator it = mapMasternodePayees.find(payee);
+    if (it == mapMasternodePayees.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    std::map<COutPoint, size_t>::const_iterator it = mapMasternodeOutpoints.find(vin.prevout);
+    if (it == mapMasternodeOutpoints.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 
 
@@ -464,11 +500,10 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    std::map<CPubKey, size_t>::const_iterator it = mapMasternodePubKeys.find(pubKeyMasternode);
+    if (it == mapMasternodePubKeys.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 
 //
@@ -591,18 +626,51 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
+std::shared_ptr<const CMasternodeMan::CMasternodeScores> CMasternodeMan::GetRankScores(int64_t nBlockHeight)
+{
+    AssertLockHeld(cs);
+
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return std::shared_ptr<const CMasternodeScores>();
+
+    std::map<int64_t, std::shared_ptr<const CMasternodeScores> >::iterator it = mapRankCache.find(nBlockHeight);
+    if (it != mapRankCache.end() && it->second->hashBlock == hash)
+        return it->second;
+
+    // Scores only depend on the block hash and the collateral input, so they are computed once per
+    // height for the whole list
+    std::shared_ptr<CMasternodeScores> pscores = std::make_shared<CMasternodeScores>();
+    pscores->hashBlock = hash;
+    pscores->vScores.reserve(vMasternodes.size());
+    for (size_t i = 0; i < vMasternodes.size(); i++)
+        pscores->vScores.push_back(make_pair(vMasternodes[i].CalculateScore(hash).GetCompact(false), i));
+    std::stable_sort(pscores->vScores.begin(), pscores->vScores.end(), CompareScoreIndex());
+
+    // make room before inserting, dropping the lowest heights other than the one being computed
+    if (it != mapRankCache.end())
+        mapRankCache.erase(it);
+    while (mapRankCache.size() >= MN_RANK_CACHE_HEIGHTS)
+        mapRankCache.erase(mapRankCache.begin());
+    mapRankCache[nBlockHeight] = pscores;
+
+    return pscores;
+}
+
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    std::shared_ptr<const CMasternodeScores> pscores = GetRankScores(nBlockHeight);
+    if (!pscores) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // walk the cached ranking, skipping the Masternodes that don't qualify right now
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, pscores->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -619,18 +687,9 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -640,36 +699,41 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    LOCK(cs);
+
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    std::shared_ptr<const CMasternodeScores> pscores = GetRankScores(nBlockHeight);
+    if (!pscores) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // disabled Masternodes are ranked with a fixed score of 9999, after every enabled one scoring higher
+    const int64_t nDisabledScore = 9999;
+    std::vector<size_t> vDisabled;
+    bool fDisabledAdded = false;
+    int rank = 0;
+
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, pscores->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vDisabled.push_back(s.second);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        if (!fDisabledAdded && s.first < nDisabledScore) {
+            BOOST_FOREACH (size_t i, vDisabled)
+                vecMasternodeRanks.push_back(make_pair(++rank, vMasternodes[i]));
+            fDisabledAdded = true;
+        }
+        vecMasternodeRanks.push_back(make_pair(++rank, mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+    if (!fDisabledAdded) {
+        BOOST_FOREACH (size_t i, vDisabled)
+            vecMasternodeRanks.push_back(make_pair(++rank, vMasternodes[i]));
     }
 
     return vecMasternodeRanks;
@@ -677,29 +741,23 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    std::shared_ptr<const CMasternodeScores> pscores = GetRankScores(nBlockHeight);
+    if (!pscores) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, size_t) & s, pscores->vScores) {
+        CMasternode& mn = vMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -941,7 +999,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (pmn->nLastDsee < sigTime) { //take the newest entry
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
-                        pmn->pubKeyMasternode = pubkey2;
+                        if (pmn->pubKeyMasternode != pubkey2) {
+                            pmn->pubKeyMasternode = pubkey2;
+                            ReindexMasternodes();
+                        }
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -1140,6 +1201,8 @@ void CMasternodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
             vMasternodes.erase(it);
+            ReindexMasternodes();
+            InvalidateRankCache();
             break;
         }
         ++it;
@@ -1163,6 +1226,40 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
     }
 }
 
+bool CMasternodeMan::IsCollateralSpent(const COutPoint& outpoint) const
+{
+    LOCK(cs_collaterals);
+    return mapSpentCollaterals.count(outpoint) > 0;
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    // A mempool spend can still be evicted or conflicted without a signal, so only mined spends count.
+    // Without a block the transaction has left the chain (disconnected or conflicted) or only reached
+    // the mempool, so the spends it made, if any, are undone.
+    LOCK(cs_collaterals);
+    if (pblock == NULL) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            std::map<COutPoint, uint256>::iterator it = mapSpentCollaterals.find(txin.prevout);
+            if (it != mapSpentCollaterals.end() && it->second == tx.GetHash()) {
+                LogPrint("masternode", "CMasternodeMan::SyncTransaction -- collateral %s no longer spent by %s\n", txin.prevout.ToStringShort(), it->second.ToString());
+                mapSpentCollaterals.erase(it);
+            }
+        }
+        return;
+    }
+
+    if (setCollaterals.empty())
+        return;
+
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (setCollaterals.count(txin.prevout)) {
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction -- collateral %s spent by %s\n", txin.prevout.ToStringShort(), tx.GetHash().ToString());
+            mapSpentCollaterals[txin.prevout] = tx.GetHash();
+        }
+    }
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
@@ -13,6 +13,9 @@
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
+
+#include <memory>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
@@ -50,7 +53,7 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -68,6 +71,35 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // positions in vMasternodes by collateral outpoint, payee script and masternode pubkey. When several
+    // entries share a key the first one in vMasternodes is indexed, as the linear scans used to return
+    std::map<COutPoint, size_t> mapMasternodeOutpoints;
+    std::map<CScript, size_t> mapMasternodePayees;
+    std::map<CPubKey, size_t> mapMasternodePubKeys;
+
+    /// Index the entry at position i of vMasternodes, keeping existing entries for shared keys
+    void IndexMasternode(size_t i);
+
+    // collateral outpoints of the list and the ones seen spent in blocks with their spending transaction,
+    // kept under their own lock so that validation callbacks never wait on cs
+    mutable CCriticalSection cs_collaterals;
+    std::set<COutPoint> setCollaterals;
+    std::map<COutPoint, uint256> mapSpentCollaterals;
+
+    // Masternode scores for a block height, sorted best first. Entries index into vMasternodes and are
+    // only valid until the list changes, see InvalidateRankCache()
+    struct CMasternodeScores {
+        uint256 hashBlock;
+        std::vector<std::pair<int64_t, size_t> > vScores;
+    };
+    std::map<int64_t, std::shared_ptr<const CMasternodeScores> > mapRankCache;
+
+    /// Drop all cached rankings, must be called whenever vMasternodes is modified
+    void InvalidateRankCache() { mapRankCache.clear(); }
+
+    /// Sorted scores of all Masternodes for a block height, computed once per block
+    std::shared_ptr<const CMasternodeScores> GetRankScores(int64_t nBlockHeight);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -83,7 +115,11 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        if (ser_action.ForRead())
+            InvalidateRankCache();
         READWRITE(vMasternodes);
+        if (ser_action.ForRead())
+            ReindexMasternodes();
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -117,6 +153,9 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
+    /// Rebuild the lookup indexes, must be called after entries are erased or their keys are changed
+    void ReindexMasternodes();
+
     /// Find an entry
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
@@ -159,6 +198,13 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Whether a transaction spending this collateral is in a block that has not been disconnected since
+    bool IsCollateralSpent(const COutPoint& outpoint) const;
+
+protected:
+    // CValidationInterface
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
 };
 
 #endif
@@ -30,7 +30,11 @@
 #include "spork.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
+#include <limits>
 
 using namespace std;
 
@@ -39,137 +43,174 @@ using namespace std;
 // BeetokMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockCost = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+/** Times a template that fails TestBlockValidity is assembled again after removing its invalid transactions */
+static const int MAX_TEMPLATE_RETRIES = 3;
+
+namespace {
+/**
+ * A mempool entry some of whose ancestors are already in the block, with
+ * its ancestor package reduced to the ancestors that are not.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry) : iter(entry), nSizeWithAncestors(entry->GetSizeWithAncestors()), nModFeesWithAncestors(entry->GetModFeesWithAncestors()) {}
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+/** Same order as CompareTxMemPoolEntryByAncestorFee, on the reduced packages */
+class CompareModifiedEntry
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 != f2)
+            return f1 > f2;
+        return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+    }
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
     {
+        return entry.iter;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockCost = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by mempool entry
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by reduced ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
+private:
+    CTxMemPool::txiter iter;
+};
 
+/** Sorts a package so that every transaction comes after its in-package ancestors */
+class CompareTxIterByAncestorCount
+{
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
     }
 };
 
-void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
+/**
+ * Reduce the ancestor packages of the in-mempool descendants of the
+ * transactions just added to the block, which are not themselves in it.
+ */
+void UpdatePackagesForAdded(const CTxMemPool& pool, const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
 {
-    pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
-
-    // Updating time can change work required on testnet:
-    if (Params().AllowMinDifficultyBlocks())
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        pool.CalculateDescendants(it, descendants);
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
 }
 
-std::pair<int, std::pair<uint256, uint256> > pCheckpointCache;
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
+/**
+ * Priority of a transaction for the priority part of the block.
+ * Zerocoin spends have no coin age; they get (age^6 + 100000) * amount,
+ * with age the time they have spent in the mempool, so that old and large
+ * zBTOK spends get into the next block.
+ */
+double GetBlockPriority(CTxMemPool& pool, CTxMemPool::txiter iter, int nHeight)
 {
-    CReserveKey reservekey(pwallet);
-
-    // Create new block
-    unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if (!pblocktemplate.get())
-        return NULL;
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
-
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
-
-    // Decide whether to include witness transactions
-    // This is only needed in case the witness softfork activation is reverted
-    // (which would require a very deep reorganization) or when
-    // -promiscuousmempoolflags is used.
-    // TODO: replace this with a call to main to assess validity of a mempool
-    // transaction (which in most cases can be a no-op).
-    bool fIncludeWitness = IsSporkActive(SPORK_18_SEGWIT_ACTIVATION);
+    const CTransaction& tx = iter->GetTx();
+    const uint256& txid = tx.GetHash();
+    double dPriority = 0;
+    if (iter->IsZerocoinSpend()) {
+        int64_t nTimeSeen = GetAdjustedTime();
+        double nConfs = 100000;
+
+        auto it = mapZerocoinspends.find(txid);
+        if (it != mapZerocoinspends.end()) {
+            nTimeSeen = it->second;
+        } else {
+            //for some reason not in map, add it
+            mapZerocoinspends[txid] = nTimeSeen;
+        }
 
-    // Make sure to create the correct block version after zerocoin is enabled
-    bool fZerocoinActive = chainActive.Height() >= Params().Zerocoin_StartHeight();
-    if (fZerocoinActive)
-        pblock->nVersion = 4;
-    else
-        pblock->nVersion = 3;
+        double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-    pblock->vtx.push_back(txNew);
-    pblocktemplate->vTxFees.push_back(-1);   // updated at end
-    pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
+        // zBTOK spends can have very large priority, use non-overflowing safe functions
+        dPriority = double_safe_addition(dPriority, (nTimePriority * nConfs));
+        dPriority = double_safe_multiplication(dPriority, iter->GetZerocoinSpent());
+    } else {
+        dPriority = iter->GetPriority(nHeight);
+    }
 
-    // ppcoin: if coinstake available add coinstake tx
-    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // only initialized at startup
+    CAmount dummy = 0;
+    pool.ApplyDeltas(txid, dPriority, dummy);
+    return dPriority;
+}
 
-    if (fProofOfStake) {
-        boost::this_thread::interruption_point();
-        pblock->nTime = GetAdjustedTime();
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
-        CMutableTransaction txCoinStake;
-        int64_t nSearchTime = pblock->nTime; // search to current time
-        bool fStakeFound = false;
-        if (nSearchTime >= nLastCoinStakeSearchTime) {
-            unsigned int nTxNewTime = 0;
-            if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
-                pblock->nTime = nTxNewTime;
-                pblock->vtx[0].vout[0].SetEmpty();
-                pblock->vtx.push_back(CTransaction(txCoinStake));
-                fStakeFound = true;
-            }
-            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-            nLastCoinStakeSearchTime = nSearchTime;
-        }
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
 
-        if (!fStakeFound)
-            return NULL;
+class TxCoinAgePriorityCompare
+{
+public:
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*b.second, *a.second); // Reverse order to make sort less than
+        return a.first < b.first;
     }
+};
+} // anon namespace
 
+BlockAssembler::BlockAssembler(CBlockTemplate* pblocktemplateIn, CTxMemPool& poolIn, int nHeightIn) : pblocktemplate(pblocktemplateIn), pool(poolIn), nHeight(nHeightIn)
+{
     // Block resource limits
     // If neither -blockmaxsize or -blockmaxcost is given, limit to DEFAULT_BLOCK_MAX_*
     // If only one is given, only restrict the specified resource.
     // If both are given, restrict both.
-    unsigned int nBlockMaxCost = DEFAULT_BLOCK_MAX_COST;
-    unsigned int nBlockMaxSize = DEFAULT_BLOCK_MAX_SIZE;
+    nBlockMaxCost = DEFAULT_BLOCK_MAX_COST;
+    nBlockMaxSize = DEFAULT_BLOCK_MAX_SIZE;
     bool fCostSet = false;
     if (mapArgs.count("-blockmaxcost")) {
         nBlockMaxCost = GetArg("-blockmaxcost", DEFAULT_BLOCK_MAX_COST);
@@ -189,346 +230,567 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
     // Whether we need to account for byte usage (in addition to cost usage)
-    bool fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000) || (nBlockPrioritySize > 0) || (nBlockMinSize > 0);
+    fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000) || (nBlockPrioritySize > 0) || (nBlockMinSize > 0);
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    // Decide whether to include witness transactions
+    // This is only needed in case the witness softfork activation is reverted
+    // (which would require a very deep reorganization) or when
+    // -promiscuousmempoolflags is used.
+    // TODO: replace this with a call to main to assess validity of a mempool
+    // transaction (which in most cases can be a no-op).
+    fIncludeWitness = IsSporkActive(SPORK_18_SEGWIT_ACTIVATION);
+    fPrintPriority = GetBoolArg("-printpriority", false);
+
+    // Reserve space for the block header, coinbase and coinstake
+    nBlockSize = 1000;
+    nBlockCost = nBlockSize * WITNESS_SCALE_FACTOR;
+    nBlockTx = 0;
+    nBlockSigOpsCost = 400;
+    nFees = 0;
+    lastFewTxs = 0;
+    blockFinished = false;
+}
 
-    {
-        LOCK2(cs_main, mempool.cs);
+void BlockAssembler::AddTransactions()
+{
+    AddPriorityTxs();
+    AddPackageTxs();
+}
 
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        int64_t nBlockSigOpsCost = 400;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
-                continue;
-            }
-            if(GetAdjustedTime() > GetSporkValue(SPORK_19_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins()){
+bool BlockAssembler::TestTransaction(const CTransaction& tx, std::vector<CBigNum>& vTxSerials) const
+{
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+        return false;
+    if (!fIncludeWitness && !tx.wit.IsNull())
+        return false; // cannot accept witness transactions into a non-witness block
+    if (!tx.ContainsZerocoins())
+        return true;
+    if (GetAdjustedTime() > GetSporkValue(SPORK_19_ZEROCOIN_MAINTENANCE_MODE))
+        return false;
+
+    // double check that there are no double spent zBtok spends in this block or tx
+    if (tx.IsZerocoinSpend()) {
+        int nHeightTx = 0;
+        if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+            return false;
+
+        for (const CTxIn& txIn : tx.vin) {
+            if (!txIn.scriptSig.IsZerocoinSpend())
                 continue;
+            libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
+            int effectiveHeight = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION ? Params().Zerocoin_LastOldParams() : Params().Zerocoin_LastOldParams() + 1;
+            if (!spend.HasValidSerial(GetZerocoinParams(effectiveHeight)))
+                return false;
+            //This zBTOK serial has already been included in the block, do not add this tx.
+            if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
+                return false;
+            if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
+                return false;
+            vTxSerials.emplace_back(spend.getCoinSerialNumber());
+        }
+    }
+    return true;
+}
+
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (nBlockCost + iter->GetTxCost() >= nBlockMaxCost) {
+        // If the block is so close to full that no more txs will fit
+        // or if we've tried more than 50 times to fill remaining space
+        // then flag that the block is finished
+        if (nBlockCost > nBlockMaxCost - 400 || lastFewTxs > 50) {
+            blockFinished = true;
+            return false;
+        }
+        // Once we're within 4000 cost of a full block, only look at 50 more txs
+        // to try to fill the remaining space.
+        if (nBlockCost > nBlockMaxCost - 4000)
+            lastFewTxs++;
+        return false;
+    }
+
+    if (fNeedSizeAccounting) {
+        if (nBlockSize + ::GetSerializeSize(iter->GetTx(), SER_NETWORK, PROTOCOL_VERSION) >= nBlockMaxSize) {
+            if (nBlockSize > nBlockMaxSize - 100 || lastFewTxs > 50) {
+                blockFinished = true;
+                return false;
             }
+            if (nBlockSize > nBlockMaxSize - 1000)
+                lastFewTxs++;
+            return false;
+        }
+    }
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
+    if (nBlockSigOpsCost + iter->GetSigOpCost() >= MAX_BLOCK_SIGOPS_COST) {
+        // If the block has room for no more sig ops then
+        // flag that the block is finished
+        if (nBlockSigOpsCost > MAX_BLOCK_SIGOPS_COST - 8) {
+            blockFinished = true;
+            return false;
+        }
+        // Otherwise attempt to find another tx with fewer sigops
+        // to put in the block.
+        return false;
+    }
 
-            // Legacy limits on sigOps:
-            int64_t nTxSigOpsCost = mi->second.GetSigOpCost();
-            if (nBlockSigOpsCost + nTxSigOpsCost >= MAX_BLOCK_SIGOPS_COST)
-                continue;
-            
-            nBlockSigOpsCost += nTxSigOpsCost;
-            pblocktemplate->vTxSigOpsCost.push_back(nTxSigOpsCost);
-
-            for (const CTxIn& txin : tx.vin) {
-                //zerocoinspend has special vin
-                if (tx.IsZerocoinSpend()) {
-                    nTotalIn = tx.GetZerocoinSpent();
-
-                    //Give a high priority to zerocoinspends to get into the next block
-                    //Priority = (age^6+100000)*amount - gives higher priority to zbtoks that have been in mempool long
-                    //and higher priority to zbtoks that are large in value
-                    int64_t nTimeSeen = GetAdjustedTime();
-                    double nConfs = 100000;
-
-                    auto it = mapZerocoinspends.find(txid);
-                    if (it != mapZerocoinspends.end()) {
-                        nTimeSeen = it->second;
-                    } else {
-                        //for some reason not in map, add it
-                        mapZerocoinspends[txid] = nTimeSeen;
-                    }
+    return true;
+}
 
-                    double nTimePriority = std::pow(GetAdjustedTime() - nTimeSeen, 6);
+bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost)
+{
+    if (nBlockCost + WITNESS_SCALE_FACTOR * packageSize >= nBlockMaxCost)
+        return false;
+    if (nBlockSigOpsCost + packageSigOpsCost >= MAX_BLOCK_SIGOPS_COST)
+        return false;
+    return true;
+}
 
-                    // zBTOK spends can have very large priority, use non-overflowing safe functions
-                    dPriority = double_safe_addition(dPriority, (nTimePriority * nConfs));
-                    dPriority = double_safe_multiplication(dPriority, nTotalIn);
+bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package, std::vector<CBigNum>& vPackageSerials)
+{
+    uint64_t nPotentialBlockSize = nBlockSize;
+    BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+        if (!TestTransaction(it->GetTx(), vPackageSerials))
+            return false;
+        if (fNeedSizeAccounting) {
+            nPotentialBlockSize += ::GetSerializeSize(it->GetTx(), SER_NETWORK, PROTOCOL_VERSION);
+            if (nPotentialBlockSize >= nBlockMaxSize)
+                return false;
+        }
+    }
+    return true;
+}
 
-                    continue;
-                }
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    const CTransaction& tx = iter->GetTx();
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOpsCost.push_back(iter->GetSigOpCost());
+    if (fNeedSizeAccounting)
+        nBlockSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nBlockCost += iter->GetTxCost();
+    ++nBlockTx;
+    nBlockSigOpsCost += iter->GetSigOpCost();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy = 0;
+        pool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), tx.GetHash().ToString());
+    }
+}
 
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+bool BlockAssembler::IsStillDependent(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, pool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
+void BlockAssembler::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
 
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+    // The priority index is kept in order for the height of this block; the
+    // zerocoin spends at its front are priced from the time they have waited,
+    // so only they, and the children released once their parents are in,
+    // go through a heap
+    pool.UpdatePriorities(nHeight);
+    typedef CTxMemPool::indexed_transaction_set::index<priority_score>::type::iterator priiter;
+    priiter mi = pool.mapTx.get<priority_score>().begin();
+    const priiter miEnd = pool.mapTx.get<priority_score>().end();
+
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    for (; mi != miEnd && mi->IsZerocoinSpend(); ++mi) {
+        CTxMemPool::txiter iter = pool.mapTx.project<0>(mi);
+        vecPriority.push_back(TxCoinAgePriority(GetBlockPriority(pool, iter, nHeight), iter));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    while ((mi != miEnd || !vecPriority.empty()) && !blockFinished) {
+        // Take the highest priority transaction from the heap or the index
+        double dPriority;
+        CTxMemPool::txiter iter;
+        TxCoinAgePriority indexTop(0, pool.mapTx.end());
+        if (mi != miEnd)
+            indexTop = TxCoinAgePriority(mi->GetCachedPriority(), pool.mapTx.project<0>(mi));
+        if (!vecPriority.empty() && (mi == miEnd || !pricomparer(vecPriority.front(), indexTop))) {
+            dPriority = vecPriority.front().first;
+            iter = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+        } else {
+            dPriority = indexTop.first;
+            iter = indexTop.second;
+            ++mi;
+        }
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+        // If tx already in block, skip
+        if (inBlock.count(iter))
+            continue;
 
-                int nConf = nHeight - coins->nHeight;
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
+
+        std::vector<CBigNum> vTxSerials;
+        if (TestForBlock(iter) && TestTransaction(iter->GetTx(), vTxSerials)) {
+            AddToBlock(iter);
+            vBlockSerials.insert(vBlockSerials.end(), vTxSerials.begin(), vTxSerials.end());
 
-                // zBTOK spends can have very large priority, use non-overflowing safe functions
-                dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(dPriority))
+                break;
 
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH (CTxMemPool::txiter child, pool.GetMemPoolChildren(iter)) {
+                std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
             }
-            if (fMissingInputs) continue;
+        }
+    }
+}
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = fNeedSizeAccounting ? ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) : 0;
-            int64_t nTxCost = mi->second.GetTxCost();
-            dPriority = tx.ComputePriority(dPriority, nTxCost);
+void BlockAssembler::AddPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(pool, inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = pool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    // Once the block reaches -blockminsize, packages below the relay fee
+    // are skipped; zerocoin spends are still taken, as before
+    bool fBelowMinFee = false;
+    while (!blockFinished && (mi != pool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != pool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = pool.mapTx.project<0>(mi);
+            if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it)) {
+                ++mi;
+                continue;
+            }
+        }
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == pool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = pool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
 
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
 
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+        }
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            fBelowMinFee = true;
+
+        CTxMemPool::setEntries ancestors;
+        int64_t packageSigOpsCost = 0;
+        std::vector<CBigNum> vPackageSerials;
+        bool fSkip = fBelowMinFee && !iter->GetTx().IsZerocoinSpend();
+        if (!fSkip) {
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            pool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            // Drop the ancestors that are already in the block
+            for (CTxMemPool::setEntries::iterator iit = ancestors.begin(); iit != ancestors.end();) {
+                if (inBlock.count(*iit))
+                    ancestors.erase(iit++);
+                else
+                    iit++;
+            }
+            ancestors.insert(iter);
+            BOOST_FOREACH (CTxMemPool::txiter it, ancestors)
+                packageSigOpsCost += it->GetSigOpCost();
+            fSkip = !TestPackage(packageSize, packageSigOpsCost) || !TestPackageTransactions(ancestors, vPackageSerials);
+        }
+        if (fSkip) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        int64_t nBlockCost = nBlockSize * WITNESS_SCALE_FACTOR;
-        int64_t nBlockTx = 0;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+        // Package can be added. Sort the entries so that parents come first
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+        BOOST_FOREACH (CTxMemPool::txiter it, sortedEntries) {
+            AddToBlock(it);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(it);
+        }
+        vBlockSerials.insert(vBlockSerials.end(), vPackageSerials.begin(), vPackageSerials.end());
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(pool, ancestors, mapModifiedTx);
+    }
+}
 
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
+{
+    pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+    // Updating time can change work required on testnet:
+    if (Params().AllowMinDifficultyBlocks())
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+}
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            int64_t nTxCost = nTxSize * WITNESS_SCALE_FACTOR;
+/**
+ * Remove the transactions of a template that failed TestBlockValidity from
+ * the mempool, with the in-mempool transactions that spend them, by
+ * replaying the template on the tip the way ConnectBlock would. Returns
+ * the number of transactions removed.
+ */
+static unsigned int RemoveInvalidTemplateTxs(CTxMemPool& pool, const CBlock& block, unsigned int nFirstTx, int nHeight)
+{
+    CCoinsViewCache view(pcoinsTip);
+    std::list<CTransaction> removed;
+    for (unsigned int i = nFirstTx; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        CValidationState state;
+        if (!view.HaveInputs(tx) || !CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false)) {
+            LogPrintf("%s: removing %s from the mempool: %s\n", __func__, tx.GetHash().ToString(), state.GetRejectReason());
+            pool.remove(tx, removed, true);
+            continue;
+        }
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+    }
+    return removed.size();
+}
 
-            if (!fIncludeWitness && !tx.wit.IsNull())
-                continue; // cannot accept witness transactions into a non-witness block
+std::pair<int, std::pair<uint256, uint256> > pCheckpointCache;
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, bool fProofOfStake)
+{
+    CReserveKey reservekey(pwallet);
 
-            if (nBlockCost + nTxCost >= nBlockMaxCost)
-                continue;
+    // Create new block
+    unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
+    if (!pblocktemplate.get())
+        return NULL;
+    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (!tx.IsZerocoinSpend() && fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockCost + nTxCost >= nBlockMinSize))
-                continue;
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (Params().MineBlocksOnDemand())
+        pblock->nVersion = GetArg("-blockversion", pblock->nVersion);
 
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+    // Make sure to create the correct block version after zerocoin is enabled
+    bool fZerocoinActive = chainActive.Height() >= Params().Zerocoin_StartHeight();
+    if (fZerocoinActive)
+        pblock->nVersion = 4;
+    else
+        pblock->nVersion = 3;
 
-            if (!view.HaveInputs(tx))
-                continue;
+    // Create coinbase tx
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    pblock->vtx.push_back(txNew);
+    pblocktemplate->vTxFees.push_back(-1);   // updated at end
+    pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
-            // double check that there are no double spent zBtok spends in this block or tx
-            if (tx.IsZerocoinSpend()) {
-                int nHeightTx = 0;
-                if (IsTransactionInChain(tx.GetHash(), nHeightTx))
-                    continue;
+    // ppcoin: if coinstake available add coinstake tx
+    static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // only initialized at startup
 
-                bool fDoubleSerial = false;
-                for (const CTxIn txIn : tx.vin) {
-                    if (txIn.scriptSig.IsZerocoinSpend()) {
-                        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
-                        int effectiveHeight = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION ? Params().Zerocoin_LastOldParams() : Params().Zerocoin_LastOldParams() + 1;
-                        if (!spend.HasValidSerial(GetZerocoinParams(effectiveHeight)))
-                            fDoubleSerial = true;
-                        if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (fDoubleSerial)
-                            break;
-                        vTxSerials.emplace_back(spend.getCoinSerialNumber());
-                    }
-                }
-                //This zBTOK serial has already been included in the block, do not add this tx.
-                if (fDoubleSerial)
-                    continue;
+    if (fProofOfStake) {
+        boost::this_thread::interruption_point();
+        pblock->nTime = GetAdjustedTime();
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+        CMutableTransaction txCoinStake;
+        int64_t nSearchTime = pblock->nTime; // search to current time
+        bool fStakeFound = false;
+        if (nSearchTime >= nLastCoinStakeSearchTime) {
+            unsigned int nTxNewTime = 0;
+            if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
+                pblock->nTime = nTxNewTime;
+                pblock->vtx[0].vout[0].SetEmpty();
+                pblock->vtx.push_back(CTransaction(txCoinStake));
+                fStakeFound = true;
             }
+            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+            nLastCoinStakeSearchTime = nSearchTime;
+        }
 
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
+        if (!fStakeFound)
+            return NULL;
+    }
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            nBlockCost += nTxCost;
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nFees += nTxFees;
+    // Collect memory pool transactions into the block
+    CAmount nFees = 0;
 
-            for (const CBigNum bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
+    {
+        LOCK2(cs_main, mempool.cs);
 
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        const int nHeight = pindexPrev->nHeight + 1;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+        // A template that fails TestBlockValidity has its invalid
+        // transactions removed from the mempool and is assembled again
+        const unsigned int nBaseTx = pblock->vtx.size();
+        const unsigned int nBaseFees = pblocktemplate->vTxFees.size();
+        const CMutableTransaction txNewBase = txNew;
+        for (int nTry = 0;; nTry++) {
+            pblock->vtx.resize(nBaseTx);
+            pblocktemplate->vTxFees.resize(nBaseFees);
+            pblocktemplate->vTxSigOpsCost.resize(nBaseFees);
+            txNew = txNewBase;
+
+            BlockAssembler assembler(pblocktemplate.get(), mempool, nHeight);
+            assembler.AddTransactions();
+            nFees = assembler.GetFees();
+            uint64_t nBlockTx = assembler.GetBlockTx();
+            int64_t nBlockCost = assembler.GetBlockCost();
+            int64_t nBlockSigOpsCost = assembler.GetBlockSigOpsCost();
+
+            if (!fProofOfStake) {
+                //Masternode and general budget payments
+                FillBlockPayee(txNew, nFees, fProofOfStake);
+
+                //Make payee
+                if (txNew.vout.size() > 1) {
+                    pblock->payee = txNew.vout[1].scriptPubKey;
                 }
             }
-        }
 
-        if (!fProofOfStake) {
-            //Masternode and general budget payments
-            FillBlockPayee(txNew, nFees, fProofOfStake);
+            nLastBlockTx = nBlockTx;
+            nLastBlockCost = nBlockCost;
+            LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigopscost %d\n", nBlockCost, nBlockTx, nFees, nBlockSigOpsCost);
 
-            //Make payee
-            if (txNew.vout.size() > 1) {
-                pblock->payee = txNew.vout[1].scriptPubKey;
+            // Compute final coinbase transaction.
+            if (!fProofOfStake) {
+                pblock->vtx[0] = txNew;
+                pblocktemplate->vTxFees[0] = -nFees;
             }
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockCost = nBlockCost;
-        LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld sigopscost %d\n", nBlockCost, nBlockTx, nFees, nBlockSigOpsCost);
-
-        // Compute final coinbase transaction.
-        if (!fProofOfStake) {
-            pblock->vtx[0] = txNew;
-            pblocktemplate->vTxFees[0] = -nFees;
-        }
-        pblock->vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev);
-
-        // Fill in header
-        pblock->hashPrevBlock = pindexPrev->GetBlockHash();
-        if (!fProofOfStake)
-            UpdateTime(pblock, pindexPrev);
-        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
-        pblock->nNonce = 0;
-        //if (fZerocoinActive) {
-        if (nHeight > 10) {  
-		//Calculate the accumulator checkpoint only if the previous cached checkpoint need to be updated
-            uint256 nCheckpoint;
-            uint256 hashBlockLastAccumulated = chainActive[nHeight - (nHeight % 10) - 10]->GetBlockHash();
-            if (nHeight >= pCheckpointCache.first || pCheckpointCache.second.first != hashBlockLastAccumulated) {
-                //For the period before v2 activation, zBTOK will be disabled and previous block's checkpoint is all that will be needed
-                pCheckpointCache.second.second = pindexPrev->nAccumulatorCheckpoint;
-                if (pindexPrev->nHeight + 2 >= Params().Zerocoin_LastOldParams()) {
-                    AccumulatorMap mapAccumulators(Params().Zerocoin_Params());
-                    if (fZerocoinActive && !CalculateAccumulatorCheckpoint(nHeight, nCheckpoint, mapAccumulators)) {
-                        LogPrintf("%s: failed to get accumulator checkpoint\n", __func__);
-                    } else {
-                        // the next time the accumulator checkpoint should be recalculated ( the next height that is multiple of 10)
-                        pCheckpointCache.first = nHeight + (10 - (nHeight % 10));
-
-                        // the block hash of the last block used in the accumulator checkpoint calc. This will handle reorg situations.
-                        pCheckpointCache.second.first = hashBlockLastAccumulated;
-                        pCheckpointCache.second.second = nCheckpoint;
+            pblock->vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
+            pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev);
+
+            // Fill in header
+            pblock->hashPrevBlock = pindexPrev->GetBlockHash();
+            if (!fProofOfStake)
+                UpdateTime(pblock, pindexPrev);
+            pblock->nBits = GetNextWorkRequired(pindexPrev, pblock);
+            pblock->nNonce = 0;
+            //if (fZerocoinActive) {
+            if (nHeight > 10) {  
+			//Calculate the accumulator checkpoint only if the previous cached checkpoint need to be updated
+                uint256 nCheckpoint;
+                uint256 hashBlockLastAccumulated = chainActive[nHeight - (nHeight % 10) - 10]->GetBlockHash();
+                if (nHeight >= pCheckpointCache.first || pCheckpointCache.second.first != hashBlockLastAccumulated) {
+                    //For the period before v2 activation, zBTOK will be disabled and previous block's checkpoint is all that will be needed
+                    pCheckpointCache.second.second = pindexPrev->nAccumulatorCheckpoint;
+                    if (pindexPrev->nHeight + 2 >= Params().Zerocoin_LastOldParams()) {
+                        AccumulatorMap mapAccumulators(Params().Zerocoin_Params());
+                        if (fZerocoinActive && !CalculateAccumulatorCheckpoint(nHeight, nCheckpoint, mapAccumulators)) {
+                            LogPrintf("%s: failed to get accumulator checkpoint\n", __func__);
+                        } else {
+                            // the next time the accumulator checkpoint should be recalculated ( the next height that is multiple of 10)
+                            pCheckpointCache.first = nHeight + (10 - (nHeight % 10));
+
+                            // the block hash of the last block used in the accumulator checkpoint calc. This will handle reorg situations.
+                            pCheckpointCache.second.first = hashBlockLastAccumulated;
+                            pCheckpointCache.second.second = nCheckpoint;
+                        }
                     }
                 }
+                pblock->nAccumulatorCheckpoint = pCheckpointCache.second.second;
             }
-            pblock->nAccumulatorCheckpoint = pCheckpointCache.second.second;
-        }
-        pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(pblock->vtx[0]);
-
-        if (fProofOfStake) {
-			if (STAKING_ON_SEGWIT < pindexPrev->nTime) {
-                bool fHaveWitness = false;
-                for (size_t t = 1; t < pblock->vtx.size(); t++) {
-                    if (!pblock->vtx[t].wit.IsNull()) {
-                        fHaveWitness = true;
-                        break;
+            pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(pblock->vtx[0]);
+
+            if (fProofOfStake) {
+				if (STAKING_ON_SEGWIT < pindexPrev->nTime) {
+                    bool fHaveWitness = false;
+                    for (size_t t = 1; t < pblock->vtx.size(); t++) {
+                        if (!pblock->vtx[t].wit.IsNull()) {
+                            fHaveWitness = true;
+                            break;
+                        }
+                    }if (fHaveWitness) {
+                        if (fDebug) {
+							//LogPrintf("CreateNewBlock : staking-on-segwit block found but the feature is not enabled.\n");
+							LogPrintf("CreateNewBlock : Accepted staking-on-segwit block found and was turned on 07/21/2019 @ 3:34pm (UTC).\n");
+						}
+
+					}else if (STAKING_ON_SEGWIT > pindexPrev->nTime) {
+						if (fDebug) {
+							LogPrintf("CreateNewBlock : Dang staking-on-segwit block found but current time is before 07/21/2019 @ 3:34pm (UTC).\n");
+							return NULL;
+						}
                     }
-                }if (fHaveWitness) {
-                    if (fDebug) {
-						//LogPrintf("CreateNewBlock : staking-on-segwit block found but the feature is not enabled.\n");
-						LogPrintf("CreateNewBlock : Accepted staking-on-segwit block found and was turned on 07/21/2019 @ 3:34pm (UTC).\n");
-					}
-
-				}else if (STAKING_ON_SEGWIT > pindexPrev->nTime) {
-					if (fDebug) {
-						LogPrintf("CreateNewBlock : Dang staking-on-segwit block found but current time is before 07/21/2019 @ 3:34pm (UTC).\n");
-						return NULL;
-					}
                 }
             }
-        }
 
 
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
-            mempool.clear();
-            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, state.GetRejectReason()));
+            CValidationState state;
+            if (TestBlockValidity(state, *pblock, pindexPrev, false, false))
+                break;
+            LogPrintf("%s: TestBlockValidity failed: %s\n", __func__, state.GetRejectReason());
+            if (nTry >= MAX_TEMPLATE_RETRIES || RemoveInvalidTemplateTxs(mempool, *pblock, nBaseTx, nHeight) == 0)
+                throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, state.GetRejectReason()));
         }
     }
 
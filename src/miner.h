@@ -6,9 +6,12 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "libzerocoin/bignum.h"
 #include "primitives/block.h"
+#include "txmempool.h"
 
 #include <stdint.h>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
@@ -18,6 +21,78 @@ class CWallet;
 
 struct CBlockTemplate;
 
+/**
+ * Fills a block template with mempool transactions. A first pass walks the
+ * mempool's priority index up to -blockprioritysize; the rest of the block
+ * is filled by walking its ancestor fee rate index, adding each transaction
+ * together with its not yet included ancestors. The mempool keeps both
+ * indexes up to date as transactions come and go (the priority one is
+ * re-keyed once per tip), so no inputs are looked up and nothing is
+ * re-sorted per template.
+ *
+ * The transactions are taken as validated on mempool entry; the finished
+ * block is still checked with TestBlockValidity by CreateNewBlock, which
+ * removes the transactions that fail from the mempool and assembles again.
+ */
+class BlockAssembler
+{
+public:
+    /** pblocktemplate must already hold the coinbase (and coinstake) of the block at nHeight */
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, CTxMemPool& poolIn, int nHeightIn);
+
+    /** Add transactions to the template. Caller must hold cs_main and pool.cs */
+    void AddTransactions();
+
+    CAmount GetFees() const { return nFees; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    int64_t GetBlockCost() const { return nBlockCost; }
+    int64_t GetBlockSigOpsCost() const { return nBlockSigOpsCost; }
+
+private:
+    CBlockTemplate* pblocktemplate;
+    CTxMemPool& pool;
+    const int nHeight;
+
+    // Limits from -blockmaxcost, -blockmaxsize, -blockprioritysize and -blockminsize
+    unsigned int nBlockMaxCost;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fNeedSizeAccounting;
+    bool fIncludeWitness;
+    bool fPrintPriority;
+
+    // Running totals of the block
+    uint64_t nBlockSize;
+    int64_t nBlockCost;
+    uint64_t nBlockTx;
+    int64_t nBlockSigOpsCost;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    std::vector<CBigNum> vBlockSerials;
+
+    // Transactions tried after the block got close to full
+    int lastFewTxs;
+    bool blockFinished;
+
+    /** Fill the first -blockprioritysize bytes by coin age priority */
+    void AddPriorityTxs();
+    /** Fill the rest by ancestor package fee rate */
+    void AddPackageTxs();
+
+    /** Whether the transaction can go into this block at all, collecting its zerocoin serials into vTxSerials */
+    bool TestTransaction(const CTransaction& tx, std::vector<CBigNum>& vTxSerials) const;
+    /** Whether a single transaction fits the remaining space, flagging the block finished when it is nearly full */
+    bool TestForBlock(CTxMemPool::txiter iter);
+    /** Whether a package of the given size and sigop cost fits the remaining space */
+    bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost);
+    /** TestTransaction and the serialized size limit for every transaction of a package */
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package, std::vector<CBigNum>& vPackageSerials);
+    void AddToBlock(CTxMemPool::txiter iter);
+    /** Whether any in-mempool parent of iter is not yet in the block */
+    bool IsStillDependent(CTxMemPool::txiter iter) const;
+};
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
@@ -32,6 +32,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -92,6 +96,7 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+bool fUseEpoll = false;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
@@ -421,7 +426,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!fUseEpoll && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -799,9 +804,10 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode* pnode)
+bool SocketSendData(CNode* pnode)
 {
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fBlocked = false;
 
     while (it != pnode->vSendMsg.end()) {
         const CSerializeData& data = *it;
@@ -818,6 +824,7 @@ void SocketSendData(CNode* pnode)
                 it++;
             } else {
                 // could not send full message; stop sending more
+                fBlocked = true;
                 break;
             }
         } else {
@@ -827,7 +834,8 @@ void SocketSendData(CNode* pnode)
                 if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                     LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
                     pnode->CloseSocketDisconnect();
-                }
+                } else if (nErr == WSAEWOULDBLOCK)
+                    fBlocked = true;
             }
             // couldn't send anything at all
             break;
@@ -839,6 +847,259 @@ void SocketSendData(CNode* pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    return fBlocked;
+}
+
+/**
+ * Whether ThreadSocketHandler should wait to receive from and to send to
+ * pnode. Implements the following logic:
+ * - If there is data to send, wait for sending data. As this only happens
+ *   when optimistic write failed, we choose to first drain the write buffer
+ *   in this case before receiving more. This avoids needlessly queueing
+ *   received data, if the remote peer is not themselves receiving data. This
+ *   means properly utilizing TCP flow control signalling.
+ * - Otherwise, if there is no (complete) message in the receive buffer, or
+ *   there is space left in the buffer, wait for receiving data.
+ * - (if neither of the above applies, there is certainly one message in the
+ *   receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always
+ * possible, so we don't deadlock:
+ * - We send some data.
+ * - We wait for data to be received (and disconnect after timeout).
+ * - We process a message in the buffer (message handler thread).
+ */
+static void GetSocketInterest(CNode* pnode, bool& fWantRecv, bool& fWantSend)
+{
+    fWantRecv = false;
+    fWantSend = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+CSocketEvents::CSocketEvents(bool fUseEpollIn) : fUseEpoll(false)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    hEpoll = -1;
+    if (fUseEpollIn) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1)
+            LogPrintf("epoll_create1 failed (%s), using select() for sockets\n", NetworkErrorString(WSAGetLastError()));
+        else
+            fUseEpoll = true;
+    }
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+}
+
+std::vector<SOCKET> CSocketEvents::Wait(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fUseEpoll)
+        return WaitEpoll(vListen, vNodesIn, nTimeout);
+#endif
+    return WaitSelect(vListen, vNodesIn, nTimeout);
+}
+
+void CSocketEvents::RecvBlocked(CNode* pnode)
+{
+    pnode->fSocketReadable = false;
+}
+
+void CSocketEvents::SendBlocked(CNode* pnode)
+{
+    pnode->fSocketWritable = false;
+}
+
+void CSocketEvents::RemoveNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    // The socket may already be closed, so the entry is found by its node
+    std::map<SOCKET, CNode*>::iterator it = mapSocketNode.begin();
+    while (it != mapSocketNode.end()) {
+        if (it->second == pnode)
+            mapSocketNode.erase(it++);
+        else
+            ++it;
+    }
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/** Most events taken from the kernel per wait */
+static const int MAX_EPOLL_EVENTS = 256;
+
+std::vector<SOCKET> CSocketEvents::WaitEpoll(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout)
+{
+    std::vector<SOCKET> vListenReady;
+
+    // Listening sockets are level-triggered: one connection is accepted per round
+    BOOST_FOREACH (SOCKET hListenSocket, vListen) {
+        if (setListenRegistered.count(hListenSocket))
+            continue;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == 0)
+            setListenRegistered.insert(hListenSocket);
+        else
+            LogPrintf("epoll_ctl failed to add listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+    }
+
+    // Register new node sockets. A closed socket leaves the epoll set by itself, and a
+    // node never gets another socket, so the flag on the node stays accurate even when
+    // the descriptor is reused. A reused descriptor replaces the entry of its old node.
+    bool fAnyReady = false;
+    BOOST_FOREACH (CNode* pnode, vNodesIn) {
+        pnode->fSocketRecvReady = false;
+        pnode->fSocketSendReady = false;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (!pnode->fSocketRegistered) {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = pnode->hSocket;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+                LogPrintf("epoll_ctl failed to add socket for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+                continue;
+            }
+            // Edge-triggered: nothing is reported for data that arrived before now
+            pnode->fSocketRegistered = true;
+            pnode->fSocketReadable = true;
+            pnode->fSocketWritable = true;
+            mapSocketNode[pnode->hSocket] = pnode;
+        }
+
+        bool fWantRecv, fWantSend;
+        GetSocketInterest(pnode, fWantRecv, fWantSend);
+        pnode->fSocketRecvReady = fWantRecv;
+        pnode->fSocketSendReady = fWantSend;
+        if ((fWantRecv && pnode->fSocketReadable) || (fWantSend && pnode->fSocketWritable))
+            fAnyReady = true;
+    }
+
+    // Don't sleep while a node can already make progress. Events that do not fit are
+    // reported by the next wait.
+    struct epoll_event vEvents[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, vEvents, MAX_EPOLL_EVENTS, fAnyReady ? 0 : nTimeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == -1) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+        nEvents = 0;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        SOCKET hSocket = vEvents[i].data.fd;
+        if (setListenRegistered.count(hSocket)) {
+            vListenReady.push_back(hSocket);
+            continue;
+        }
+        std::map<SOCKET, CNode*>::iterator it = mapSocketNode.find(hSocket);
+        if (it == mapSocketNode.end())
+            continue;
+        // Errors and hangups are picked up by the next recv
+        if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            it->second->fSocketReadable = true;
+        if (vEvents[i].events & EPOLLOUT)
+            it->second->fSocketWritable = true;
+    }
+
+    BOOST_FOREACH (CNode* pnode, vNodesIn) {
+        pnode->fSocketRecvReady = pnode->fSocketRecvReady && pnode->fSocketReadable;
+        pnode->fSocketSendReady = pnode->fSocketSendReady && pnode->fSocketWritable;
+    }
+
+    return vListenReady;
+}
+#endif
+
+std::vector<SOCKET> CSocketEvents::WaitSelect(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout)
+{
+    std::vector<SOCKET> vListenReady;
+
+    struct timeval timeout = MillisToTimeval(nTimeout);
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (SOCKET hListenSocket, vListen) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+
+    BOOST_FOREACH (CNode* pnode, vNodesIn) {
+        pnode->fSocketRecvReady = false;
+        pnode->fSocketSendReady = false;
+        if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+            continue;
+        FD_SET(pnode->hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, pnode->hSocket);
+        have_fds = true;
+
+        bool fWantRecv, fWantSend;
+        GetSocketInterest(pnode, fWantRecv, fWantSend);
+        if (fWantSend)
+            FD_SET(pnode->hSocket, &fdsetSend);
+        else if (fWantRecv)
+            FD_SET(pnode->hSocket, &fdsetRecv);
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(nTimeout);
+    }
+
+    BOOST_FOREACH (SOCKET hListenSocket, vListen) {
+        if (FD_ISSET(hListenSocket, &fdsetRecv))
+            vListenReady.push_back(hListenSocket);
+    }
+
+    BOOST_FOREACH (CNode* pnode, vNodesIn) {
+        if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+            continue;
+        pnode->fSocketRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+        pnode->fSocketSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+    }
+
+    return vListenReady;
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -846,6 +1107,8 @@ static list<CNode*> vNodesDisconnected;
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    CSocketEvents events(fUseEpoll);
+    LogPrintf("Using %s for network sockets\n", events.UsesEpoll() ? "epoll" : "select()");
     while (true) {
         //
         // Disconnect nodes
@@ -865,6 +1128,7 @@ void ThreadSocketHandler()
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
+                    events.RemoveNode(pnode);
 
                     // hold in disconnected pool until all refs are released
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -911,86 +1175,28 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        vector<SOCKET> vListen;
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+            vListen.push_back(hListenSocket.socket);
 
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH (CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
+        // 50ms is the frequency to poll pnode->vSend
+        set<SOCKET> setListenReady;
+        BOOST_FOREACH (SOCKET hSocket, events.Wait(vListen, vNodesCopy, 50))
+            setListenReady.insert(hSocket);
 
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && setListenReady.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1013,7 +1219,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!events.UsesEpoll() && !IsSelectableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1038,13 +1244,6 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             boost::this_thread::interruption_point();
 
@@ -1053,7 +1252,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (pnode->fSocketRecvReady) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
@@ -1066,6 +1265,9 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // a short read emptied the socket buffer
+                            if (nBytes < (int)sizeof(pchBuf))
+                                events.RecvBlocked(pnode);
                         } else if (nBytes == 0) {
                             // socket closed gracefully
                             if (!pnode->fDisconnect)
@@ -1078,7 +1280,8 @@ void ThreadSocketHandler()
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                                 pnode->CloseSocketDisconnect();
-                            }
+                            } else if (nErr == WSAEWOULDBLOCK)
+                                events.RecvBlocked(pnode);
                         }
                     }
                 }
@@ -1089,10 +1292,14 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (pnode->fSocketSendReady) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                if (lockSend) {
+                    // a short write or WSAEWOULDBLOCK filled the socket's send buffer; any other
+                    // early stop leaves it writable and the rest is sent on the next round
+                    if (SocketSendData(pnode))
+                        events.SendBlocked(pnode);
+                }
             }
 
             //
@@ -1611,7 +1818,7 @@ bool BindListenPort(const CService& addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket)) {
+    if (!fUseEpoll && !IsSelectableSocket(hListenSocket)) {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
         return false;
@@ -2102,6 +2309,11 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nPingUsecTime = 0;
     fPingQueued = false;
     fObfuScationMaster = false;
+    fSocketRegistered = false;
+    fSocketReadable = false;
+    fSocketWritable = false;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
 
     {
         LOCK(cs_nLastNodeId);
@@ -57,6 +57,12 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -75,7 +81,58 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
-void SocketSendData(CNode* pnode);
+/** Send queued messages until the queue or the socket's send buffer is empty; returns whether the send buffer filled up */
+bool SocketSendData(CNode* pnode);
+
+/**
+ * Waits for activity on the listening sockets and the node sockets for
+ * ThreadSocketHandler.
+ *
+ * The select() backend rebuilds its fd_sets on every wait and only handles
+ * sockets below FD_SETSIZE. The epoll backend (Linux) registers each socket
+ * once, edge-triggered: a node stays readable or writable until a recv or
+ * send on it would block. The kernel then only reports the sockets that had
+ * activity, but each wait still asks every node whether it wants to send or
+ * receive, as other threads queue messages without telling the socket thread.
+ */
+class CSocketEvents
+{
+private:
+    // Disallow copies
+    CSocketEvents(const CSocketEvents&);
+    CSocketEvents& operator=(const CSocketEvents&);
+
+    bool fUseEpoll;
+#ifdef HAVE_SYS_EPOLL_H
+    int hEpoll;
+    std::set<SOCKET> setListenRegistered;
+    std::map<SOCKET, CNode*> mapSocketNode; // registered node sockets, until RemoveNode
+
+    std::vector<SOCKET> WaitEpoll(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout);
+#endif
+    std::vector<SOCKET> WaitSelect(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout);
+
+public:
+    /** Falls back to select() if fUseEpollIn is set but epoll is unavailable */
+    explicit CSocketEvents(bool fUseEpollIn);
+    ~CSocketEvents();
+
+    bool UsesEpoll() const { return fUseEpoll; }
+
+    /**
+     * Wait up to nTimeout milliseconds. Sets CNode::fSocketRecvReady and
+     * CNode::fSocketSendReady on the nodes to service and returns the
+     * listening sockets with a connection to accept.
+     */
+    std::vector<SOCKET> Wait(const std::vector<SOCKET>& vListen, const std::vector<CNode*>& vNodesIn, int64_t nTimeout);
+
+    /** A recv on pnode's socket would block or drained it */
+    void RecvBlocked(CNode* pnode);
+    /** A send on pnode's socket would block */
+    void SendBlocked(CNode* pnode);
+    /** pnode is disconnected and will be deleted */
+    void RemoveNode(CNode* pnode);
+};
 
 typedef int NodeId;
 
@@ -125,6 +182,7 @@ extern uint64_t nRelevantServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern bool fUseEpoll;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -325,6 +383,12 @@ public:
     // (even if it's relative to mixing e.g. for blinding) should NOT set this to 'true'.
     // For such cases node should be released manually (preferably right after corresponding code).
     bool fObfuScationMaster;
+    // Socket readiness, only used by ThreadSocketHandler through CSocketEvents
+    bool fSocketRegistered; // hSocket was added to the epoll set
+    bool fSocketReadable;   // epoll: no recv would block since the socket last became readable
+    bool fSocketWritable;   // epoll: no send would block since the socket last became writable
+    bool fSocketRecvReady;  // receive from hSocket in this round
+    bool fSocketSendReady;  // send to hSocket in this round
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -64,6 +64,8 @@ UniValue getinfo(const UniValue& params, bool fHelp)
             "  \"proxy\": \"host:port\",     (string, optional) the proxy used by the server\n"
             "  \"difficulty\": xxxxxx,       (numeric) the current difficulty\n"
             "  \"testnet\": true|false,      (boolean) if the server is using testnet or not\n"
+            "  \"coincacheusage\": xxxxx,    (numeric) bytes of memory used by the in-memory coins cache\n"
+            "  \"coincachehitrate\": x.xxx,  (numeric) fraction of coins lookups answered by the in-memory cache\n"
             "  \"moneysupply\" : \"supply\"       (numeric) The money supply when this block was added to the blockchain\n"
             "  \"zBTOKsupply\" :\n"
             "  {\n"
@@ -113,6 +115,8 @@ UniValue getinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("proxy", (proxy.IsValid() ? proxy.proxy.ToStringIPPort() : string())));
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("testnet", Params().TestnetToBeDeprecatedFieldRPC()));
+    obj.push_back(Pair("coincacheusage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    obj.push_back(Pair("coincachehitrate", pcoinsTip->GetCacheHitRate()));
 
     // During inital block verification chainActive.Tip() might be not yet initialized
     if (chainActive.Tip() == NULL) {
@@ -104,7 +104,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blocksdownloaded\": n,     (numeric) The number of requested blocks received from this peer\n"
+            "    \"blockbytesdownloaded\": n, (numeric) The total size in bytes of those blocks\n"
+            "    \"blockdownloadrate\": n,    (numeric) Bytes per second received in blocks while blocks were in flight from this peer\n"
+            "    \"stalling\": true|false,    (boolean) Whether this peer is holding back the block download window\n"
+            "    \"stalls\": n,               (numeric) How many times this peer held back the block download window\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -152,6 +157,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blocksdownloaded", statestats.nBlocksDownloaded));
+            obj.push_back(Pair("blockbytesdownloaded", statestats.nBlockBytesDownloaded));
+            obj.push_back(Pair("blockdownloadrate", statestats.dBlockDownloadRate));
+            obj.push_back(Pair("stalling", statestats.fStalling));
+            obj.push_back(Pair("stalls", statestats.nStalls));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
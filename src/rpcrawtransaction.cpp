@@ -6,6 +6,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addressindex.h"
 #include "base58.h"
 #include "core_io.h"
 #include "consensus/validation.h"
@@ -20,6 +21,7 @@
 #include "script/sign.h"
 #include "script/standard.h"
 #include "swifttx.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "utilmoneystr.h"
 #ifdef ENABLE_WALLET
@@ -188,6 +190,269 @@ UniValue searchrawtransactions(const UniValue& params, bool fHelp)
     return result;
 }
 
+/** The command line passes the object form as a string, so a string is either a bare address or a JSON object */
+static UniValue ParseAddressIndexParam(const UniValue& param)
+{
+    if (!param.isStr() || param.get_str().empty() || param.get_str()[0] != '{')
+        return param;
+    UniValue obj;
+    if (!obj.read(param.get_str()) || !obj.isObject())
+        throw JSONRPCError(RPC_PARSE_ERROR, "Error parsing JSON:" + param.get_str());
+    return obj;
+}
+
+static void ParseAddressIndexKeys(const UniValue& param, std::vector<std::pair<uint160, int> >& vAddresses)
+{
+    std::vector<UniValue> vValues;
+    if (param.isStr()) {
+        vValues.push_back(param);
+    } else if (param.isObject()) {
+        UniValue addressValues = find_value(param.get_obj(), "addresses");
+        if (!addressValues.isArray())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Addresses is expected to be an array");
+        vValues = addressValues.getValues();
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with an addresses array");
+    }
+
+    BOOST_FOREACH (const UniValue& value, vValues) {
+        if (!value.isStr() || !IsValidDestinationString(value.get_str()))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        uint160 hashBytes;
+        int type = 0;
+        if (!GetAddressIndexKey(DecodeDestination(value.get_str()), hashBytes, type))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address type is not indexed");
+        vAddresses.push_back(std::make_pair(hashBytes, type));
+    }
+}
+
+static std::string AddressIndexKeyToString(const uint160& hashBytes, int type)
+{
+    switch (type) {
+    case ADDRESS_TYPE_PUBKEYHASH:
+        return EncodeDestination(CKeyID(hashBytes));
+    case ADDRESS_TYPE_SCRIPTHASH:
+        return EncodeDestination(CScriptID(hashBytes));
+    case ADDRESS_TYPE_WITNESS_V0_KEYHASH: {
+        WitnessV0KeyHash id;
+        memcpy(id.begin(), hashBytes.begin(), 20);
+        return EncodeDestination(id);
+    }
+    default:
+        return "";
+    }
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|{\"addresses\":[\"address\",...]}\n"
+            "\nReturns the balance of one or more addresses from the address index (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\"      (string or json object) An address, or an object with an array of addresses\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : n,    (numeric) The current balance in satoshis\n"
+            "  \"received\" : n,   (numeric) The total amount received in satoshis, including change\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"]}'") +
+            HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"]}"));
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address balance index not enabled");
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexKeys(ParseAddressIndexParam(params[0]), vAddresses);
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        if (!pblocktree->ReadAddressIndex(it->first, it->second, addressIndex))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "No information available for address");
+
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itIndex = addressIndex.begin(); itIndex != addressIndex.end(); itIndex++) {
+            if (itIndex->second > 0)
+                nReceived += itIndex->second;
+            nBalance += itIndex->second;
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+UniValue getaddressdeltas(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressdeltas \"address\"|{\"addresses\":[\"address\",...], \"start\":n, \"end\":n}\n"
+            "\nReturns all changes to the balance of one or more addresses from the address index (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\"      (string or json object) An address, or an object with an array of addresses and an\n"
+            "                   optional start and end block height\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"satoshis\" : n,     (numeric) The difference in satoshis\n"
+            "    \"txid\" : \"hash\",    (string) The related transaction id\n"
+            "    \"index\" : n,        (numeric) The related input or output index\n"
+            "    \"blockindex\" : n,   (numeric) The position of the transaction in its block\n"
+            "    \"height\" : n,       (numeric) The block height\n"
+            "    \"address\" : \"addr\"  (string) The address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"], \"start\": 1000}'") +
+            HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"], \"start\": 1000}"));
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address balance index not enabled");
+
+    const UniValue param = ParseAddressIndexParam(params[0]);
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexKeys(param, vAddresses);
+
+    int nStart = 0;
+    int nEnd = 0;
+    if (param.isObject()) {
+        UniValue startValue = find_value(param.get_obj(), "start");
+        UniValue endValue = find_value(param.get_obj(), "end");
+        if (startValue.isNum())
+            nStart = startValue.get_int();
+        if (endValue.isNum())
+            nEnd = endValue.get_int();
+        if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start or end height");
+    }
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        if (!pblocktree->ReadAddressIndex(it->first, it->second, addressIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "No information available for address");
+
+        std::string strAddress = AddressIndexKeyToString(it->first, it->second);
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itIndex = addressIndex.begin(); itIndex != addressIndex.end(); itIndex++) {
+            UniValue delta(UniValue::VOBJ);
+            delta.push_back(Pair("satoshis", itIndex->second));
+            delta.push_back(Pair("txid", itIndex->first.txhash.GetHex()));
+            delta.push_back(Pair("index", (int)itIndex->first.index));
+            delta.push_back(Pair("blockindex", (int)itIndex->first.txindex));
+            delta.push_back(Pair("height", itIndex->first.blockHeight));
+            delta.push_back(Pair("address", strAddress));
+            result.push_back(delta);
+        }
+    }
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|{\"addresses\":[\"address\",...]}\n"
+            "\nReturns the unspent outputs of one or more addresses from the address index (requires -addressindex).\n"
+
+            "\nArguments:\n"
+            "1. \"address\"      (string or json object) An address, or an object with an array of addresses\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\" : \"addr\",   (string) The address\n"
+            "    \"txid\" : \"hash\",      (string) The output transaction id\n"
+            "    \"outputIndex\" : n,    (numeric) The output index\n"
+            "    \"script\" : \"hex\",     (string) The hex-encoded output script\n"
+            "    \"satoshis\" : n,       (numeric) The output value in satoshis\n"
+            "    \"height\" : n          (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"]}'") +
+            HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"BMA6iEZeH7zmGkWz89oETRgefeX8P2HupB\"]}"));
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address balance index not enabled");
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    ParseAddressIndexKeys(ParseAddressIndexParam(params[0]), vAddresses);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); it++) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
+        if (!pblocktree->ReadAddressUnspentIndex(it->first, it->second, unspentOutputs))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "No information available for address");
+
+        std::string strAddress = AddressIndexKeyToString(it->first, it->second);
+        for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator itUnspent = unspentOutputs.begin(); itUnspent != unspentOutputs.end(); itUnspent++) {
+            UniValue output(UniValue::VOBJ);
+            output.push_back(Pair("address", strAddress));
+            output.push_back(Pair("txid", itUnspent->first.txhash.GetHex()));
+            output.push_back(Pair("outputIndex", (int)itUnspent->first.index));
+            output.push_back(Pair("script", HexStr(itUnspent->second.script.begin(), itUnspent->second.script.end())));
+            output.push_back(Pair("satoshis", itUnspent->second.satoshis));
+            output.push_back(Pair("height", itUnspent->second.blockHeight));
+            result.push_back(output);
+        }
+    }
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\":\"hash\", \"index\":n}\n"
+            "\nReturns the input spending an output, from the spent index (requires -spentindex).\n"
+
+            "\nArguments:\n"
+            "1. {\"txid\":\"hash\", \"index\":n}  (json object) The transaction id and output index\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\" : \"hash\",   (string) The spending transaction id\n"
+            "  \"index\" : n,       (numeric) The spending input index\n"
+            "  \"height\" : n       (numeric) The height of the block containing the spend\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'") +
+            HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}"));
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled");
+
+    UniValue txidValue = find_value(params[0].get_obj(), "txid");
+    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (!txidValue.isStr() || !indexValue.isNum())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+
+    CSpentIndexKey key(ParseHashV(txidValue, "txid"), indexValue.get_int());
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(key, value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.inputIndex));
+    result.push_back(Pair("height", value.blockHeight));
+    return result;
+}
+
 UniValue getrawtransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -692,9 +957,7 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
         BOOST_FOREACH(const CTxIn& txin, mergedTx.vin) {
-            const uint256& prevHash = txin.prevout.hash;
-            CCoins coins;
-            view.AccessCoins(prevHash); // this is certainly allowed to fail
+            view.AccessCoin(txin.prevout); // this is certainly allowed to fail
         }
 
         view.SetBackend(viewDummy); // switch back to avoid locking mempool for too long
@@ -749,20 +1012,22 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
             CScript scriptPubKey(pkData.begin(), pkData.end());
 
             {
-                CCoinsModifier coins = view.ModifyCoins(txid);
-                if (coins->IsAvailable(nOut) && coins->vout[nOut].scriptPubKey != scriptPubKey) {
+                COutPoint out(txid, nOut);
+                const Coin& coin = view.AccessCoin(out);
+                if (coin.IsAvailable() && coin.out.scriptPubKey != scriptPubKey) {
                     string err("Previous output scriptPubKey mismatch:\n");
-                    err = err + coins->vout[nOut].scriptPubKey.ToString() + "\nvs:\n" +
+                    err = err + coin.out.scriptPubKey.ToString() + "\nvs:\n" +
                         scriptPubKey.ToString();
                     throw JSONRPCError(RPC_DESERIALIZATION_ERROR, err);
                 }
-                if ((unsigned int)nOut >= coins->vout.size())
-                    coins->vout.resize(nOut+1);
-                coins->vout[nOut].scriptPubKey = scriptPubKey;
-                coins->vout[nOut].nValue = 0;
+                Coin newcoin;
+                newcoin.out.scriptPubKey = scriptPubKey;
+                newcoin.out.nValue = 0;
                 if (prevOut.exists("amount")) {
-                    coins->vout[nOut].nValue = AmountFromValue(find_value(prevOut, "amount"));
+                    newcoin.out.nValue = AmountFromValue(find_value(prevOut, "amount"));
                 }
+                newcoin.nHeight = 1;
+                view.AddCoin(out, newcoin, true);
             }
 
             // if redeemScript given and not using the local wallet (private keys
@@ -820,13 +1085,13 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
     // Sign what we can:
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
         CTxIn& txin = mergedTx.vin[i];
-        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
+        const Coin& coin = view.AccessCoin(txin.prevout);
+        if (!coin.IsAvailable()) {
             TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
             continue;
         }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
-        const CAmount& amount = coins->vout[txin.prevout.n].nValue;
+        const CScript& prevPubKey = coin.out.scriptPubKey;
+        const CAmount& amount = coin.out.nValue;
 
         SignatureData sigdata;
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
@@ -895,9 +1160,12 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
         fSwiftX = params[2].get_bool();
 
     CCoinsViewCache& view = *pcoinsTip;
-    const CCoins* existingCoins = view.AccessCoins(hashTx);
+    bool fHaveChain = false;
+    for (unsigned int o = 0; !fHaveChain && o < tx.vout.size(); o++) {
+        const Coin& existingCoin = view.AccessCoin(COutPoint(hashTx, o));
+        fHaveChain = !existingCoin.IsSpent();
+    }
     bool fHaveMempool = mempool.exists(hashTx);
-    bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
         if (fSwiftX) {
@@ -336,6 +336,10 @@ static const CRPCCommand vRPCCommands[] =
         {"rawtransactions", "decodescript", &decodescript, true, false, false},
         {"rawtransactions", "getrawtransaction", &getrawtransaction, true, false, false},
         {"rawtransactions", "searchrawtransactions", &searchrawtransactions, true, false, false},
+        {"rawtransactions", "getaddressbalance", &getaddressbalance, true, false, false},
+        {"rawtransactions", "getaddressdeltas", &getaddressdeltas, true, false, false},
+        {"rawtransactions", "getaddressutxos", &getaddressutxos, true, false, false},
+        {"rawtransactions", "getspentinfo", &getspentinfo, true, false, false},
         {"rawtransactions", "sendrawtransaction", &sendrawtransaction, false, false, false},
         {"rawtransactions", "signrawtransaction", &signrawtransaction, false, false, false}, /* uses wallet if enabled */
 
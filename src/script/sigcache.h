@@ -7,11 +7,33 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <string.h>
 #include <vector>
 
+/** Default for -maxsigcachesize, the number of entries in each of the signature and script execution caches (32 bytes each) */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 1000000;
+
 class CPubKey;
 
+/**
+ * Hasher for the cuckoo caches. Their keys are salted SHA256 digests, so the
+ * eight hashes can simply be taken from different words of the key.
+ */
+class SignatureCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select < 8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -23,4 +45,7 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Size the signature cache from -maxsigcachesize; must be called before any signature is checked */
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -0,0 +1,163 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "consensus/validation.h"
+#include "keystore.h"
+#include "main.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "txdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+extern std::set<CBlockIndex*> setDirtyBlockIndex;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static std::vector<std::pair<CAddressIndexKey, CAmount> > ReadDeltas(const CKeyID& keyid)
+{
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas;
+    BOOST_CHECK(pblocktree->ReadAddressIndex(keyid, ADDRESS_TYPE_PUBKEYHASH, vDeltas));
+    return vDeltas;
+}
+
+static std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > ReadUnspent(const CKeyID& keyid)
+{
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(pblocktree->ReadAddressUnspentIndex(keyid, ADDRESS_TYPE_PUBKEYHASH, vUnspent));
+    return vUnspent;
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_connect_disconnect)
+{
+    LOCK(cs_main);
+    bool fAddressIndexOld = fAddressIndex;
+    bool fSpentIndexOld = fSpentIndex;
+    fAddressIndex = true;
+    fSpentIndex = true;
+
+    CBasicKeyStore keystore;
+    CKey keyFrom, keyTo;
+    keyFrom.MakeNewKey(true);
+    keyTo.MakeNewKey(true);
+    keystore.AddKey(keyFrom);
+    const CKeyID idFrom = keyFrom.GetPubKey().GetID();
+    const CKeyID idTo = keyTo.GetPubKey().GetID();
+    const CScript scriptFrom = GetScriptForDestination(idFrom);
+    const CScript scriptTo = GetScriptForDestination(idTo);
+
+    // A block on top of the tip paying keyTo from a coin of keyFrom. The coin is given a
+    // non-zero height, since undo data of height 0 is read as the old per-transaction format.
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const int nHeight = pindexPrev->nHeight + 1;
+    const COutPoint prevout(GetRandHash(), 0);
+    const Coin coinFrom(CTxOut(10 * COIN, scriptFrom), nHeight, false, false);
+
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    txCoinbase.vout.push_back(CTxOut(1 * COIN, scriptTo));
+
+    CMutableTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(prevout));
+    txSpend.vout.push_back(CTxOut(9 * COIN, scriptTo));
+    BOOST_CHECK(SignSignature(keystore, scriptFrom, txSpend, 0, coinFrom.out.nValue, SIGHASH_ALL));
+
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->nTime + 60;
+    block.nBits = pindexPrev->nBits;
+    block.vtx.push_back(txCoinbase);
+    block.vtx.push_back(txSpend);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    const uint256 hashSpend = block.vtx[1].GetHash();
+
+    // Kept out of mapBlockIndex; connecting marks it dirty, which is undone at the end
+    const uint256 hashBlock = block.GetHash();
+    CBlockIndex index(block);
+    CBlockIndex* pindex = &index;
+    pindex->phashBlock = &hashBlock;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = nHeight;
+
+    // Reconnecting a block while verifying the chain at startup leaves the indexes alone
+    {
+        CCoinsViewCache view(pcoinsTip);
+        view.AddCoin(prevout, Coin(coinFrom), false);
+        CValidationState state;
+        fVerifyingBlocks = true;
+        BOOST_CHECK(ConnectBlock(block, state, pindex, view, false, true));
+        fVerifyingBlocks = false;
+        BOOST_CHECK(ReadDeltas(idTo).empty());
+        BOOST_CHECK(ReadUnspent(idTo).empty());
+        CSpentIndexValue spent;
+        BOOST_CHECK(!pblocktree->ReadSpentIndex(CSpentIndexKey(prevout.hash, prevout.n), spent));
+    }
+
+    CCoinsViewCache view(pcoinsTip);
+    view.AddCoin(prevout, Coin(coinFrom), false);
+    CValidationState state;
+    BOOST_CHECK(ConnectBlock(block, state, pindex, view, false, true));
+
+    // Connecting records the spend of keyFrom and both outputs of keyTo
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vDeltas = ReadDeltas(idFrom);
+    BOOST_CHECK_EQUAL(vDeltas.size(), 1);
+    if (vDeltas.size() == 1) {
+        BOOST_CHECK(vDeltas[0].first.spending);
+        BOOST_CHECK(vDeltas[0].first.txhash == hashSpend);
+        BOOST_CHECK_EQUAL(vDeltas[0].first.blockHeight, nHeight);
+        BOOST_CHECK_EQUAL(vDeltas[0].second, -10 * COIN);
+    }
+    vDeltas = ReadDeltas(idTo);
+    BOOST_CHECK_EQUAL(vDeltas.size(), 2);
+    CAmount nReceived = 0;
+    for (size_t i = 0; i < vDeltas.size(); i++) {
+        BOOST_CHECK(!vDeltas[i].first.spending);
+        nReceived += vDeltas[i].second;
+    }
+    BOOST_CHECK_EQUAL(nReceived, 10 * COIN);
+
+    BOOST_CHECK(ReadUnspent(idFrom).empty());
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent = ReadUnspent(idTo);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 2);
+    for (size_t i = 0; i < vUnspent.size(); i++) {
+        BOOST_CHECK(vUnspent[i].second.script == scriptTo);
+        BOOST_CHECK_EQUAL(vUnspent[i].second.blockHeight, nHeight);
+    }
+
+    CSpentIndexValue spent;
+    BOOST_CHECK(pblocktree->ReadSpentIndex(CSpentIndexKey(prevout.hash, prevout.n), spent));
+    BOOST_CHECK(spent.txid == hashSpend);
+    BOOST_CHECK_EQUAL(spent.inputIndex, 0);
+    BOOST_CHECK_EQUAL(spent.blockHeight, nHeight);
+    BOOST_CHECK_EQUAL(spent.satoshis, 10 * COIN);
+    BOOST_CHECK(spent.addressHash == uint160(idFrom));
+
+    // Disconnecting removes what the block added and gives keyFrom its output back
+    bool fClean = false;
+    BOOST_CHECK(DisconnectBlock(block, state, pindex, view, &fClean));
+    BOOST_CHECK(fClean);
+
+    BOOST_CHECK(ReadDeltas(idFrom).empty());
+    BOOST_CHECK(ReadDeltas(idTo).empty());
+    BOOST_CHECK(ReadUnspent(idTo).empty());
+    vUnspent = ReadUnspent(idFrom);
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1);
+    if (vUnspent.size() == 1) {
+        BOOST_CHECK(vUnspent[0].first.txhash == prevout.hash);
+        BOOST_CHECK_EQUAL(vUnspent[0].first.index, prevout.n);
+        BOOST_CHECK_EQUAL(vUnspent[0].second.satoshis, 10 * COIN);
+        BOOST_CHECK_EQUAL(vUnspent[0].second.blockHeight, nHeight);
+    }
+    BOOST_CHECK(!pblocktree->ReadSpentIndex(CSpentIndexKey(prevout.hash, prevout.n), spent));
+
+    setDirtyBlockIndex.erase(pindex);
+    fAddressIndex = fAddressIndexOld;
+    fSpentIndex = fSpentIndexOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
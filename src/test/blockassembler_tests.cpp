@@ -0,0 +1,190 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "miner.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+#include <map>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(blockassembler_tests)
+
+static CMutableTransaction SpendTx(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+/** A template holding only a coinbase, as CreateNewBlock hands it to the assembler */
+static void InitTemplate(CBlockTemplate& blocktemplate)
+{
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    blocktemplate.block.vtx.push_back(txCoinbase);
+    blocktemplate.vTxFees.push_back(-1);
+    blocktemplate.vTxSigOpsCost.push_back(-1);
+}
+
+/** Every transaction must come after its in-block parents, and the totals must match the template */
+static void CheckTemplate(const CBlockTemplate& blocktemplate, const BlockAssembler& assembler)
+{
+    const std::vector<CTransaction>& vtx = blocktemplate.block.vtx;
+    BOOST_CHECK_EQUAL(vtx.size(), assembler.GetBlockTx() + 1);
+    BOOST_CHECK_EQUAL(blocktemplate.vTxFees.size(), vtx.size());
+    BOOST_CHECK_EQUAL(blocktemplate.vTxSigOpsCost.size(), vtx.size());
+
+    std::map<uint256, size_t> mapPos;
+    CAmount nFees = 0;
+    for (size_t i = 1; i < vtx.size(); i++) {
+        mapPos[vtx[i].GetHash()] = i;
+        nFees += blocktemplate.vTxFees[i];
+    }
+    BOOST_CHECK_EQUAL(nFees, assembler.GetFees());
+    for (size_t i = 1; i < vtx.size(); i++) {
+        for (const CTxIn& txin : vtx[i].vin) {
+            std::map<uint256, size_t>::const_iterator it = mapPos.find(txin.prevout.hash);
+            if (it != mapPos.end())
+                BOOST_CHECK(it->second < i);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockAssemblerPackageTest)
+{
+    LOCK(cs_main);
+    CTxMemPool pool(CFeeRate(0));
+    const int nHeight = chainActive.Height() + 1;
+    mapArgs["-blockprioritysize"] = "0";
+
+    // A low fee parent whose child pays for both, and an unrelated transaction
+    // paying more than the parent alone but less than the pair
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 50000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 40000LL);
+    CMutableTransaction txOther = SpendTx(COutPoint(uint256(2), 0), 50000LL);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, nHeight - 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000LL, 0, 0.0, nHeight - 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 0, 0.0, nHeight - 1));
+
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        InitTemplate(blocktemplate);
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+        CheckTemplate(blocktemplate, assembler);
+
+        const std::vector<CTransaction>& vtx = blocktemplate.block.vtx;
+        BOOST_CHECK_EQUAL(vtx.size(), 4);
+        BOOST_CHECK(vtx[1].GetHash() == txParent.GetHash());
+        BOOST_CHECK(vtx[2].GetHash() == txChild.GetHash());
+        BOOST_CHECK(vtx[3].GetHash() == txOther.GetHash());
+        BOOST_CHECK_EQUAL(assembler.GetFees(), 111000LL);
+    }
+
+    // Prioritising the unrelated transaction puts it first
+    pool.PrioritiseTransaction(txOther.GetHash(), txOther.GetHash().ToString(), 0.0, 1000000LL);
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        InitTemplate(blocktemplate);
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+        BOOST_CHECK(blocktemplate.block.vtx[1].GetHash() == txOther.GetHash());
+        // The template reports the fees actually paid
+        BOOST_CHECK_EQUAL(assembler.GetFees(), 111000LL);
+    }
+
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(BlockAssemblerPriorityTest)
+{
+    LOCK(cs_main);
+    CTxMemPool pool(CFeeRate(0));
+    const int nHeight = chainActive.Height() + 1;
+    mapArgs["-blockprioritysize"] = "100000";
+
+    // Free transactions above the free threshold; the child has the highest
+    // priority but has to wait for its parent, which has the lowest
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 50000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 50000LL);
+    CMutableTransaction txOther = SpendTx(COutPoint(uint256(2), 0), 50000LL);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0LL, 0, 1e12, nHeight - 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0LL, 0, 3e12, nHeight - 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 0LL, 0, 2e12, nHeight - 1));
+
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        InitTemplate(blocktemplate);
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+        CheckTemplate(blocktemplate, assembler);
+
+        const std::vector<CTransaction>& vtx = blocktemplate.block.vtx;
+        BOOST_CHECK_EQUAL(vtx.size(), 4);
+        BOOST_CHECK(vtx[1].GetHash() == txOther.GetHash());
+        BOOST_CHECK(vtx[2].GetHash() == txParent.GetHash());
+        BOOST_CHECK(vtx[3].GetHash() == txChild.GetHash());
+    }
+
+    // A priority delta moves the parent, and with it the child, to the front
+    pool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 5e12, 0LL);
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        InitTemplate(blocktemplate);
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+
+        const std::vector<CTransaction>& vtx = blocktemplate.block.vtx;
+        BOOST_CHECK_EQUAL(vtx.size(), 4);
+        BOOST_CHECK(vtx[1].GetHash() == txParent.GetHash());
+        BOOST_CHECK(vtx[2].GetHash() == txChild.GetHash());
+        BOOST_CHECK(vtx[3].GetHash() == txOther.GetHash());
+    }
+
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(BlockAssemblerSizeLimitTest)
+{
+    LOCK(cs_main);
+    CTxMemPool pool(CFeeRate(0));
+    const int nHeight = chainActive.Height() + 1;
+    mapArgs["-blockmaxsize"] = "20000";
+
+    for (int i = 0; i < 500; i++) {
+        CMutableTransaction tx = SpendTx(COutPoint(uint256(i + 1), 0), 50000LL);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000LL + i, 0, 0.0, nHeight - 1));
+    }
+
+    {
+        LOCK(pool.cs);
+        CBlockTemplate blocktemplate;
+        InitTemplate(blocktemplate);
+        BlockAssembler assembler(&blocktemplate, pool, nHeight);
+        assembler.AddTransactions();
+        CheckTemplate(blocktemplate, assembler);
+
+        BOOST_CHECK(assembler.GetBlockTx() > 0);
+        BOOST_CHECK(assembler.GetBlockTx() < 500);
+        BOOST_CHECK(::GetSerializeSize(blocktemplate.block, SER_NETWORK, PROTOCOL_VERSION) < 20000);
+    }
+
+    mapArgs.erase("-blockmaxsize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+static std::shared_ptr<const CBlock> MakeBlock(uint32_t nNonce)
+{
+    std::shared_ptr<CBlock> pblock(new CBlock());
+    pblock->nNonce = nNonce;
+    return pblock;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru_eviction)
+{
+    CBlockReadCache cache;
+    cache.SetMaxSize(300);
+
+    cache.Insert(CDiskBlockPos(0, 8), MakeBlock(1), 100);
+    cache.Insert(CDiskBlockPos(0, 200), MakeBlock(2), 100);
+    cache.Insert(CDiskBlockPos(1, 8), MakeBlock(3), 100);
+    BOOST_CHECK_EQUAL(cache.Get(CDiskBlockPos(0, 200))->nNonce, 2U);
+    BOOST_CHECK(!cache.Get(CDiskBlockPos(1, 200)));
+
+    // Touch the oldest block so the next insert evicts the second one instead
+    BOOST_CHECK(cache.Get(CDiskBlockPos(0, 8)));
+    cache.Insert(CDiskBlockPos(1, 200), MakeBlock(4), 100);
+    BOOST_CHECK(cache.Get(CDiskBlockPos(0, 8)));
+    BOOST_CHECK(!cache.Get(CDiskBlockPos(1, 8)));
+    BOOST_CHECK(cache.Get(CDiskBlockPos(1, 200)));
+
+    // Blocks larger than the whole cache are not kept
+    cache.Insert(CDiskBlockPos(2, 8), MakeBlock(5), 301);
+    BOOST_CHECK(!cache.Get(CDiskBlockPos(2, 8)));
+
+    cache.SetMaxSize(100);
+    BOOST_CHECK(cache.Get(CDiskBlockPos(1, 200)));
+    BOOST_CHECK(!cache.Get(CDiskBlockPos(0, 8)));
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(CDiskBlockPos(1, 200)));
+}
+
+BOOST_AUTO_TEST_CASE(memory_reader_matches_data_stream)
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.nTime = 1546300800;
+    block.nNonce = 42;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    CBlock blockRead;
+    reader >> blockRead;
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    // Reading past the end of the range fails instead of running off the buffer
+    CMemoryReader readerShort(&ss[0], &ss[0] + ss.size() - 1, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(readerShort >> blockRead, std::ios_base::failure);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(mapped_file_truncation)
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.nNonce = 7;
+    unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+
+    // Write one block followed by preallocated space, as a block file being appended to
+    const int nFile = 9999;
+    CDiskBlockPos pos(nFile, 0);
+    FILE* file = OpenBlockFile(pos);
+    BOOST_REQUIRE(file);
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    fileout << FLATDATA(Params().MessageStart()) << nBlockSize;
+    pos.nPos = MESSAGE_START_SIZE + sizeof(uint32_t);
+    fileout << block;
+    unsigned int nEnd = pos.nPos + nBlockSize;
+    AllocateFileRange(fileout.Get(), nEnd, 0x1000);
+    FileCommit(fileout.Get());
+
+    CBlockReadCache cache;
+    CBlock blockRead;
+    unsigned int nSizeRead = 0;
+    BOOST_CHECK(cache.ReadFromMappedFile(pos, blockRead, nSizeRead));
+    BOOST_CHECK_EQUAL(nSizeRead, nBlockSize);
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    // After truncation reads map the file again instead of touching pages past its end
+    cache.UnmapFile(nFile);
+    BOOST_CHECK(TruncateFile(fileout.Get(), nEnd));
+    fileout.fclose();
+    BOOST_CHECK(cache.ReadFromMappedFile(pos, blockRead, nSizeRead));
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK(!cache.ReadFromMappedFile(CDiskBlockPos(nFile, nEnd + 0x100), blockRead, nSizeRead));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,9 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "coins.h"
 #include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "undo.h"
 #include "uint256.h"
+#include "utilstrencodings.h"
 
 #include <vector>
 #include <map>
@@ -16,27 +21,27 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -44,8 +49,8 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+            map_[it->first] = it->second.coin;
+            if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
@@ -58,6 +63,21 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    //! The incrementally kept memory usage must match a full recount
+    void SelfTest() const
+    {
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+            ret += it->second.coin.DynamicMemoryUsage();
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,9 +87,10 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
-// new tip is added to the stack of caches, or the tip is flushed and removed.
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes and the first
+// two output indexes. Occasionally, a new tip is added to the stack of caches,
+// or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
 // operation hits all branches.
@@ -85,12 +106,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -102,39 +123,45 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 2); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.out.scriptPubKey.assign(insecure_rand() % 64, OP_NOP);
+                newcoin.nHeight = 1;
+                newcoin.fCoinStake = insecure_rand() % 2;
+                stack.back()->AddCoin(outpoint, newcoin, !coin.IsSpent() || insecure_rand() % 2);
+                coin = newcoin;
             } else {
-                coins.Clear();
-                entry->Clear();
+                BOOST_CHECK(stack.back()->SpendCoin(outpoint));
+                coin.Clear();
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    found_an_entry = true;
                 }
             }
+            for (CCoinsViewCacheTest* test : stack)
+                test->SelfTest();
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +178,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +202,57 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // The example from coins.h: 600 BTC to a key hash, at height 203998
+    CTxOut out(60000000000LL, GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35")))));
+    Coin coin(out, 203998, false, false);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.end()), "b0e578835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+
+    Coin coinRead;
+    ss >> coinRead;
+    BOOST_CHECK(coinRead == coin);
+
+    // The coinbase and coinstake flags take the two lowest bits of the code
+    Coin coinStake(out, 203998, false, true);
+    ss << coinStake;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.begin() + 3), "b0e579");
+    ss >> coinRead;
+    BOOST_CHECK(coinRead.fCoinStake && !coinRead.fCoinBase && coinRead.nHeight == 203998);
+}
+
+BOOST_AUTO_TEST_CASE(txundo_legacy_format)
+{
+    // Undo data from before one record per output: the metadata and the
+    // transaction version only with the last spent output of a transaction
+    CTxOut out(50 * COIN, CScript() << OP_TRUE);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    WriteCompactSize(ss, 2);
+    ss << VARINT(100 * 4 + 2) << VARINT(1) << CTxOutCompressor(REF(out));
+    ss << VARINT(0) << CTxOutCompressor(REF(out));
+    const std::string strLegacy = HexStr(ss.begin(), ss.end());
+
+    CTxUndo undo;
+    ss >> undo;
+    BOOST_CHECK(ss.empty());
+    BOOST_REQUIRE_EQUAL(undo.vprevout.size(), 2U);
+    BOOST_CHECK(undo.vprevout[0].out == out);
+    BOOST_CHECK(undo.vprevout[0].fCoinBase && !undo.vprevout[0].fCoinStake);
+    BOOST_CHECK_EQUAL(undo.vprevout[0].nHeight, 100);
+    BOOST_CHECK(undo.vprevout[1].out == out);
+    BOOST_CHECK_EQUAL(undo.vprevout[1].nHeight, 0);
+
+    // Written back, only the dropped version differs
+    ss << undo;
+    BOOST_CHECK_EQUAL(ss.size(), undo.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    std::string strWritten = HexStr(ss.begin(), ss.end());
+    BOOST_CHECK_EQUAL(strWritten.size(), strLegacy.size());
+    BOOST_CHECK(strWritten != strLegacy);
+    CTxUndo undoRead;
+    ss >> undoRead;
+    BOOST_CHECK(undoRead.vprevout == undo.vprevout);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
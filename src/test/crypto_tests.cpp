@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/common.h"
 #include "crypto/rfc6979_hmac_sha256.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
@@ -131,6 +132,28 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d_padded) {
+    // Short messages padded into one block each must hash like CSHA256 run twice
+    for (size_t nSize = 0; nSize <= 55; nSize++) {
+        unsigned char blocks[64 * 4] = {0};
+        unsigned char out[32 * 4];
+        unsigned char expected[32 * 4];
+        for (int i = 0; i < 4; i++) {
+            unsigned char* block = blocks + 64 * i;
+            for (size_t j = 0; j < nSize; j++)
+                block[j] = insecure_rand();
+            block[nSize] = 0x80;
+            WriteBE64(block + 56, nSize * 8);
+
+            unsigned char inner[32];
+            CSHA256().Write(block, nSize).Finalize(inner);
+            CSHA256().Write(inner, 32).Finalize(expected + 32 * i);
+        }
+        SHA256DPadded(out, blocks, 4);
+        BOOST_CHECK(memcmp(out, expected, sizeof(out)) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
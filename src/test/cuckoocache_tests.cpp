@@ -0,0 +1,75 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "random.h"
+#include "script/sigcache.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(cuckoocache_tests)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_contains)
+{
+    CuckooCache::cache<uint256, SignatureCacheHasher> cache;
+    BOOST_CHECK(!cache.contains(GetRandHash(), false));
+
+    const uint32_t nSize = cache.setup(4096);
+    BOOST_CHECK_EQUAL(nSize, 4096U);
+
+    // At half load nearly every key finds a slot
+    std::vector<uint256> vKeys;
+    for (uint32_t i = 0; i < nSize / 2; i++) {
+        vKeys.push_back(GetRandHash());
+        cache.insert(vKeys.back());
+    }
+    size_t nFound = 0;
+    BOOST_FOREACH (const uint256& key, vKeys)
+        nFound += cache.contains(key, false);
+    BOOST_CHECK(nFound >= vKeys.size() * 99 / 100);
+    BOOST_CHECK(!cache.contains(GetRandHash(), false));
+
+    // Overfilling the table drops keys instead of growing it
+    for (uint32_t i = 0; i < nSize * 4; i++)
+        cache.insert(GetRandHash());
+    nFound = 0;
+    BOOST_FOREACH (const uint256& key, vKeys)
+        nFound += cache.contains(key, false);
+    BOOST_CHECK(nFound < vKeys.size());
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erased_slots_are_reused)
+{
+    CuckooCache::cache<uint256, SignatureCacheHasher> cache;
+    const uint32_t nSize = cache.setup(1024);
+
+    std::vector<uint256> vOld;
+    for (uint32_t i = 0; i < nSize; i++) {
+        vOld.push_back(GetRandHash());
+        cache.insert(vOld.back());
+    }
+    // Entries looked up with erase stay readable until their slot is taken
+    size_t nErased = 0;
+    BOOST_FOREACH (const uint256& key, vOld)
+        nErased += cache.contains(key, true);
+    BOOST_FOREACH (const uint256& key, vOld)
+        if (cache.contains(key, false))
+            nErased--;
+    BOOST_CHECK_EQUAL(nErased, 0U);
+
+    // New keys fill the erased slots, so they all fit
+    std::vector<uint256> vNew;
+    for (uint32_t i = 0; i < nSize / 2; i++) {
+        vNew.push_back(GetRandHash());
+        cache.insert(vNew.back());
+    }
+    size_t nFound = 0;
+    BOOST_FOREACH (const uint256& key, vNew)
+        nFound += cache.contains(key, false);
+    BOOST_CHECK(nFound >= vNew.size() * 99 / 100);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
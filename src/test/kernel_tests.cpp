@@ -0,0 +1,78 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+// Append blocks with jittery timestamps, a third of them generating a new stake modifier
+static void BuildChain(std::vector<CBlockIndex>& vBlocks, CBlockIndex* pindexPrev, unsigned int nTimeStart)
+{
+    unsigned int nTime = nTimeStart;
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        CBlockIndex& block = vBlocks[i];
+        block.pprev = i ? &vBlocks[i - 1] : pindexPrev;
+        block.nHeight = block.pprev ? block.pprev->nHeight + 1 : 0;
+        nTime += 90 - insecure_rand() % 100;
+        block.nTime = nTime;
+        block.SetStakeModifier(((uint64_t)insecure_rand() << 32) | insecure_rand(), insecure_rand() % 3 == 0);
+        block.BuildSkip();
+    }
+}
+
+// The modifier of the first later block that generated one a selection interval after the block from
+static uint64_t KernelModifierReference(const CBlockIndex* pindexFrom)
+{
+    int64_t nTimeStop = pindexFrom->GetBlockTime() + GetStakeModifierSelectionInterval();
+    for (const CBlockIndex* pindex = chainActive.Next(pindexFrom); pindex; pindex = chainActive.Next(pindex)) {
+        if (pindex->GeneratedStakeModifier() && pindex->GetBlockTime() >= nTimeStop)
+            return pindex->nStakeModifier;
+    }
+    return 0;
+}
+
+static void CheckKernelModifiers()
+{
+    for (int nHeight = 0; nHeight <= chainActive.Height(); nHeight++) {
+        uint64_t nStakeModifier;
+        int nStakeModifierHeight;
+        int64_t nStakeModifierTime;
+        BOOST_CHECK(GetKernelStakeModifier(chainActive[nHeight], nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false));
+        BOOST_CHECK_EQUAL(nStakeModifier, KernelModifierReference(chainActive[nHeight]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_stake_modifier_index)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexOrig = chainActive.Tip();
+
+    std::vector<CBlockIndex> vMain(1000);
+    BuildChain(vMain, NULL, 1500000000);
+    chainActive.SetTip(&vMain.back());
+    CheckKernelModifiers();
+
+    // Reorganize onto a longer fork, then back onto the main chain once it grew past the fork
+    std::vector<CBlockIndex> vFork(300);
+    BuildChain(vFork, &vMain[799], vMain[799].nTime);
+    chainActive.SetTip(&vFork.back());
+    CheckKernelModifiers();
+
+    std::vector<CBlockIndex> vMainNext(200);
+    BuildChain(vMainNext, &vMain.back(), vMain.back().nTime);
+    chainActive.SetTip(&vMainNext.back());
+    CheckKernelModifiers();
+
+    // Forget the blocks that go out of scope
+    chainActive.SetTip(pindexOrig);
+    ResetKernelModifiers();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -442,6 +442,53 @@ Test_MintAndSpend()
 	return false;
 }
 
+bool
+Test_PrecomputedVerify()
+{
+	try {
+		if (gCoins[0] == NULL)
+		{
+			// No coins: mint some.
+			Test_MintCoin();
+			if (gCoins[0] == NULL) {
+				return false;
+			}
+		}
+
+		Accumulator accEmpty(&g_Params->accumulatorParams,CoinDenomination::ZQ_ONE);
+		Accumulator acc(accEmpty);
+		for (uint32_t i = 0; i < TESTS_COINS_TO_ACCUMULATE; i++) {
+			acc += gCoins[i]->getPublicCoin();
+		}
+
+		// Spend the first few coins, each with its own witness
+		vector<CoinSpend> vSpends;
+		for (uint32_t i = 0; i < 3; i++) {
+			AccumulatorWitness wAcc(g_Params, accEmpty, gCoins[i]->getPublicCoin());
+			for (uint32_t j = 0; j < TESTS_COINS_TO_ACCUMULATE; j++) {
+				wAcc += gCoins[j]->getPublicCoin();
+			}
+			vSpends.push_back(CoinSpend(g_Params, g_Params, *gCoins[i], acc, 0, wAcc, 0, SpendType::SPEND));
+		}
+
+		// The precomputed path must agree with the reference path
+		for (const CoinSpend& spend : vSpends) {
+			if (!spend.Verify(acc, true) || !spend.Verify(acc))
+				return false;
+		}
+
+		// ... also when a spend is checked against the wrong accumulator
+		Accumulator accWrong(accEmpty);
+		accWrong += gCoins[0]->getPublicCoin();
+		return !vSpends[1].Verify(accWrong, true) && !vSpends[1].Verify(accWrong);
+	} catch (runtime_error &e) {
+		cout << e.what() << endl;
+		return false;
+	}
+
+	return false;
+}
+
 void
 Test_RunAllTests()
 {
@@ -463,6 +510,7 @@ Test_RunAllTests()
 	LogTestResult("the accumulator works", Test_Accumulator);
 	LogTestResult("the commitment equality PoK works", Test_EqualityPoK);
 	LogTestResult("a minted coin can be spent", Test_MintAndSpend);
+	LogTestResult("spends verify through precomputed tables", Test_PrecomputedVerify);
 
 	cout << endl << "Average coin size is " << gCoinSize << " bytes." << endl;
 	cout << "Serial number size is " << gSerialNumberSize << " bytes." << endl;
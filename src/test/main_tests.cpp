@@ -4,11 +4,20 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
+#include "consensus/validation.h"
 #include "primitives/transaction.h"
 #include "main.h"
+#include "pow.h"
+#include "random.h"
 
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern std::set<CBlockIndex*> setDirtyBlockIndex;
+extern std::multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+
 BOOST_AUTO_TEST_SUITE(main_tests)
 
 CAmount nMoneySupplyPoWEnd = 18000000 * COIN;
@@ -54,4 +63,365 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(disk_tx_index_serialization)
+{
+    CDiskTxPos pos(CDiskBlockPos(7, 123456), 321);
+    uint256 hashBlock = uint256("0x3b2f0a1d0d54d9ff1b2e6f1c0e1f2a7e4c4e0e1a7d6b5a4c3b2a190817161514");
+
+    // An entry written with its block reads back unchanged
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskTxIndex(pos, hashBlock, 250000);
+    CDiskTxIndex txindex;
+    ss >> txindex;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(txindex.nFile == 7 && txindex.nPos == 123456 && txindex.nTxOffset == 321);
+    BOOST_CHECK(txindex.HasBlock());
+    BOOST_CHECK(txindex.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(txindex.nHeight, 250000);
+
+    // A legacy entry holding only the position reads back without a block
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << pos;
+    CDiskTxIndex txindexLegacy;
+    ssLegacy >> txindexLegacy;
+    BOOST_CHECK(txindexLegacy.nFile == 7 && txindexLegacy.nPos == 123456 && txindexLegacy.nTxOffset == 321);
+    BOOST_CHECK(!txindexLegacy.HasBlock());
+    BOOST_CHECK_EQUAL(txindexLegacy.nHeight, -1);
+}
+
+BOOST_AUTO_TEST_CASE(stake_context_deferred)
+{
+    LOCK(cs_main);
+
+    // A proof-of-stake block on the tip whose kernel does not exist
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 1 * COIN;
+
+    CBlock block;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    block.nTime = chainActive.Tip()->nTime + 60;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(coinstake);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(block.IsProofOfStake());
+
+    uint256 hash = block.GetHash();
+    CBlockIndex index(block);
+    index.phashBlock = &hash;
+    index.pprev = chainActive.Tip();
+    index.nHeight = index.pprev->nHeight + 1;
+
+    // Accepted while its parent had no stake context, the block is checked once it connects
+    index.nStatus = BLOCK_VALID_TREE | BLOCK_STAKE_PENDING;
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!CheckStakeContext(state, block, &index));
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK(index.nStatus & BLOCK_STAKE_PENDING);
+
+    // The pending state survives a restart
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CDiskBlockIndex(&index);
+    CDiskBlockIndex diskindex;
+    ss >> diskindex;
+    BOOST_CHECK(diskindex.nStatus & BLOCK_STAKE_PENDING);
+
+    // Accepted with stake context, it was checked then and is not checked again
+    index.nStatus = BLOCK_VALID_TREE;
+    CValidationState stateChecked;
+    BOOST_CHECK(CheckStakeContext(stateChecked, block, &index));
+    BOOST_CHECK(stateChecked.IsValid());
+}
+
+// Drop an entry a test added to mapBlockIndex, and every reference the node keeps to it
+static void EraseBlockIndex(CBlockIndex* pindex)
+{
+    setDirtyBlockIndex.erase(pindex);
+    mapBlocksUnlinked.erase(pindex);
+    for (std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = mapBlocksUnlinked.begin(); it != mapBlocksUnlinked.end();) {
+        if (it->second == pindex)
+            mapBlocksUnlinked.erase(it++);
+        else
+            ++it;
+    }
+    const uint256 hash = pindex->GetBlockHash();
+    mapBlockIndex.erase(hash);
+    delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(stake_context_pending_parent)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexBestHeaderOld = pindexBestHeader;
+
+    // A parent known from its header alone, so without a stake modifier of its own
+    CBlockIndex* pindexPrev = InsertBlockIndex(GetRandHash());
+    pindexPrev->pprev = chainActive.Tip();
+    pindexPrev->nHeight = chainActive.Height() + 1;
+    pindexPrev->nTime = chainActive.Tip()->nTime + 60;
+    pindexPrev->nBits = chainActive.Tip()->nBits;
+    pindexPrev->nStatus = BLOCK_VALID_TREE | BLOCK_STAKE_PENDING;
+
+    // A proof-of-stake child whose stake input is in neither the coins view nor the recent stake spends
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    coinstake.vout.resize(2);
+    coinstake.vout[0].SetEmpty();
+    coinstake.vout[1].nValue = 1 * COIN;
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->nTime + 60;
+    block.nBits = pindexPrev->nBits;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(coinstake);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(block.IsProofOfStake());
+
+    // Stored without its stake checks; CheckBlock is skipped as the block carries no signature. The
+    // position of the genesis block is passed as the known one, so nothing is written to the block files.
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    CDiskBlockPos pos = chainActive.Genesis()->GetBlockPos();
+    BOOST_CHECK(AcceptBlock(block, state, &pindex, &pos, true));
+    BOOST_CHECK(state.IsValid());
+    BOOST_REQUIRE(pindex != NULL);
+    BOOST_CHECK(pindex->nStatus & BLOCK_HAVE_DATA);
+    BOOST_CHECK(pindex->nStatus & BLOCK_STAKE_PENDING);
+
+    // Rejected once it connects, before its kernel is looked at
+    CValidationState stateConnect;
+    int nDoS = 0;
+    BOOST_CHECK(!CheckStakeContext(stateConnect, block, pindex));
+    BOOST_CHECK(stateConnect.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK_EQUAL(stateConnect.GetRejectReason(), "bad-stake-spent");
+    BOOST_CHECK(pindex->nStatus & BLOCK_STAKE_PENDING);
+
+    setStakeSeen.erase(std::make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    EraseBlockIndex(pindex);
+    EraseBlockIndex(pindexPrev);
+    pindexBestHeader = pindexBestHeaderOld;
+}
+
+BOOST_AUTO_TEST_CASE(stake_context_connect)
+{
+    LOCK(cs_main);
+
+    // A proof-of-work block on the tip, accepted while its parent had no stake context
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << (chainActive.Height() + 1) << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 1 * COIN;
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    block.nTime = chainActive.Tip()->nTime + 60;
+    block.nBits = GetNextWorkRequired(chainActive.Tip(), &block);
+    block.vtx.push_back(coinbase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(block.IsProofOfWork());
+
+    // Kept out of mapBlockIndex; computing the modifier marks it dirty, which is undone at the end
+    const uint256 hash = block.GetHash();
+    CBlockIndex index(block);
+    CBlockIndex* pindex = &index;
+    pindex->phashBlock = &hash;
+    pindex->pprev = chainActive.Tip();
+    pindex->nHeight = chainActive.Height() + 1;
+    pindex->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA | BLOCK_STAKE_PENDING;
+    BOOST_CHECK(!pindex->GeneratedStakeModifier());
+
+    // Connecting runs the deferred checks, then gives the block its modifier
+    CValidationState state;
+    BOOST_CHECK(CheckStakeContext(state, block, pindex));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(!(pindex->nStatus & BLOCK_STAKE_PENDING));
+    BOOST_CHECK(pindex->GeneratedStakeModifier());
+    BOOST_CHECK(pindex->nStakeModifier != 0);
+
+    setDirtyBlockIndex.erase(pindex);
+}
+
+BOOST_AUTO_TEST_CASE(stake_context_accept)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexBestHeaderOld = pindexBestHeader;
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlockIndex* pindexTipNext = pindexTip->pnext;
+
+    // A proof-of-work block on the tip
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << (chainActive.Height() + 1) << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 1 * COIN;
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = pindexTip->GetBlockHash();
+    block.nTime = pindexTip->nTime + 60;
+    block.nBits = GetNextWorkRequired(pindexTip, &block);
+    block.vtx.push_back(coinbase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // Its header arrives first and leaves the stake checks for later
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(AcceptBlockHeader(CBlock(block.GetBlockHeader()), state, &pindex));
+    BOOST_REQUIRE(pindex != NULL);
+    BOOST_CHECK(pindex->nStatus & BLOCK_STAKE_PENDING);
+
+    // The parent has its stake context, so accepting the block runs the checks and gives it its modifier.
+    // With the tip's transaction count hidden, the block is parked in mapBlocksUnlinked rather than
+    // becoming a candidate for the chain tip.
+    unsigned int nChainTxTip = pindexTip->nChainTx;
+    pindexTip->nChainTx = 0;
+    CDiskBlockPos pos = chainActive.Genesis()->GetBlockPos();
+    BOOST_CHECK(AcceptBlock(block, state, &pindex, &pos, true));
+    pindexTip->nChainTx = nChainTxTip;
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(!(pindex->nStatus & BLOCK_STAKE_PENDING));
+    BOOST_CHECK(pindex->GeneratedStakeModifier());
+
+    EraseBlockIndex(pindex);
+    pindexTip->pnext = pindexTipNext;
+    pindexBestHeader = pindexBestHeaderOld;
+}
+
+BOOST_AUTO_TEST_CASE(header_difficulty_bits)
+{
+    LOCK(cs_main);
+
+    // A parent past the block time target, from where headers must carry the required bits
+    uint256 hashPrev = GetRandHash();
+    CBlockIndex indexPrev;
+    indexPrev.phashBlock = &hashPrev;
+    indexPrev.pprev = chainActive.Tip();
+    indexPrev.nHeight = chainActive.Height() + 1;
+    indexPrev.nVersion = 4;
+    indexPrev.nTime = BLOCK_TIME_TARGET + 60;
+    indexPrev.nBits = chainActive.Tip()->nBits;
+
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = hashPrev;
+    header.nTime = indexPrev.nTime + 60;
+    header.nBits = GetNextWorkRequired(&indexPrev, &header);
+    CValidationState state;
+    BOOST_CHECK(ContextualCheckBlockHeader(header, state, &indexPrev));
+    BOOST_CHECK(state.IsValid());
+
+    header.nBits -= 1;
+    CValidationState stateBad;
+    int nDoS = 0;
+    BOOST_CHECK(!ContextualCheckBlockHeader(header, stateBad, &indexPrev));
+    BOOST_CHECK(stateBad.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK_EQUAL(stateBad.GetRejectReason(), "bad-diffbits");
+}
+
+static bool CollectImportBatch(std::vector<CImportedBlock>& vBlocks, std::vector<std::pair<uint64_t, uint256> >& vDecoded, int& nErrors)
+{
+    BOOST_FOREACH (const CImportedBlock& imported, vBlocks) {
+        if (imported.strError.empty())
+            vDecoded.push_back(std::make_pair(imported.nBlockPos, imported.hash));
+        else
+            nErrors++;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(import_parallel_decode)
+{
+    // A chain of more than two import batches, written parent last so that every block comes
+    // before its parent, with junk, a short record, a corrupt record and a truncated one mixed in
+    std::vector<uint256> vHashes;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << std::string("junk");
+    uint256 hashPrev = Params().HashGenesisBlock();
+    std::vector<CBlock> vBlocks;
+    for (unsigned int i = 0; i < 2 * IMPORT_BATCH_BLOCKS + 100; i++) {
+        CMutableTransaction txCoinbase;
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << (int)i << OP_0;
+        txCoinbase.vout.resize(1);
+        txCoinbase.vout[0].nValue = 1 * COIN;
+        txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+        CBlock block;
+        block.nVersion = 4;
+        block.hashPrevBlock = hashPrev;
+        block.nTime = 1500000000 + i;
+        block.vtx.push_back(CTransaction(txCoinbase));
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        hashPrev = block.GetHash();
+        vBlocks.push_back(block);
+    }
+    int nCorrupt = 0;
+    for (size_t i = vBlocks.size(); i-- > 0;) {
+        if (i % 500 == 0) {
+            unsigned int nShort = 40;
+            ss << FLATDATA(Params().MessageStart()) << nShort;
+        }
+        if (i % 700 == 0) {
+            unsigned int nSize = 200;
+            ss << FLATDATA(Params().MessageStart()) << nSize;
+            ss << std::vector<unsigned char>(nSize, 0xff);
+            nCorrupt++;
+        }
+        unsigned int nSize = ::GetSerializeSize(vBlocks[i], SER_DISK, CLIENT_VERSION);
+        ss << FLATDATA(Params().MessageStart()) << nSize << vBlocks[i];
+        vHashes.push_back(vBlocks[i].GetHash());
+    }
+    unsigned int nTruncated = 1000;
+    ss << FLATDATA(Params().MessageStart()) << nTruncated << std::string(50, 'x');
+
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    fclose(file);
+
+    // The serial path decodes on the calling thread, the parallel one on four workers
+    std::vector<std::pair<uint64_t, uint256> > vSerial, vParallel;
+    int nSerialErrors = 0, nParallelErrors = 0;
+    CImportStats stats;
+    BOOST_CHECK(ReadExternalBlockFile(fopen(path.string().c_str(), "rb"), 1, boost::bind(&CollectImportBatch, _1, boost::ref(vSerial), boost::ref(nSerialErrors)), stats));
+    BOOST_CHECK(ReadExternalBlockFile(fopen(path.string().c_str(), "rb"), 4, boost::bind(&CollectImportBatch, _1, boost::ref(vParallel), boost::ref(nParallelErrors)), stats));
+    boost::filesystem::remove(path);
+
+    BOOST_CHECK_EQUAL(nSerialErrors, nCorrupt);
+    BOOST_CHECK_EQUAL(nParallelErrors, nCorrupt);
+    BOOST_REQUIRE_EQUAL(vSerial.size(), vHashes.size());
+    BOOST_REQUIRE_EQUAL(vParallel.size(), vHashes.size());
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        BOOST_CHECK(vSerial[i].second == vHashes[i]);
+        BOOST_CHECK(vParallel[i] == vSerial[i]);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,67 @@
+// Copyright (c) 2019 The Beetok Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternodeman.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+static CTransaction SpendCollateral(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return CTransaction(tx);
+}
+
+BOOST_AUTO_TEST_CASE(collateral_spend)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(uint256(3), 0));
+    BOOST_CHECK(mnodeman.Add(mn));
+    RegisterValidationInterface(&mnodeman);
+
+    // A collateral spend that only reached the mempool does not mark the masternode spent
+    CTxMemPool pool(CFeeRate(0));
+    CTransaction txSpend = SpendCollateral(mn.vin.prevout, 10000LL);
+    pool.addUnchecked(txSpend.GetHash(), CTxMemPoolEntry(txSpend, 1000LL, 100, 0.0, 1));
+    GetMainSignals().SyncTransaction(txSpend, NULL);
+    BOOST_CHECK_EQUAL(pool.Expire(101), 1);
+    BOOST_CHECK(!mnodeman.IsCollateralSpent(mn.vin.prevout));
+    CMasternode* pmn = mnodeman.Find(mn.vin);
+    BOOST_CHECK(pmn != NULL && pmn->IsEnabled());
+
+    // Once mined, it does
+    CBlock block;
+    block.vtx.push_back(txSpend);
+    GetMainSignals().SyncTransaction(txSpend, &block);
+    BOOST_CHECK(mnodeman.IsCollateralSpent(mn.vin.prevout));
+
+    // A conflicting spend leaving the mempool does not undo the mined one
+    CTransaction txOther = SpendCollateral(mn.vin.prevout, 20000LL);
+    GetMainSignals().SyncTransaction(txOther, NULL);
+    BOOST_CHECK(mnodeman.IsCollateralSpent(mn.vin.prevout));
+
+    // Disconnecting the block syncs the spend again without a block, which undoes it
+    GetMainSignals().SyncTransaction(txSpend, NULL);
+    BOOST_CHECK(!mnodeman.IsCollateralSpent(mn.vin.prevout));
+
+    // and the spend of the other branch counts once that is connected
+    CBlock blockOther;
+    blockOther.vtx.push_back(txOther);
+    GetMainSignals().SyncTransaction(txOther, &blockOther);
+    BOOST_CHECK(mnodeman.IsCollateralSpent(mn.vin.prevout));
+
+    UnregisterValidationInterface(&mnodeman);
+    mnodeman.Remove(mn.vin);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,12 +2,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "main.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "util.h"
 
 #include <boost/test/unit_test.hpp>
 #include <list>
+#include <vector>
 
 BOOST_AUTO_TEST_SUITE(mempool_tests)
 
@@ -99,4 +102,260 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+/** A transaction spending prevout with one output of nValue; nValue also keeps the txids apart */
+static CMutableTransaction SpendTx(const COutPoint& prevout, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 30000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 20000LL);
+    CMutableTransaction txGrandChild = SpendTx(COutPoint(txChild.GetHash(), 0), 10000LL);
+    CTxMemPoolEntry entryParent(txParent, 1000LL, 0, 0.0, 1);
+    CTxMemPoolEntry entryChild(txChild, 2000LL, 0, 0.0, 1);
+    CTxMemPoolEntry entryGrandChild(txGrandChild, 3000LL, 0, 0.0, 1);
+    const uint64_t nSizeParent = entryParent.GetTxSize(), nSizeChild = entryChild.GetTxSize(), nSizeGrandChild = entryGrandChild.GetTxSize();
+
+    pool.addUnchecked(txParent.GetHash(), entryParent);
+    pool.addUnchecked(txChild.GetHash(), entryChild);
+    pool.addUnchecked(txGrandChild.GetHash(), entryGrandChild);
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nSizeParent + nSizeChild + nSizeGrandChild);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 6000LL);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithAncestors(), 3000LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nSizeParent + nSizeChild + nSizeGrandChild);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 6000LL);
+
+    // Ancestor limits are enforced for new transactions
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CTxMemPoolEntry entryNext(SpendTx(COutPoint(txGrandChild.GetHash(), 0), 5000LL), 1000LL, 0, 0.0, 1);
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entryNext, setAncestors, 4, 1000000, 25, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, 3, 1000000, 25, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entryNext, setAncestors, 25, 1000000, 3, 1000000, errString));
+
+    // Prioritising the child moves all packages it is part of
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0.0, 500LL);
+    BOOST_CHECK_EQUAL(itChild->GetModifiedFee(), 2500LL);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 6500LL);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithDescendants(), 5500LL);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 6500LL);
+
+    // The parent is mined: the others lose it as an ancestor
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itChild->GetSizeWithAncestors(), nSizeChild);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 5500LL);
+
+    // The block is disconnected again and the parent returns, finding its children
+    pool.addUnchecked(txParent.GetHash(), entryParent);
+    itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 6500LL);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nSizeParent + nSizeChild + nSizeGrandChild);
+    BOOST_CHECK(pool.GetMemPoolChildren(itParent).count(itChild));
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).count(itParent));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A parent paying nothing with a well paying child, and an unrelated transaction in between
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 30000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 20000LL);
+    CMutableTransaction txOther = SpendTx(COutPoint(uint256(2), 0), 10000LL);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0LL, 300, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 50000LL, 200, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 100, 0.0, 1));
+
+    // Eviction order: the unrelated transaction, then the parent scored with its child, then the child
+    std::vector<uint256> vExpected;
+    vExpected.push_back(txOther.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    vExpected.push_back(txChild.GetHash());
+    std::vector<uint256> vOrder;
+    for (CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator it = pool.mapTx.get<descendant_score>().begin(); it != pool.mapTx.get<descendant_score>().end(); it++)
+        vOrder.push_back(it->GetTx().GetHash());
+    BOOST_CHECK(vOrder == vExpected);
+
+    // Entry time order
+    vExpected.clear();
+    vExpected.push_back(txOther.GetHash());
+    vExpected.push_back(txChild.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    vOrder.clear();
+    for (CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator it = pool.mapTx.get<entry_time>().begin(); it != pool.mapTx.get<entry_time>().end(); it++)
+        vOrder.push_back(it->GetTx().GetHash());
+    BOOST_CHECK(vOrder == vExpected);
+
+    // Mining order: the child pays for its parent, the parent alone pays nothing
+    vExpected.clear();
+    vExpected.push_back(txChild.GetHash());
+    vExpected.push_back(txOther.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    vOrder.clear();
+    for (CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator it = pool.mapTx.get<ancestor_score>().begin(); it != pool.mapTx.get<ancestor_score>().end(); it++)
+        vOrder.push_back(it->GetTx().GetHash());
+    BOOST_CHECK(vOrder == vExpected);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPriorityIndexTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A small transaction with a head start and a large one gaining priority faster
+    CMutableTransaction txSmall = SpendTx(COutPoint(uint256(1), 0), 10000LL);
+    CMutableTransaction txLarge = SpendTx(COutPoint(uint256(2), 0), 100000000LL);
+    pool.addUnchecked(txSmall.GetHash(), CTxMemPoolEntry(txSmall, 0LL, 0, 1e6, 1));
+    pool.addUnchecked(txLarge.GetHash(), CTxMemPoolEntry(txLarge, 0LL, 0, 0.0, 1));
+    BOOST_CHECK(pool.mapTx.get<priority_score>().begin()->GetTx().GetHash() == txSmall.GetHash());
+
+    // The index is re-keyed for a later block
+    pool.UpdatePriorities(101);
+    BOOST_CHECK(pool.mapTx.get<priority_score>().begin()->GetTx().GetHash() == txLarge.GetHash());
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txLarge.GetHash())->GetCachedPriority(), pool.mapTx.find(txLarge.GetHash())->GetPriority(101));
+
+    // PrioritiseTransaction applies at once
+    pool.PrioritiseTransaction(txSmall.GetHash(), txSmall.GetHash().ToString(), 1e12, 0LL);
+    BOOST_CHECK(pool.mapTx.get<priority_score>().begin()->GetTx().GetHash() == txSmall.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    const int64_t nStart = 1500000000;
+    SetMockTime(nStart);
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 30000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 20000LL);
+    CMutableTransaction txOther = SpendTx(COutPoint(uint256(2), 0), 10000LL);
+    CTxMemPoolEntry entryOther(txOther, 10000LL, 0, 0.0, 1);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0LL, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 50000LL, 0, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), entryOther);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // The lowest descendant score goes first, and raises the minimum fee above its own rate
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(txOther.GetHash()));
+    CAmount nMinFee = CFeeRate(10000LL, entryOther.GetTxSize()).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    // Trimming is a no-op below the limit
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+
+    // The minimum fee only decays once a block has been seen
+    SetMockTime(nStart + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(pool.DynamicMemoryUsage()).GetFeePerK(), nMinFee);
+    SetMockTime(nStart);
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(nStart + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(pool.DynamicMemoryUsage()).GetFeePerK(), (CAmount)(nMinFee / 2.0));
+
+    // A parent is evicted together with its descendants
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpiryTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txOld = SpendTx(COutPoint(uint256(1), 0), 30000LL);
+    CMutableTransaction txOldChild = SpendTx(COutPoint(txOld.GetHash(), 0), 20000LL);
+    CMutableTransaction txNew = SpendTx(COutPoint(uint256(2), 0), 10000LL);
+    pool.addUnchecked(txOld.GetHash(), CTxMemPoolEntry(txOld, 1000LL, 100, 0.0, 1));
+    pool.addUnchecked(txOldChild.GetHash(), CTxMemPoolEntry(txOldChild, 1000LL, 300, 0.0, 1));
+    pool.addUnchecked(txNew.GetHash(), CTxMemPoolEntry(txNew, 1000LL, 200, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    // Expiring a transaction takes its descendants with it, however recent
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(201), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistenceTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txParent = SpendTx(COutPoint(uint256(1), 0), 30000LL);
+    CMutableTransaction txChild = SpendTx(COutPoint(txParent.GetHash(), 0), 20000LL);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 100, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000LL, 200, 0.0, 1));
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 1.5, 700LL);
+    uint256 hashMissing(3);
+    pool.PrioritiseTransaction(hashMissing, hashMissing.ToString(), 0.0, -300LL);
+
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    BOOST_CHECK(pool.WriteMempool(file));
+    rewind(file.Get());
+
+    CTxMemPool poolLoaded(CFeeRate(0));
+    std::vector<std::pair<CTransaction, int64_t> > vTx;
+    BOOST_CHECK(poolLoaded.ReadMempool(file, vTx));
+    BOOST_REQUIRE_EQUAL(vTx.size(), 2);
+    for (unsigned int i = 0; i < vTx.size(); i++) {
+        CTxMemPool::txiter it = pool.mapTx.find(vTx[i].first.GetHash());
+        BOOST_REQUIRE(it != pool.mapTx.end());
+        BOOST_CHECK(it->GetTx() == vTx[i].first);
+        BOOST_CHECK_EQUAL(it->GetTime(), vTx[i].second);
+    }
+
+    // Prioritisation survives, including that of transactions not in the pool
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    poolLoaded.ApplyDeltas(txChild.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1.5);
+    BOOST_CHECK_EQUAL(nFeeDelta, 700LL);
+    dPriorityDelta = 0;
+    nFeeDelta = 0;
+    poolLoaded.ApplyDeltas(hashMissing, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, -300LL);
+
+    // Loaded transactions pick up their fee delta when they are added back
+    poolLoaded.addUnchecked(vTx[1].first.GetHash(), CTxMemPoolEntry(vTx[1].first, 1000LL, vTx[1].second, 0.0, 1));
+    CTxMemPool::txiter it = poolLoaded.mapTx.find(vTx[1].first.GetHash());
+    BOOST_CHECK_EQUAL(it->GetModifiedFee(), vTx[1].first.GetHash() == txChild.GetHash() ? 1700LL : 1000LL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,8 +5,11 @@
 #include "rpcserver.h"
 #include "rpcclient.h"
 
+#include "addressindex.h"
 #include "base58.h"
+#include "main.h"
 #include "netbase.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <boost/algorithm/string.hpp>
@@ -263,4 +266,61 @@ BOOST_AUTO_TEST_CASE(rpc_ban)
     BOOST_CHECK_EQUAL(adr.get_str(), "2001:4d48:ac57:400:cacf:e9ff:fe1d:9c63/128");
 }
 
+BOOST_AUTO_TEST_CASE(rpc_addressindex)
+{
+    uint160 hashBytes = uint160("5b7ba2a1cf4f1ecdcbba0ae3d5bf4acf0f1b5aa6");
+    string strAddress = EncodeDestination(CKeyID(hashBytes));
+    uint256 txidFirst = uint256("dd2888870cdc3f6e92661f6b0829667ee4bb07ed086c44205e726bbf3338f726");
+    uint256 txidSecond = uint256("0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9");
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    vAddressIndex.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 1, 1, txidFirst, 0, false), 5000));
+    vAddressIndex.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 3, 1, txidSecond, 0, true), -5000));
+    vAddressIndex.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, 3, 1, txidSecond, 1, false), 1000));
+    BOOST_CHECK(pblocktree->WriteAddressIndex(vAddressIndex));
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentIndex;
+    vUnspentIndex.push_back(make_pair(CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hashBytes, txidSecond, 1),
+        CAddressUnspentValue(1000, GetScriptForDestination(CKeyID(hashBytes)), 3)));
+    BOOST_CHECK(pblocktree->UpdateAddressUnspentIndex(vUnspentIndex));
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    vSpentIndex.push_back(make_pair(CSpentIndexKey(txidFirst, 0), CSpentIndexValue(txidSecond, 0, 3, 5000, ADDRESS_TYPE_PUBKEYHASH, hashBytes)));
+    BOOST_CHECK(pblocktree->UpdateSpentIndex(vSpentIndex));
+
+    BOOST_CHECK_THROW(CallRPC("getaddressbalance " + strAddress), runtime_error);
+    fAddressIndex = true;
+    fSpentIndex = true;
+
+    // A bare address and the object form give the same answer
+    UniValue r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getaddressbalance " + strAddress));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "balance").get_int64(), 1000);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "received").get_int64(), 6000);
+    BOOST_CHECK_NO_THROW(r = CallRPC("getaddressbalance {\"addresses\":[\"" + strAddress + "\"]}"));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "balance").get_int64(), 1000);
+    BOOST_CHECK_THROW(CallRPC("getaddressbalance {\"addresses\":\"" + strAddress + "\"}"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getaddressbalance {\"addresses\":["), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getaddressbalance not_an_address"), runtime_error);
+
+    BOOST_CHECK_NO_THROW(r = CallRPC("getaddressdeltas " + strAddress));
+    BOOST_CHECK_EQUAL(r.size(), 3U);
+    BOOST_CHECK_NO_THROW(r = CallRPC("getaddressdeltas {\"addresses\":[\"" + strAddress + "\"],\"start\":2,\"end\":3}"));
+    BOOST_CHECK_EQUAL(r.size(), 2U);
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "satoshis").get_int64(), -5000);
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "address").get_str(), strAddress);
+    BOOST_CHECK_THROW(CallRPC("getaddressdeltas {\"addresses\":[\"" + strAddress + "\"],\"start\":3,\"end\":2}"), runtime_error);
+
+    BOOST_CHECK_NO_THROW(r = CallRPC("getaddressutxos " + strAddress));
+    BOOST_CHECK_EQUAL(r.size(), 1U);
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "txid").get_str(), txidSecond.GetHex());
+    BOOST_CHECK_EQUAL(find_value(r[0].get_obj(), "satoshis").get_int64(), 1000);
+
+    BOOST_CHECK_NO_THROW(r = CallRPC("getspentinfo {\"txid\":\"" + txidFirst.GetHex() + "\",\"index\":0}"));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "txid").get_str(), txidSecond.GetHex());
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "height").get_int(), 3);
+    BOOST_CHECK_THROW(CallRPC("getspentinfo {\"txid\":\"" + txidFirst.GetHex() + "\",\"index\":1}"), runtime_error);
+
+    fAddressIndex = false;
+    fSpentIndex = false;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
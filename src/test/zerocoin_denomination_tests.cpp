@@ -69,6 +69,49 @@ BOOST_AUTO_TEST_CASE(denomination_to_value_test)
     BOOST_CHECK_MESSAGE(ZerocoinDenominationToAmount(denomination) == Value, "Wrong Value - should be 0");
 }
 
+BOOST_AUTO_TEST_CASE(block_index_denomination_serialization_test)
+{
+    cout << "Running block_index_denomination_serialization_test...\n";
+
+    // supply serializes like the std::map<CoinDenomination, int64_t> previously stored in the block index
+    std::map<CoinDenomination, int64_t> mapSupply;
+    CZerocoinSupply supply;
+    int64_t nValue = 3;
+    for (auto& denom : zerocoinDenomList) {
+        mapSupply.insert(std::make_pair(denom, nValue));
+        supply.at(denom) = nValue;
+        nValue *= 7;
+    }
+    CDataStream ssMap(SER_DISK, CLIENT_VERSION), ssSupply(SER_DISK, CLIENT_VERSION);
+    ssMap << mapSupply;
+    ssSupply << supply;
+    BOOST_CHECK(ssMap.str() == ssSupply.str());
+
+    CZerocoinSupply supplyRead;
+    ssMap >> supplyRead;
+    for (auto& denom : zerocoinDenomList)
+        BOOST_CHECK_EQUAL(supplyRead.at(denom), mapSupply.at(denom));
+    BOOST_CHECK_THROW(supply.at(ZQ_ERROR), std::out_of_range);
+
+    // minted denominations read from the std::vector format, in any order
+    std::vector<CoinDenomination> vMints = {ZQ_FIFTY, ZQ_ONE, ZQ_FIFTY, ZQ_FIVE_THOUSAND};
+    CDataStream ssVector(SER_DISK, CLIENT_VERSION);
+    ssVector << vMints;
+    CMintDenominations mints;
+    ssVector >> mints;
+    BOOST_CHECK_EQUAL(mints.size(), 4U);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_FIFTY), 2);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_ONE), 1);
+    BOOST_CHECK_EQUAL(mints.count(ZQ_TEN), 0);
+
+    // and are written back in zerocoinDenomList order
+    std::vector<CoinDenomination> vSorted = {ZQ_ONE, ZQ_FIFTY, ZQ_FIFTY, ZQ_FIVE_THOUSAND};
+    CDataStream ssSorted(SER_DISK, CLIENT_VERSION), ssMints(SER_DISK, CLIENT_VERSION);
+    ssSorted << vSorted;
+    ssMints << mints;
+    BOOST_CHECK(ssSorted.str() == ssMints.str());
+}
+
 BOOST_AUTO_TEST_CASE(zerocoin_spend_test241)
 {
     const int nMaxNumberOfSpends = 4;
@@ -525,5 +525,70 @@ BOOST_AUTO_TEST_CASE(deterministic_tests)
     BOOST_CHECK_MESSAGE(hash == uint256("c90c225f2cbdee5ef053b1f9f70053dd83724c58126d0e1b8425b88091d1f73f"), "minting determinism isn't as expected");
 }
 
+BOOST_AUTO_TEST_CASE(witness_cache_tests)
+{
+    SelectParams(CBaseChainParams::UNITTEST);
+    CZerocoinDB* zerocoinDBOld = zerocoinDB;
+    zerocoinDB = new CZerocoinDB(0, true);
+
+    PrivateCoin coin(Params().Zerocoin_Params(), CoinDenomination::ZQ_TEN);
+    PublicCoin pubcoin = coin.getPublicCoin();
+    uint256 hashPubcoin = GetPubCoinHash(pubcoin.getValue());
+
+    // A registered mint is cached until the wallet no longer lists it
+    BOOST_CHECK(!IsWitnessCached(hashPubcoin));
+    AddWitnessToCache(pubcoin);
+    BOOST_CHECK(IsWitnessCached(hashPubcoin));
+    std::set<uint256> setHashPubcoin;
+    setHashPubcoin.insert(hashPubcoin);
+    PruneWitnessCache(setHashPubcoin);
+    BOOST_CHECK(IsWitnessCached(hashPubcoin));
+
+    // Witness progress survives the database round trip
+    CAccumulatorWitnessData data;
+    data.bnPubcoin = pubcoin.getValue();
+    data.denom = CoinDenomination::ZQ_TEN;
+    data.nHeightMintAdded = 1000;
+    data.nHeightAccStart = 1010;
+    data.nMintsAccumulated = 3;
+    data.nHeightNext = 1200;
+    data.hashBlockLast = uint256("c90c225f2cbdee5ef053b1f9f70053dd83724c58126d0e1b8425b88091d1f73f");
+    data.bnWitness = CBigNum(12345);
+    data.nMintsAdded = 7;
+    data.nCheckpointsAdded = 19;
+    data.fOldParams = true;
+    BOOST_CHECK(zerocoinDB->WriteWitnessData(hashPubcoin, data));
+
+    std::map<uint256, CAccumulatorWitnessData> mapWitnessData;
+    BOOST_CHECK(zerocoinDB->LoadWitnessData(mapWitnessData));
+    BOOST_CHECK_EQUAL(mapWitnessData.size(), 1U);
+    const CAccumulatorWitnessData& dataRead = mapWitnessData[hashPubcoin];
+    BOOST_CHECK(dataRead.bnPubcoin == data.bnPubcoin);
+    BOOST_CHECK(dataRead.denom == data.denom);
+    BOOST_CHECK_EQUAL(dataRead.nHeightMintAdded, data.nHeightMintAdded);
+    BOOST_CHECK_EQUAL(dataRead.nHeightAccStart, data.nHeightAccStart);
+    BOOST_CHECK_EQUAL(dataRead.nMintsAccumulated, data.nMintsAccumulated);
+    BOOST_CHECK_EQUAL(dataRead.nHeightNext, data.nHeightNext);
+    BOOST_CHECK(dataRead.hashBlockLast == data.hashBlockLast);
+    BOOST_CHECK(dataRead.bnWitness == data.bnWitness);
+    BOOST_CHECK_EQUAL(dataRead.nMintsAdded, data.nMintsAdded);
+    BOOST_CHECK_EQUAL(dataRead.nCheckpointsAdded, data.nCheckpointsAdded);
+    BOOST_CHECK(dataRead.fOldParams);
+
+    // Pruning a spent mint also erases its stored witness, and loading brings back what is stored
+    PruneWitnessCache(std::set<uint256>());
+    BOOST_CHECK(!IsWitnessCached(hashPubcoin));
+    mapWitnessData.clear();
+    BOOST_CHECK(zerocoinDB->LoadWitnessData(mapWitnessData));
+    BOOST_CHECK(mapWitnessData.empty());
+
+    BOOST_CHECK(zerocoinDB->WriteWitnessData(hashPubcoin, data));
+    BOOST_CHECK(LoadWitnessCache());
+    BOOST_CHECK(IsWitnessCached(hashPubcoin));
+
+    PruneWitnessCache(std::set<uint256>());
+    delete zerocoinDB;
+    zerocoinDB = zerocoinDBOld;
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,9 +7,13 @@
 
 #include "txdb.h"
 
+#include "checkpoints.h"
+#include "checkqueue.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
 #include "random.h"
+#include "ui_interface.h"
 #include "uint256.h"
 #include "accumulators.h"
 
@@ -20,37 +24,112 @@
 using namespace std;
 using namespace libzerocoin;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+static const char DB_COIN = 'C';
+static const char DB_COINS = 'c';
+static const char DB_BEST_BLOCK = 'B';
+
+namespace
+{
+//! The key of a coin record: DB_COIN, the txid and VARINT(n)
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * A DB_COINS record: all the unspent outputs of one transaction, the format
+ * of the coin database before it stored one record per output. It is only
+ * read, to upgrade old databases; see the CCoins format in earlier versions
+ * of coins.h. fCoinStake is in bit 2 of the header code.
+ */
+struct CLegacyCoins {
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+    int nVersion;
+
+    CLegacyCoins() : fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        // version
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        fCoinStake = (nCode & 2) != 0;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 4) != 0;
+        vAvail[1] = (nCode & 8) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+}
+
+void static BatchWriteCoin(CLevelDBBatch& batch, const COutPoint& outpoint, const Coin& coin)
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
+    if (coin.IsSpent())
+        batch.Erase(CoinEntry(&outpoint));
     else
-        batch.Write(make_pair('c', hash), coins);
+        batch.Write(CoinEntry(&outpoint), coin);
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
-    batch.Write('B', hash);
+    batch.Write(DB_BEST_BLOCK, hash);
 }
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256& txid) const
+bool CCoinsViewDB::HaveCoin(const COutPoint& outpoint) const
 {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
@@ -62,7 +141,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoin(batch, it->first, it->second.coin);
             changed++;
         }
         count++;
@@ -72,7 +151,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed coins (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
@@ -135,57 +214,129 @@ bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    uint256 hashPrevTx;
+    bool fFirst = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            ssKey >> entry;
+            if (entry.key == DB_COIN) {
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                Coin coin;
+                ssValue >> coin;
+                // the outputs of a transaction are adjacent in the database
+                if (fFirst || outpoint.hash != hashPrevTx) {
+                    if (!fFirst)
+                        ss << VARINT(0);
+                    ss << outpoint.hash;
+                    ss << VARINT(coin.nHeight * 4 + (coin.fCoinBase ? 2 : 0) + (coin.fCoinStake ? 1 : 0));
+                    stats.nTransactions++;
+                    hashPrevTx = outpoint.hash;
+                    fFirst = false;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                stats.nTransactionOutputs++;
+                ss << VARINT(outpoint.n + 1);
+                ss << coin.out;
+                nTotalAmount += coin.out.nValue;
+                stats.nSerializedSize += slKey.size() + slValue.size();
             }
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!fFirst)
+        ss << VARINT(0);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(leveldb::Slice(&DB_COINS, 1));
+    if (!pcursor->Valid() || pcursor->key().size() == 0 || pcursor->key()[0] != DB_COINS)
+        return true;
+
+    LogPrintf("Upgrading the coin database to one record per output...\n");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    // Each batch erases the records it converts, so an interrupted upgrade
+    // resumes where it stopped on the next start.
+    static const size_t nBatchRecords = 100000;
+    CLevelDBBatch batch;
+    size_t nBatchCount = 0;
+    uint64_t nRecords = 0, nCoins = 0;
+    int nReportDone = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != DB_COINS)
+            break;
+        uint256 txid;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            ssKey >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CLegacyCoins coins;
+            ssValue >> coins;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                const CTxOut& out = coins.vout[i];
+                if (!out.IsNull() && !out.scriptPubKey.IsUnspendable()) {
+                    const COutPoint outpoint(txid, i);
+                    batch.Write(CoinEntry(&outpoint), Coin(out, coins.nHeight, coins.fCoinBase, coins.fCoinStake));
+                    nCoins++;
+                }
+            }
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        batch.Erase(make_pair(DB_COINS, txid));
+        nRecords++;
+
+        // txids are uniformly distributed, so the first byte of the key tells how far along we are
+        int nPercentageDone = (int)(unsigned char)slKey[1] * 100 / 256;
+        if (nPercentageDone >= nReportDone + 10) {
+            nReportDone = nPercentageDone;
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), nPercentageDone);
+            LogPrintf("[%d%%]...", nPercentageDone);
+        }
+
+        if (++nBatchCount >= nBatchRecords) {
+            if (!db.WriteBatch(batch))
+                return error("%s : failed to write coin database upgrade batch", __func__);
+            batch = CLevelDBBatch();
+            nBatchCount = 0;
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s : failed to write coin database upgrade batch", __func__);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s]. Converted %u transactions into %u coins.\n", ShutdownRequested() ? "CANCELLED" : "DONE", nRecords, nCoins);
+    return !ShutdownRequested();
+}
+
+bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxIndex& pos)
 {
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& vect)
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxIndex> >& vect)
 {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+    for (std::vector<std::pair<uint256, CDiskTxIndex> >::const_iterator it = vect.begin(); it != vect.end(); it++)
         batch.Write(make_pair('t', it->first), it->second);
     return WriteBatch(batch);
 }
@@ -239,6 +390,128 @@ bool CBlockTreeDB::AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxP
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('d', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Erase(make_pair('d', it->first));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start, int end)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    if (start > 0)
+        ssKeySet << make_pair('d', CAddressIndexIteratorKey(type, addressHash, start));
+    else
+        ssKeySet << make_pair('d', CAddressIndexIteratorKey(type, addressHash));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey indexKey;
+            ssKey >> chType;
+            if (chType != 'd')
+                break;
+            ssKey >> indexKey;
+            if (indexKey.type != (unsigned int)type || indexKey.hashBytes != addressHash)
+                break;
+            if (end > 0 && indexKey.blockHeight > end)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAmount nValue;
+            ssValue >> nValue;
+            addressIndex.push_back(make_pair(indexKey, nValue));
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressIndexIteratorKey(type, addressHash));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey indexKey;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> indexKey;
+            if (indexKey.type != (unsigned int)type || indexKey.hashBytes != addressHash)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            unspentOutputs.push_back(make_pair(indexKey, value));
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
+
+bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = vect.begin(); it != vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    return Read(make_pair('p', key), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
@@ -263,85 +536,193 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
+namespace {
+/** A raw 'b' record of the block tree, decoded and checked away from the cursor thread */
+struct CBlockIndexRecord {
+    uint256 hash;
+    std::string strValue;
+    CDiskBlockIndex diskindex;
+    std::string strError;
+};
+
+/**
+ * Decode one record on a check queue thread. The hash is taken from the record key, headers are only
+ * re-hashed above nTrustedHeight (the last checkpoint) where a pre-v4 header costs a full HashQuark.
+ * Failures are kept in the record so that they are reported in key order.
+ */
+class CBlockIndexRecordCheck
+{
+private:
+    CBlockIndexRecord* precord;
+    int nTrustedHeight;
+
+public:
+    CBlockIndexRecordCheck() : precord(NULL), nTrustedHeight(0) {}
+    CBlockIndexRecordCheck(CBlockIndexRecord* precordIn, int nTrustedHeightIn) : precord(precordIn), nTrustedHeight(nTrustedHeightIn) {}
+
+    bool operator()()
+    {
+        CBlockIndexRecord& record = *precord;
+        try {
+            CDataStream ssValue(record.strValue.data(), record.strValue.data() + record.strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> record.diskindex;
+        } catch (std::exception& e) {
+            record.strError = strprintf("Deserialize or I/O error - %s", e.what());
+            return true;
+        }
+        std::string().swap(record.strValue);
+
+        if (record.diskindex.nHeight > nTrustedHeight && record.diskindex.GetBlockHash() != record.hash)
+            record.strError = "block hash does not match its index key";
+        else if (record.diskindex.nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(record.hash, record.diskindex.nBits))
+            record.strError = "CheckProofOfWork failed";
+        return true;
+    }
+
+    void swap(CBlockIndexRecordCheck& check)
+    {
+        std::swap(precord, check.precord);
+        std::swap(nTrustedHeight, check.nTrustedHeight);
+    }
+};
+
+/** Decodes batches of records on worker threads that are started once for the whole load */
+class CBlockIndexDecoder
+{
+private:
+    CCheckQueue<CBlockIndexRecordCheck> queue;
+    boost::thread_group threads;
+
+public:
+    CBlockIndexDecoder(size_t nWorkers) : queue(128)
+    {
+        for (size_t i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<CBlockIndexRecordCheck>::Thread, boost::ref(queue)));
+    }
+
+    ~CBlockIndexDecoder()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    //! Decode a batch, the calling thread joins the workers until it is done
+    void Decode(std::vector<CBlockIndexRecord>& vRecords, int nTrustedHeight)
+    {
+        std::vector<CBlockIndexRecordCheck> vChecks;
+        vChecks.reserve(vRecords.size());
+        BOOST_FOREACH (CBlockIndexRecord& record, vRecords)
+            vChecks.push_back(CBlockIndexRecordCheck(&record, nTrustedHeight));
+        CCheckQueueControl<CBlockIndexRecordCheck> control(&queue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+};
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    int64_t nStart = GetTimeMillis();
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
+    const size_t nBatchSize = 16384;
+    const int nTrustedHeight = Checkpoints::GetTotalBlocksEstimate();
+    const size_t nThreads = std::max(nScriptCheckThreads, 1);
+    size_t nLoaded = 0;
+
+    // Load mapBlockIndex: raw records are read from the cursor in batches, decoded by the calling thread
+    // and nThreads - 1 workers, and then linked into mapBlockIndex in key order
+    CBlockIndexDecoder decoder(nThreads - 1);
     uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
+    std::vector<CBlockIndexRecord> vRecords;
+    bool fDone = false;
+    while (!fDone) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any checkpoints that exist before v2 zbtok. The accumulator is invalid for v1 and not used.
-                    if (pindexNew->nHeight > Params().Zerocoin_LastOldParams())
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
 
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
+        vRecords.clear();
+        while (vRecords.size() < nBatchSize) {
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 'b') {
+                    fDone = true; // finished loading block index
+                    break;
                 }
+                vRecords.push_back(CBlockIndexRecord());
+                ssKey >> vRecords.back().hash;
+                leveldb::Slice slValue = pcursor->value();
+                vRecords.back().strValue.assign(slValue.data(), slValue.size());
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            pcursor->Next();
+        }
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+        decoder.Decode(vRecords, nTrustedHeight);
+
+        BOOST_FOREACH (const CBlockIndexRecord& record, vRecords) {
+            const CDiskBlockIndex& diskindex = record.diskindex;
+            if (!record.strError.empty())
+                return error("%s : %s: block %s height %d", __func__, record.strError, record.hash.ToString(), diskindex.nHeight);
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(record.hash);
+            pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+
+            //zerocoin
+            pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+            pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
+            pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
+
+            //Proof Of Stake
+            pindexNew->nMint = diskindex.nMint;
+            pindexNew->nMoneySupply = diskindex.nMoneySupply;
+            pindexNew->nFlags = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->prevoutStake = diskindex.prevoutStake;
+            pindexNew->nStakeTime = diskindex.nStakeTime;
+
+            // ppcoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+            //populate accumulator checksum map in memory
+            if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
+                //Don't load any checkpoints that exist before v2 zbtok. The accumulator is invalid for v1 and not used.
+                if (pindexNew->nHeight > Params().Zerocoin_LastOldParams())
+                    LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+
+                nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
+        nLoaded += vRecords.size();
     }
 
+    LogPrintf("%s : loaded %u block index entries in %dms (%u threads, headers re-hashed above height %d)\n",
+        __func__, nLoaded, GetTimeMillis() - nStart, nThreads, nTrustedHeight);
+
     return true;
 }
 
@@ -462,3 +843,47 @@ bool CZerocoinDB::EraseAccumulatorValue(const uint32_t& nChecksum)
     LogPrint("zero", "%s : checksum:%d\n", __func__, nChecksum);
     return Erase(make_pair('2', nChecksum));
 }
+
+bool CZerocoinDB::WriteWitnessData(const uint256& hashPubcoin, const CAccumulatorWitnessData& data)
+{
+    return Write(make_pair('W', hashPubcoin), data);
+}
+
+bool CZerocoinDB::EraseWitnessData(const uint256& hashPubcoin)
+{
+    return Erase(make_pair('W', hashPubcoin));
+}
+
+bool CZerocoinDB::LoadWitnessData(std::map<uint256, CAccumulatorWitnessData>& mapWitnessData)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('W', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'W')
+                break;
+
+            uint256 hashPubcoin;
+            ssKey >> hashPubcoin;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAccumulatorWitnessData data;
+            ssValue >> data;
+            mapWitnessData[hashPubcoin] = data;
+            pcursor->Next();
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
@@ -15,6 +15,10 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -30,24 +34,45 @@ inline bool AllowFree(double dPriority)
 }
 
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry tracks the in-mempool
+ * transactions that depend on it (its descendants) and that it depends on
+ * (its ancestors), counting itself in both: their number, total size and
+ * total modified fee. These packages are what eviction and block assembly
+ * score transactions by.
  */
 class CTxMemPoolEntry
 {
 private:
     CTransaction tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxSize;       //! ... and avoid recomputing tx size
+    size_t nTxSize;            //!< ... and avoid recomputing tx size
     size_t nTxCost;            //!< ... and avoid recomputing tx cost (also used for GetTxSize())
     size_t nModSize;           //!< ... and modified size for priority
+    CAmount nValueIn;          //!< ... and value in for priority
+    CAmount nZerocoinSpent;    //!< ... and value of the zerocoin spends for block priority, 0 if none
+    size_t nUsageSize;         //!< ... and total memory usage
     int64_t nTime;             //!< Local time when entering the mempool
     double dPriority;          //!< Priority when entering the mempool
     unsigned int nHeight;      //!< Chain height when entering the mempool
-    int64_t sigOpCost;    //!< Total sigop cost
+    int64_t sigOpCost;         //!< Total sigop cost
+    CAmount nFeeDelta;         //!< Fee adjustment from PrioritiseTransaction
+    double dCachedPriority;    //!< Priority at the pool's priority height, with the PrioritiseTransaction delta
+
+    // Descendants of this transaction in the mempool, including itself
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+
+    // Ancestors of this transaction in the mempool, including itself
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -60,13 +85,168 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     const CAmount& GetFee() const { return nFee; }
-    size_t GetTxSize() const;
+    size_t GetTxSize() const { return nTxSize; }
     size_t GetTxCost() const { return nTxCost; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     int64_t GetSigOpCost() const { return sigOpCost; }
+    bool IsZerocoinSpend() const { return nZerocoinSpent > 0; }
+    CAmount GetZerocoinSpent() const { return nZerocoinSpent; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
+    double GetCachedPriority() const { return dCachedPriority; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    /** Adjust the descendant or ancestor package by the given size, fee and count differences */
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+    void UpdateCachedPriority(double dNewPriority) { dCachedPriority = dNewPriority; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state {
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_fee_delta {
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+struct update_cached_priority {
+    update_cached_priority(double _priority) : priority(_priority) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateCachedPriority(priority); }
+
+private:
+    double priority;
+};
+
+/** Extracts the transaction hash of an entry, the primary key of mapTx */
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort by the better of the fee rate of the transaction alone and that of
+ * the transaction with all its descendants, lowest first; ties go to the
+ * newer transaction first. Evicting from the front removes the packages
+ * that pay the least per byte.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Compare fee rates without dividing
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+        if (f1 != f2)
+            return f1 < f2;
+        if (a.GetTime() != b.GetTime())
+            return a.GetTime() > b.GetTime();
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
+
+    /** Whether the descendant package pays a higher fee rate than the transaction alone */
+    bool UseDescendantScore(const CTxMemPoolEntry& a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** Sort by the time transactions entered the mempool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/**
+ * Sort by the fee rate of the transaction together with all its unconfirmed
+ * ancestors, highest first: the order in which a block can take them.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 != f2)
+            return f1 > f2;
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort by cached priority, highest first: the order of the priority part
+ * of a block.
+ */
+class CompareTxMemPoolEntryByPriority
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (a.GetCachedPriority() != b.GetCachedPriority())
+            return a.GetCachedPriority() > b.GetCachedPriority();
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }
 };
 
+// Multi_index tag names
+struct descendant_score {};
+struct entry_time {};
+struct ancestor_score {};
+struct priority_score {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -99,6 +279,23 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index that sorts the entries by
+ * - txid
+ * - descendant score (see CompareTxMemPoolEntryByDescendantScore), used
+ *   by TrimToSize to evict the least valuable packages when the pool
+ *   outgrows -maxmempool
+ * - entry time, used by Expire to drop transactions older than
+ *   -mempoolexpiry
+ * - ancestor score (see CompareTxMemPoolEntryByAncestorFee), the order in
+ *   which block assembly can consider them
+ * - priority at the height of the next block (see UpdatePriorities), the
+ *   order of the priority part of a block; zerocoin spends, whose priority
+ *   grows with the time they have waited, are kept in front
+ *
+ * mapLinks holds the in-mempool parents and children of every entry, from
+ * which the ancestor and descendant packages are kept up to date as
+ * transactions are added and removed.
  */
 class CTxMemPool
 {
@@ -109,26 +306,110 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of the dynamic memory usage of all entries and their links
+
+    unsigned int nPriorityHeight; //! height the cached priorities of the entries are computed for
+
+    // Minimum fee rate for new transactions after the pool was trimmed, decaying over time
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate;
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    /** Time for the rolling minimum fee to halve once the pool is no longer full */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime>,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee>,
+            // sorted by priority
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<priority_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByPriority> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add or remove entry from the descendant packages of setAncestors */
+    void UpdateAncestorsOf(bool add, txiter entry, const setEntries& setAncestors);
+    /** Set the ancestor package of entry from setAncestors */
+    void UpdateEntryForAncestors(txiter entry, const setEntries& setAncestors);
+    /**
+     * Link a transaction that was just added to in-mempool children it
+     * already has, which happens when a block is disconnected, and rebuild
+     * the packages this joins.
+     */
+    void UpdateForAddedChildren(txiter entry, const setEntries& setAncestors);
+    void RecalculateDescendantState(txiter entry);
+    void RecalculateAncestorState(txiter entry);
+    /** Priority of entry at nPriorityHeight plus its PrioritiseTransaction delta, the key of the priority index */
+    double CalculateCachedPriority(const CTxMemPoolEntry& entry) const;
+    /** Erase a single entry whose links and packages are already taken care of */
+    void removeUnchecked(txiter entry, std::list<CTransaction>& removed);
+
+public:
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
     /**
      * If sanity-checking is turned on, check makes sure the pool is
      * consistent (does not contain two transactions that spend the same inputs,
-     * all inputs are in the mapNextTx array). If sanity-checking is turned off,
-     * check does nothing.
+     * all inputs are in the mapNextTx array, ancestor and descendant packages
+     * match the links). If sanity-checking is turned off, check does nothing.
      */
     void check(const CCoinsViewCache* pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * addUnchecked must update the packages of all ancestors of the new entry;
+     * when the caller has already computed them with CalculateMemPoolAncestors
+     * it can pass them in to avoid doing so twice.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, setEntries& setAncestors);
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
@@ -136,7 +417,7 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void getTransactions(std::set<uint256>& setTxid);
-    void pruneSpent(const uint256& hash, CCoins& coins);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
@@ -145,6 +426,51 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Re-key the priority index for a block at nHeight. Coin age priority
+     * grows by a different amount per block for every transaction, so the
+     * index is in order for one height only; this is a no-op until the
+     * height changes, i.e. it re-sorts once per new tip, not per template.
+     */
+    void UpdatePriorities(unsigned int nHeight);
+
+    /**
+     * Remove a set of transactions, updating the packages of the ancestors
+     * and descendants that stay in the pool. Callers removing a transaction
+     * together with its descendants must include them in stage.
+     */
+    void RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed);
+
+    /**
+     * Find all in-mempool ancestors of entry. With fSearchForParents, entry
+     * need not be in the pool yet and its parents are looked up from its
+     * inputs; otherwise the stored links are used.
+     * Fails with errString set if entry would have more than limitAncestorCount
+     * ancestors or limitAncestorSize bytes of them, or give any of them more
+     * than limitDescendantCount descendants or limitDescendantSize bytes of them.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const;
+
+    /** Add entry and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * The minimum fee rate to get into the pool, which is non-zero after
+     * TrimToSize had to evict transactions and halves every
+     * ROLLING_FEE_HALFLIFE (faster while the pool is well below sizelimit)
+     * once a block has been connected.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Evict the packages with the lowest descendant score until the pool uses at most sizelimit bytes */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove transactions that entered the pool before time, with their descendants. Returns the number removed */
+    int Expire(int64_t time);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -164,6 +490,9 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    /** Estimated heap memory used by the pool, which -maxmempool limits */
+    size_t DynamicMemoryUsage() const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
@@ -173,6 +502,14 @@ public:
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
+
+    /**
+     * Write/Read the pool contents to disk, for mempool.dat. Reading returns
+     * the transactions with the time they entered the pool, to be revalidated
+     * by the caller, and merges the stored prioritisation into mapDeltas.
+     */
+    bool WriteMempool(CAutoFile& fileout) const;
+    bool ReadMempool(CAutoFile& filein, std::vector<std::pair<CTransaction, int64_t> >& vTx);
 };
 
 /** 
@@ -186,8 +523,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
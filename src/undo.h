@@ -6,55 +6,65 @@
 #ifndef BITCOIN_UNDO_H
 #define BITCOIN_UNDO_H
 
+#include "coins.h"
 #include "compressor.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "serialize.h"
 
 /** Undo information for a CTxIn
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version)
+ *  Contains the prevout's CTxOut being spent and the metadata of its
+ *  transaction (coinbase, coinstake, height). Undo data used to carry the
+ *  metadata, and the transaction version after it, only with the last spent
+ *  output of a transaction, marking the others with height 0; a zero version
+ *  is still written so that old and new undo data read alike.
  */
-class CTxInUndo
+class TxInUndoSerializer
 {
-public:
-    CTxOut txout;   // the txout data before being spent
-    bool fCoinBase; // if the outpoint was the last unspent: whether it belonged to a coinbase
-    bool fCoinStake;
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
+    const Coin* pcoin;
 
-    CTxInUndo() : txout(), fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
-    CTxInUndo(const CTxOut& txoutIn, bool fCoinBaseIn = false, bool fCoinStakeIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn), nVersion(nVersionIn) {}
+public:
+    TxInUndoSerializer(const Coin* pcoinIn) : pcoin(pcoinIn) {}
 
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
-        return ::GetSerializeSize(VARINT(nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0)), nType, nVersion) +
-               (nHeight > 0 ? ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion) : 0) +
-               ::GetSerializeSize(CTxOutCompressor(REF(txout)), nType, nVersion);
+        return ::GetSerializeSize(VARINT(pcoin->nHeight * 4 + (pcoin->fCoinBase ? 2 : 0) + (pcoin->fCoinStake ? 1 : 0)), nType, nVersion) +
+               (pcoin->nHeight > 0 ? ::GetSerializeSize(VARINT(0), nType, nVersion) : 0) +
+               ::GetSerializeSize(CTxOutCompressor(REF(pcoin->out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const
     {
-        ::Serialize(s, VARINT(nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0)), nType, nVersion);
-        if (nHeight > 0)
-            ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Serialize(s, CTxOutCompressor(REF(txout)), nType, nVersion);
+        ::Serialize(s, VARINT(pcoin->nHeight * 4 + (pcoin->fCoinBase ? 2 : 0) + (pcoin->fCoinStake ? 1 : 0)), nType, nVersion);
+        if (pcoin->nHeight > 0)
+            ::Serialize(s, VARINT(0), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(pcoin->out)), nType, nVersion);
     }
+};
+
+class TxInUndoDeserializer
+{
+    Coin* pcoin;
+
+public:
+    TxInUndoDeserializer(Coin* pcoinIn) : pcoin(pcoinIn) {}
 
     template <typename Stream>
     void Unserialize(Stream& s, int nType, int nVersion)
     {
         unsigned int nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        nHeight = nCode >> 2;
-        fCoinBase = nCode & 2;
-        fCoinStake = nCode & 1;
-        if (nHeight > 0)
-            ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))), nType, nVersion);
+        pcoin->nHeight = nCode >> 2;
+        pcoin->fCoinBase = nCode & 2;
+        pcoin->fCoinStake = nCode & 1;
+        if (pcoin->nHeight > 0) {
+            // the transaction version, no longer kept
+            int nVersionDummy;
+            ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        }
+        ::Unserialize(s, REF(CTxOutCompressor(REF(pcoin->out))), nType, nVersion);
     }
 };
 
@@ -63,14 +73,36 @@ class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<Coin> vprevout;
 
-    ADD_SERIALIZE_METHODS;
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = GetSizeOfCompactSize(vprevout.size());
+        for (unsigned int i = 0; i < vprevout.size(); i++)
+            nSize += ::GetSerializeSize(TxInUndoSerializer(&vprevout[i]), nType, nVersion);
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, vprevout.size());
+        for (unsigned int i = 0; i < vprevout.size(); i++)
+            ::Serialize(s, TxInUndoSerializer(&vprevout[i]), nType, nVersion);
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
     {
-        READWRITE(vprevout);
+        // a corrupt count must not make the resize huge: no block fits more inputs than this
+        uint64_t nCount = ReadCompactSize(s);
+        if (nCount > MAX_BLOCK_SIZE_CURRENT / ::GetSerializeSize(CTxIn(), nType, nVersion))
+            throw std::ios_base::failure("Too many input undo records");
+        vprevout.resize(nCount);
+        for (unsigned int i = 0; i < vprevout.size(); i++) {
+            TxInUndoDeserializer deserializer(&vprevout[i]);
+            ::Unserialize(s, deserializer, nType, nVersion);
+        }
     }
 };
 
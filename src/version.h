@@ -12,7 +12,7 @@
  * network protocol versioning
  * Forked from Tfinch work
  */
-static const int PROTOCOL_VERSION = 72010;
+static const int PROTOCOL_VERSION = 72011;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -53,6 +53,9 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" messages are supported starting with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 72011;
+
 //! This is block time 07/21/2019 @ 2:56am (UTC) block 18400
 static const int BLOCK_TIME_TARGET = 1563677813;
 
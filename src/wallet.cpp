@@ -693,6 +693,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        InvalidateStakeCoins();
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -745,6 +746,15 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+void CWallet::InvalidateStakeCoins()
+{
+    AssertLockHeld(cs_wallet);
+    setStakeCoins.clear();
+    nLastStakeSetUpdate = 0;
+    vStakeKernels.clear();
+    hashKernelsTip = 0;
+}
+
 void CWallet::EraseFromWallet(const uint256& hash)
 {
     if (!fFileBacked)
@@ -753,6 +763,7 @@ void CWallet::EraseFromWallet(const uint256& hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        InvalidateStakeCoins();
     }
     return;
 }
@@ -2908,22 +2919,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance > 0 && nBalance <= nReserveBalance)
         return false;
 
-    // presstab HyperStake - Initialize as static and don't update the set on every run of CreateCoinStake() in order to lighten resource use
-    static std::set<pair<const CWalletTx*, unsigned int> > setStakeCoins;
-    static int nLastStakeSetUpdate = 0;
-
-    if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
-        setStakeCoins.clear();
-        if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
-            return false;
-
-        nLastStakeSetUpdate = GetTime();
-    }
-
-    if (setStakeCoins.empty())
-        return false;
-
-    vector<const CWalletTx*> vwtxPrev;
+    vector<CTransaction> vwtxPrev;
 
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
@@ -2933,87 +2929,137 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() <= chainActive.Tip()->nTime)
         MilliSleep(10000);
 
-    BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = NULL;
-        BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
-        if (it != mapBlockIndex.end())
-            pindex = it->second;
-        else {
-            if (fDebug)
-                LogPrintf("CreateCoinStake() failed to find block index \n");
-            continue;
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        // presstab HyperStake - Keep the set between runs of CreateCoinStake() and don't update it on every run in order to lighten resource use
+        if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
+            InvalidateStakeCoins();
+            if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
+                return false;
+
+            nLastStakeSetUpdate = GetTime();
         }
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+        if (setStakeCoins.empty())
+            return false;
 
-        uint256 hashProofOfStake = 0;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        nTxNewTime = GetAdjustedTime();
+        // Stake modifiers, block times and targets of the stake coins only change with the tip, so they are
+        // computed once per tip and searching a coin is then only hashing
+        if (hashKernelsTip != chainActive.Tip()->GetBlockHash() || nKernelsBits != nBits) {
+            vStakeKernels.clear();
+            vStakeKernels.reserve(setStakeCoins.size());
+            BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
+                BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
+                if (it == mapBlockIndex.end()) {
+                    if (fDebug)
+                        LogPrintf("CreateCoinStake() failed to find block index \n");
+                    continue;
+                }
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (CheckStakeKernelHash(nBits, block, *pcoin.first, prevoutStake, nTxNewTime, nHashDrift, false, hashProofOfStake, true)) {
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
+                CStakeKernel kernel;
+                COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+                if (!kernel.SetKernel(nBits, it->second, prevoutStake, pcoin.first->vout[pcoin.second].nValue)) {
+                    LogPrintf("CreateCoinStake() : failed to get kernel stake modifier \n");
+                    continue;
+                }
+                vStakeKernels.push_back(make_pair(pcoin, kernel));
             }
 
-            // Found a kernel
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : kernel found\n");
+            hashKernelsTip = chainActive.Tip()->GetBlockHash();
+            nKernelsBits = nBits;
+        }
+    }
 
-            vector<valtype> vSolutions;
-            txnouttype whichType;
-            CScript scriptPubKeyOut;
-            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-            if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
-                LogPrintf("CreateCoinStake : failed to parse kernel\n");
+    bool fHashed = false;
+    int nHeightStart = chainActive.Height();
+    {
+        LOCK(cs_wallet);
+        for (const auto& stakeKernel : vStakeKernels) {
+            //new block came in, move on
+            if (chainActive.Height() != nHeightStart)
                 break;
-            }
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH && whichType != TX_WITNESS_V0_KEYHASH) {
+
+            const pair<const CWalletTx*, unsigned int>& pcoin = stakeKernel.first;
+            const CStakeKernel& kernel = stakeKernel.second;
+            nTxNewTime = GetAdjustedTime();
+
+            //make sure that enough time has elapsed between the coin and the stake
+            if (nTxNewTime < kernel.nTimeBlockFrom || kernel.nTimeBlockFrom + StakeMinAgev2() > nTxNewTime)
+                continue;
+
+            //iterates the hash drift of this utxo inside of Search()
+            uint256 hashProofOfStake = 0;
+            fHashed = true;
+            if (kernel.Search(nTxNewTime, nHashDrift, hashProofOfStake)) {
+                //Double check that this will pass time requirements
+                if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+                    LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+                    continue;
+                }
+
+                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake", false))
-                    LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                break; // only support pay to public key and pay to address
-            }
-            if (whichType == TX_PUBKEYHASH) // pay to address type
-            {
-                //convert to pay to public key type
-                CKey key;
-                if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
+                    LogPrintf("CreateCoinStake : kernel found\n");
+
+                vector<valtype> vSolutions;
+                txnouttype whichType;
+                CScript scriptPubKeyOut;
+                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+                if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
+                    LogPrintf("CreateCoinStake : failed to parse kernel\n");
+                    break;
+                }
+                if (fDebug && GetBoolArg("-printcoinstake", false))
+                    LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH && whichType != TX_WITNESS_V0_KEYHASH) {
                     if (fDebug && GetBoolArg("-printcoinstake", false))
-                        LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                    break; // unable to find corresponding public key
+                        LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+                    break; // only support pay to public key and pay to address
                 }
+                if (whichType == TX_PUBKEYHASH) // pay to address type
+                {
+                    //convert to pay to public key type
+                    CKey key;
+                    if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
+                        if (fDebug && GetBoolArg("-printcoinstake", false))
+                            LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                        break; // unable to find corresponding public key
+                    }
 
-                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-            } else
-                scriptPubKeyOut = scriptPubKeyKernel;
+                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+                } else
+                    scriptPubKeyOut = scriptPubKeyKernel;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
-            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+                nCredit += pcoin.first->vout[pcoin.second].nValue;
+                vwtxPrev.push_back(*pcoin.first);
+                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-            //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
-            const CBlockIndex* pIndex0 = chainActive.Tip();
-            uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
+                //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
+                const CBlockIndex* pIndex0 = chainActive.Tip();
+                uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
 
-            //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
-            if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+                //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
+                if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
+                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
-            fKernelFound = true;
-            break;
+                if (fDebug && GetBoolArg("-printcoinstake", false))
+                    LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
+                fKernelFound = true;
+                break;
+            }
+            if (fKernelFound)
+                break; // if kernel is found stop searching
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
     }
+
+    //store a time stamp of when we last hashed on this block
+    if (fHashed) {
+        mapHashedBlocks.clear();
+        mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime();
+    }
+
     if (!fKernelFound)
         return false;
 
@@ -3055,13 +3101,16 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     // Sign
     int nIn = 0;
-    BOOST_FOREACH (const CWalletTx* pcoin, vwtxPrev) {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL))
+    BOOST_FOREACH (const CTransaction& txPrev, vwtxPrev) {
+        if (!SignSignature(*this, txPrev, txNew, nIn++, SIGHASH_ALL))
             return error("CreateCoinStake : failed to sign coinstake");
     }
 
     // Successfully generated coinstake
-    nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
+    {
+        LOCK(cs_wallet);
+        nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
+    }
     return true;
 }
 
@@ -5380,6 +5429,35 @@ bool CWallet::GetMint(const uint256& hashSerial, CZerocoinMint& mint)
     return true;
 }
 
+// Keep the accumulator witnesses of the unspent mints up to date so that spending them does not need a chain walk
+void CWallet::CacheZerocoinWitnesses()
+{
+    std::set<uint256> setUnspent;
+    {
+        LOCK(cs_wallet);
+        if (!zbtokTracker)
+            return;
+
+        std::set<CMintMeta> setMints = zbtokTracker->ListMints(true, true, false);
+        for (const CMintMeta& meta : setMints) {
+            setUnspent.insert(meta.hashPubcoin);
+            if (IsWitnessCached(meta.hashPubcoin))
+                continue;
+
+            CZerocoinMint mint;
+            if (!GetMint(meta.hashSerial, mint))
+                continue;
+
+            bool isV1Coin = mint.GetVersion() < libzerocoin::PrivateCoin::PUBKEY_VERSION;
+            libzerocoin::ZerocoinParams* paramsCoin = isV1Coin ? Params().Zerocoin_Params() : Params().OldZerocoin_Params();
+            AddWitnessToCache(libzerocoin::PublicCoin(paramsCoin, mint.GetValue(), mint.GetDenomination()));
+        }
+    }
+
+    PruneWitnessCache(setUnspent);
+    UpdateWitnessCache();
+}
+
 
 bool CWallet::IsMyMint(const CBigNum& bnValue) const
 {
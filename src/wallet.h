@@ -204,6 +204,18 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Stake coins and their kernels for one tip and target, cached across CreateCoinStake calls.
+     * They point into mapWallet, so they are guarded by cs_wallet and dropped whenever a wallet
+     * transaction is added, updated or erased.
+     */
+    std::set<std::pair<const CWalletTx*, unsigned int> > setStakeCoins;
+    int64_t nLastStakeSetUpdate;
+    std::vector<std::pair<std::pair<const CWalletTx*, unsigned int>, CStakeKernel> > vStakeKernels;
+    uint256 hashKernelsTip;
+    unsigned int nKernelsBits;
+    void InvalidateStakeCoins();
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const;
@@ -230,6 +242,7 @@ public:
     bool GetZerocoinKey(const CBigNum& bnSerial, CKey& key);
     bool CreateZBTOKOutput(libzerocoin::CoinDenomination denomination, CTxOut& outMint, CDeterministicMint& dMint);
     bool GetMint(const uint256& hashSerial, CZerocoinMint& mint);
+    void CacheZerocoinWitnesses();
     bool GetMintFromStakeHash(const uint256& hashStake, CZerocoinMint& mint);
     bool DatabaseMint(CDeterministicMint& dMint);
     bool SetMintUnspent(const CBigNum& bnSerial);
@@ -320,6 +333,9 @@ public:
         nStakeSplitThreshold = 500;
         nHashInterval = 22;
         nStakeSetUpdateTime = 300; // 5 minutes
+        nLastStakeSetUpdate = 0;
+        hashKernelsTip = 0;
+        nKernelsBits = 0;
 
         //MultiSend
         vMultiSend.clear();